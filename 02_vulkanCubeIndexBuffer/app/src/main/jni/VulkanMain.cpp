@@ -47,7 +47,6 @@ bool InitVulkan(android_app* app) {
 
   auto surf = std::make_shared<RenderSurface>();
   surf->mVertexCount = 8;
-  surf->mInstanceCount = 12;
   surf->mIndexCount = 36;
   surf->mItemSize = 3;
 
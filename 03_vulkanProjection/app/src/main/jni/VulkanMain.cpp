@@ -49,24 +49,16 @@ bool InitVulkan(android_app* app) {
       0, 5, 4,  0, 3, 5
   };
 
-  struct UniformBufferObject {
-    Matrix4x4f mvpMtx;
-  };
-
   gSurf->mVertexCount = 8;
-  gSurf->mInstanceCount = 12;
   gSurf->mIndexCount = 36;
   gSurf->mItemSize = 3;
+  // The mvp matrix is all it needs, push it instead of a uniform buffer.
+  gSurf->mPushTransform = true;
 
   gRenderer.CreateVertexBuffer(vertexData, gSurf);
   gRenderer.CreateIndexBuffer(indexData, gSurf);
-  gRenderer.CreateUniformBuffer(sizeof(UniformBufferObject), gSurf);
-
-  // CreateDescriptorSetLayout needs to be after CreateTextureFromFile and CreateUniformBuffer
-  gRenderer.CreateDescriptorSetLayout(gSurf);
   gRenderer.CreateGraphicsPipeline("shaders/uniform.vert.spv",
                                    "shaders/uniform.frag.spv", gSurf);
-  gRenderer.CreateDescriptorSet(sizeof(UniformBufferObject), gSurf);
   gSurf->mTransformMatrix.Translate(0, 0, -10);
 
   gRenderer.AddSurface(gSurf);
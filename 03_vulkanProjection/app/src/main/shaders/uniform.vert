@@ -2,10 +2,10 @@
 #extension GL_ARB_separate_shader_objects : enable
 
 layout(location = 0) in vec3 pos;
-layout(binding = 0) uniform UniformBufferObject {
+layout(push_constant) uniform PushConstants {
    mat4 mvpMtx;
-} ubo;
+} pushConstants;
 
 void main() {
-   gl_Position = ubo.mvpMtx * vec4(pos.xyz, 1.0);
+   gl_Position = pushConstants.mvpMtx * vec4(pos.xyz, 1.0);
 }
\ No newline at end of file
@@ -31,15 +31,25 @@ bool InitVulkan(android_app* app) {
 
   gRenderer.CreateVertexBuffer(gSurf->GetVertexData(), gSurf);
   gRenderer.CreateIndexBuffer(gSurf->GetIndexData(), gSurf);
-  gRenderer.CreateUniformBuffer(sizeof(UniformBufferObject), gSurf);
-  gRenderer.CreateTextureFromFile("assets/textures/crate01_color_height_rgba.ktx", gSurf);
-
-  // CreateDescriptorSetLayout needs to be after CreateTextureFromFile and CreateUniformBuffer
-  gRenderer.CreateDescriptorSetLayout(gSurf);
-  // Call DescriptorSetLayout must before CreateGraphicsPipeline
-  gRenderer.CreateGraphicsPipeline("shaders/texture.vert.spv",
-                                   "shaders/texture.frag.spv", gSurf);
-  gRenderer.CreateDescriptorSet(sizeof(UniformBufferObject), gSurf);
+  if (gRenderer.HasTextureTable()) {
+    // The texture is a slot of the texture table and the mvp matrix is pushed,
+    // the surface needs no descriptor set.
+    gSurf->mPushTransform = true;
+    gSurf->mUseTextureTable = true;
+    gRenderer.CreateTextureFromFile("assets/textures/crate01_color_height_rgba.ktx", gSurf);
+    gRenderer.CreateGraphicsPipeline("shaders/texture_table.vert.spv",
+                                     "shaders/texture_table.frag.spv", gSurf);
+  } else {
+    gRenderer.CreateUniformBuffer(sizeof(UniformBufferObject), gSurf);
+    gRenderer.CreateTextureFromFile("assets/textures/crate01_color_height_rgba.ktx", gSurf);
+
+    // CreateDescriptorSetLayout needs to be after CreateTextureFromFile and CreateUniformBuffer
+    gRenderer.CreateDescriptorSetLayout(gSurf);
+    // Call DescriptorSetLayout must before CreateGraphicsPipeline
+    gRenderer.CreateGraphicsPipeline("shaders/texture.vert.spv",
+                                     "shaders/texture.frag.spv", gSurf);
+    gRenderer.CreateDescriptorSet(sizeof(UniformBufferObject), gSurf);
+  }
   gSurf->mTransformMatrix.Translate(0, 0, -15);
 
   gRenderer.AddSurface(gSurf);
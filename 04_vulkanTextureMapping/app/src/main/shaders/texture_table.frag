@@ -0,0 +1,17 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_EXT_nonuniform_qualifier : enable
+
+layout(location = 0) in vec4 fragColor;
+layout(location = 1) in vec2 fragTexCoord;
+// The texture table of the renderer, indexed with the slots of the surface.
+layout(set = 0, binding = 0) uniform sampler2D textures[];
+layout(push_constant) uniform PushConstants {
+   layout(offset = 64) uint textureSlots[4];
+} pushConstants;
+
+layout(location = 0) out vec4 outColor;
+
+void main() {
+    outColor = texture(textures[pushConstants.textureSlots[0]], fragTexCoord) * fragColor;
+}
\ No newline at end of file
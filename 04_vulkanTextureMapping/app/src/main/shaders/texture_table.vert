@@ -0,0 +1,19 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+layout(location = 0) in vec3 pos;
+layout(location = 1) in vec4 color;
+layout(location = 2) in vec3 normal;
+layout(location = 3) in vec2 uv;
+layout(push_constant) uniform PushConstants {
+   mat4 mvpMtx;
+} pushConstants;
+
+layout(location = 0) out vec4 fragColor;
+layout(location = 1) out vec2 fragTexCoord;
+
+void main() {
+   gl_Position = pushConstants.mvpMtx * vec4(pos.xyz, 1.0);
+   fragColor = color;
+   fragTexCoord = uv;
+}
\ No newline at end of file
@@ -25,6 +25,9 @@
 
 using namespace tinygltf;
 static const char* kTAG = "05-Vulkan-glTF";
+// constant_id of the specialization constants of the shaders.
+static const uint32_t kHasTextureConstant = 0;
+static const uint32_t kHasTangentConstant = 1;
 
 VulkanRenderer gRenderer;
 std::shared_ptr<RenderSurface> gSurf = std::make_shared<RenderSurface>();
@@ -128,7 +131,6 @@ void SetupMeshState(const tinygltf::Model& model) {
 
         assert(accessorType >= TINYGLTF_TYPE_VEC2 && accessorType <= TINYGLTF_TYPE_VEC4);
         gSurf->mVertexCount = bufferView.byteLength / (sizeof(float) * accessorType);
-        gSurf->mInstanceCount = gSurf->mIndexCount / 3;
         gSurf->mItemSize = 3;  //accessorType; //bufferView.byteStride / 4; //3
         gSurf->mVertexInput = RenderSurface::VertexInputType_Pos3Normal3Tangent4UV2;
         std::vector<float> vertexData(bufferView.byteLength / sizeof(float));
@@ -197,12 +199,38 @@ void SetupMeshState(const tinygltf::Model& model) {
     }
   }
 
+  // glTF requires the min and max of position accessors, they are the
+  // culling bounds of the surface.
+  if (model.meshes.size() && model.meshes[0].primitives.size()) {
+    const auto& attributes = model.meshes[0].primitives[0].attributes;
+    const auto position = attributes.find("POSITION");
+    if (position != attributes.end()) {
+      const auto& accessor = model.accessors[position->second];
+      if (accessor.minValues.size() == 3 && accessor.maxValues.size() == 3) {
+        const float boundsMin[3] = {(float)accessor.minValues[0], (float)accessor.minValues[1],
+                                    (float)accessor.minValues[2]};
+        const float boundsMax[3] = {(float)accessor.maxValues[0], (float)accessor.maxValues[1],
+                                    (float)accessor.maxValues[2]};
+        gSurf->SetBounds(boundsMin, boundsMax);
+      }
+    }
+  }
+
   // create texture
   if (model.images.size()) {
     const Image& image = model.images[0];
     gRenderer.CreateTextureFromBuffer((const char*)image.image.data(), image.width, image.height, image.component,
                                       gSurf);
   }
+
+  // Pick the shader variant matching the mesh.
+  bool hasTangent = false;
+  if (model.meshes.size() && model.meshes[0].primitives.size()) {
+    const auto& attributes = model.meshes[0].primitives[0].attributes;
+    hasTangent = attributes.find("TANGENT") != attributes.end();
+  }
+  gSurf->SetShaderConstant(kHasTextureConstant, !model.images.empty());
+  gSurf->SetShaderConstant(kHasTangentConstant, hasTangent);
 }
 
 bool InitVulkan(android_app* app) {
@@ -275,12 +303,16 @@ bool InitVulkan(android_app* app) {
 
   // CreateDescriptorSetLayout needs to be after CreateTextureFromFilZe and CreateUniformBuffer
   gRenderer.CreateDescriptorSetLayout(gSurf);
-  gRenderer.CreateGraphicsPipeline("shaders/uniform.vert.spv",
-                                   "shaders/uniform.frag.spv", gSurf);
+  // The pipeline compiles on a worker, the mesh shows up once it is ready.
+  gRenderer.CompileGraphicsPipelines({
+    { "shaders/uniform.vert.spv", "shaders/uniform.frag.spv", gSurf },
+  });
   gRenderer.CreateDescriptorSet(sizeof(UniformBufferObject), gSurf);
   gSurf->mTransformMatrix.Translate(0, 0, -10);
 
   gRenderer.AddSurface(gSurf);
+  // Cull the indexed surfaces on the GPU and draw them indirectly.
+  gRenderer.EnableGpuCulling("shaders/cull.comp.spv");
   gRenderer.ConstructRenderPass();
 
   return true;
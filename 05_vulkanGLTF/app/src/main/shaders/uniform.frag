@@ -4,11 +4,17 @@
 layout(location = 0) in vec3 fragColor;
 layout(location = 1) in vec2 fragTexCoord;
 layout(binding = 1) uniform sampler2D texSampler;
+// Specialized by the pipeline, the untaken branch folds away.
+layout(constant_id = 0) const bool kHasTexture = true;
 
 layout (location = 0) out vec4 uFragColor;
 
 void main() {
 //    uFragColor = vec4(1.0, 0.0, 0.0, 1.0);
  //   uFragColor = vec4(fragTexCoord.xy, 1, 1.0);
-    uFragColor = texture(texSampler, fragTexCoord);
+    if (kHasTexture) {
+        uFragColor = texture(texSampler, fragTexCoord);
+    } else {
+        uFragColor = vec4(fragColor, 1.0);
+    }
 }
\ No newline at end of file
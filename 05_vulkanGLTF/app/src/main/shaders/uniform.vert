@@ -10,12 +10,15 @@ layout(binding = 0) uniform UniformBufferObject {
    mat4 mvpMtx;
 } ubo;
 
+// Specialized by the pipeline, meshes without tangents are shaded by normal.
+layout(constant_id = 1) const bool kHasTangent = true;
+
 layout(location = 0) out vec3 fragColor;
 layout(location = 1) out vec2 fragTexCoord;
 
 void main() {
    gl_Position = ubo.mvpMtx * vec4(pos.xyz, 1.0);
-   vec3 v = (tangent.xyz + 1.0) / 2;
+   vec3 v = ((kHasTangent ? tangent.xyz : normal) + 1.0) / 2;
    fragColor = vec3(v.xyz);
    fragTexCoord = uv;
 }
\ No newline at end of file
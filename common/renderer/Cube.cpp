@@ -56,7 +56,6 @@ std::vector<uint16_t> Cube::mCubeIndexData = {
 Cube::Cube() {
   mVertexCount = 24;
   mIndexCount = 36;
-  mInstanceCount = 12;
   mItemSize = 12;
   mVertexInput = VertexInputType_Pos3Color4Normal3UV2;
 }
@@ -2,5 +2,85 @@
 // Created by Daosheng Mu on 12/13/20.
 //
 
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
 #include <utils.h>
 #include "RenderSurface.h"
+
+void RenderSurface::SetBounds(const float aMin[3], const float aMax[3]) {
+  for (int i = 0; i < 3; i++) {
+    mBoundsMin[i] = aMin[i];
+    mBoundsMax[i] = aMax[i];
+  }
+  mHasBounds = true;
+}
+
+void RenderSurface::SetShaderConstant(uint32_t aConstantId, uint32_t aValue) {
+  auto constant = std::lower_bound(mShaderConstants.begin(), mShaderConstants.end(),
+                                   std::make_pair(aConstantId, 0u));
+  if (constant != mShaderConstants.end() && constant->first == aConstantId) {
+    constant->second = aValue;
+  } else {
+    mShaderConstants.insert(constant, std::make_pair(aConstantId, aValue));
+  }
+}
+
+void RenderSurface::ComputeBounds(const std::vector<float>& aVertexData) {
+  if (mItemSize < 3 || aVertexData.size() < 3) {
+    mHasBounds = false;
+    return;
+  }
+
+  const size_t stride = mItemSize;
+  const float* first = aVertexData.data();
+  float boundsMin[3] = {first[0], first[1], first[2]};
+  float boundsMax[3] = {first[0], first[1], first[2]};
+  for (size_t i = stride; i + 3 <= aVertexData.size(); i += stride) {
+    for (int j = 0; j < 3; j++) {
+      boundsMin[j] = std::min(boundsMin[j], aVertexData[i + j]);
+      boundsMax[j] = std::max(boundsMax[j], aVertexData[i + j]);
+    }
+  }
+  SetBounds(boundsMin, boundsMax);
+}
+
+void RenderSurface::ComputeInstanceBounds(const std::vector<float>& aInstanceData) {
+  if (!mHasBounds || mInstanceItemSize < 16) {
+    return;
+  }
+
+  const size_t stride = mInstanceItemSize;
+  for (int j = 0; j < 3; j++) {
+    mInstanceBoundsMin[j] = FLT_MAX;
+    mInstanceBoundsMax[j] = -FLT_MAX;
+  }
+  // Each instance starts with its column-major model matrix.
+  for (size_t i = 0; i + 16 <= aInstanceData.size(); i += stride) {
+    const float* model = &aInstanceData[i];
+    for (int row = 0; row < 3; row++) {
+      float center = model[12 + row];
+      float extent = 0.0f;
+      for (int column = 0; column < 3; column++) {
+        const float element = model[column * 4 + row];
+        center += element * (mBoundsMin[column] + mBoundsMax[column]) * 0.5f;
+        extent += std::fabs(element) * (mBoundsMax[column] - mBoundsMin[column]) * 0.5f;
+      }
+      mInstanceBoundsMin[row] = std::min(mInstanceBoundsMin[row], center - extent);
+      mInstanceBoundsMax[row] = std::max(mInstanceBoundsMax[row], center + extent);
+    }
+  }
+}
+
+bool RenderSurface::GetCullingBounds(float aMin[3], float aMax[3]) const {
+  if (!mHasBounds) {
+    return false;
+  }
+
+  const bool instanced = mBuffer.instanceRange != VulkanGeometryArena::kInvalidRange;
+  for (int i = 0; i < 3; i++) {
+    aMin[i] = instanced ? mInstanceBoundsMin[i] : mBoundsMin[i];
+    aMax[i] = instanced ? mInstanceBoundsMax[i] : mBoundsMax[i];
+  }
+  return true;
+}
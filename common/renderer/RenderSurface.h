@@ -5,12 +5,16 @@
 #ifndef VULKANANDROID_RENDERSURFACE_H
 #define VULKANANDROID_RENDERSURFACE_H
 
+#include <utility>
+#include <vector>
 #include "Matrix4x4.h"
 #include "vulkan_wrapper.h"
+#include "VulkanMemoryAllocator.h"
+#include "VulkanGeometryArena.h"
 
 using namespace gfx_math;
 
-enum ShaderType { VERTEX_SHADER, FRAGMENT_SHADER };
+enum ShaderType { VERTEX_SHADER, FRAGMENT_SHADER, COMPUTE_SHADER };
 
 class RenderSurface {
 
@@ -22,52 +26,93 @@ public:
   };
 
   int mVertexCount = 0;
-  int mInstanceCount = 0; // no. of triangles in a mesh.
+  int mInstanceCount = 1; // no. of instances drawn.
   int mFirstVertex = 0;
   int mFirstInstance = 0;
   int mItemSize = 0;    // no. of items in a vertex. (stride)
+  // no. of items of an instance, its model matrix then vec4s. (stride)
+  int mInstanceItemSize = 0;
   int mIndexCount = 0;
   int mUBOSize = 0;
+  // Pass the mvp matrix with push constants, the surface needs no uniform
+  // buffer or descriptors for it.
+  bool mPushTransform = false;
+  // Sample the textures through the texture table of the renderer, if it
+  // has one. Set it before creating the textures.
+  bool mUseTextureTable = false;
+  int mDrawLayer = 0;   // lower layers are drawn first, ex: a sky box last.
   VertexInputType mVertexInput = VertexInputType_Pos3;
+  // Fixed-function state of the pipeline, surfaces with the same state and
+  // shaders share their pipeline.
+  VkCullModeFlags mCullMode = VK_CULL_MODE_BACK_BIT;
+  VkFrontFace mFrontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+  bool mAlphaBlend = false;
   Matrix4x4f  mTransformMatrix;
+  // Bounding box of the vertex positions in local space, used for frustum
+  // culling. Surfaces without bounds are always drawn.
+  float mBoundsMin[3] = {0.0f, 0.0f, 0.0f};
+  float mBoundsMax[3] = {0.0f, 0.0f, 0.0f};
+  bool mHasBounds = false;
+
+  void SetBounds(const float aMin[3], const float aMax[3]);
+  // Specializes the constant |aConstantId| of the surface shaders, bools are
+  // 0 or 1 and floats pass their bits. Every variant is compiled from the
+  // same SPIR-V, call it before creating the pipeline.
+  void SetShaderConstant(uint32_t aConstantId, uint32_t aValue);
+  // Local bounds of all the instances together, or of the mesh if it isn't
+  // instanced. Returns false if the surface has no bounds.
+  bool GetCullingBounds(float aMin[3], float aMax[3]) const;
 
 private:
+  // Ranges of the shared vertex and index arenas of VulkanRenderer,
+  // one vertex range per vertex stream.
   struct VulkanBufferInfo {
-    std::vector<VkBuffer> vertexBuf;
-    std::vector<VkDeviceMemory> vertexBufMemory;
-    VkBuffer indexBuf = VK_NULL_HANDLE;
-    VkDeviceMemory indexBufMemory = VK_NULL_HANDLE;
+    std::vector<uint32_t> vertexRanges;
+    uint32_t indexRange = VulkanGeometryArena::kInvalidRange;
+    uint32_t instanceRange = VulkanGeometryArena::kInvalidRange;
   };
 
   struct VulkanGfxPipelineInfo {
-    VkPipelineLayout layout;
-    VkPipelineCache cache;
-    VkPipeline pipeline;
+    VkPipelineLayout layout = VK_NULL_HANDLE;
+    VkPipeline pipeline = VK_NULL_HANDLE;
   };
 
   struct VulkanTexture {
     VkSampler      sampler;
     VkImage        image;
     VkImageLayout  imageLayout;
-    VkDeviceMemory deviceMemory;
+    VulkanAllocation deviceMemory;
     VkImageView    view;
     uint32_t       width;
     uint32_t       height;
     uint32_t       mipLevels;
     VkFormat       format;
+    // Slot in the texture table of VulkanRenderer, if there is one.
+    uint32_t       tableSlot = UINT32_MAX;
   };
 
+  // Computes the bounds from the positions at the start of every vertex.
+  void ComputeBounds(const std::vector<float>& aVertexData);
+  // Computes the bounds of the mesh moved by every instance model matrix.
+  void ComputeInstanceBounds(const std::vector<float>& aInstanceData);
+
   // buffer
   std::vector<float> mVertexData;
   std::vector<uint16_t> mIndexData;
-  VulkanBufferInfo mBuffer; // it includes vertex and index buffers.
+  float mInstanceBoundsMin[3] = {0.0f, 0.0f, 0.0f};
+  float mInstanceBoundsMax[3] = {0.0f, 0.0f, 0.0f};
+  VulkanBufferInfo mBuffer; // it includes vertex, index and instance ranges.
   VulkanGfxPipelineInfo mGfxPipeline;
+  // (constant_id, value) pairs sorted by id.
+  std::vector<std::pair<uint32_t, uint32_t>> mShaderConstants;
   VkDescriptorSetLayout mDescriptorSetLayout = VK_NULL_HANDLE;
-  VkDescriptorPool mDescriptorPool;
   std::vector<VkDescriptorSet> mDescriptorSets;
-  std::vector<VkBuffer> mUniformBuffers;
-  std::vector<VkDeviceMemory> mUniformBuffersMemory;
+  // Slice of the uniform arena, and its offset inside every frame region.
+  uint32_t mUBORange = VulkanGeometryArena::kInvalidRange;
+  VkDeviceSize mUBOOffset = 0;
   std::vector<VulkanTexture> mTextures;
+  // Ticket of the upload batch that carries the last data of this surface.
+  uint64_t mUploadTicket = 0;
 
   // material
 
@@ -0,0 +1,275 @@
+#include "VulkanDescriptorAllocator.h"
+
+#include <algorithm>
+#include <cassert>
+#include "Logger.h"
+
+static const char* kTAG = "VulkanDescriptorAllocator";
+
+// Pools start small and double up to the limit, surfaces are added a few at a time.
+static const uint32_t kMinPoolSetCount = 64;
+static const uint32_t kMaxPoolSetCount = 1024;
+
+// Descriptors of each type a pool holds per set.
+static const struct {
+  VkDescriptorType type;
+  uint32_t countPerSet;
+} kPoolRatios[] = {
+  { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 1 },
+  { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 2 },
+  { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1 },
+  { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1 },
+};
+
+static uint64_t HashValue(uint64_t aHash, uint64_t aValue) {
+  // FNV-1a over the bytes of |aValue|.
+  for (uint32_t i = 0; i < sizeof(aValue); i++) {
+    aHash ^= (aValue >> (i * 8)) & 0xff;
+    aHash *= 1099511628211ull;
+  }
+  return aHash;
+}
+
+// Handles are pointers or 64-bit integers depending on the platform.
+template <typename T>
+static uint64_t HandleValue(T aHandle) {
+  return (uint64_t)aHandle;
+}
+
+void VulkanDescriptorAllocator::Init(VkDevice aDevice) {
+  mDevice = aDevice;
+  mPersistentPools = PoolList();
+}
+
+void VulkanDescriptorAllocator::Terminate() {
+  if (mSets.size()) {
+    LOG_W(kTAG, "%u cached descriptor sets are still in use.",
+          static_cast<uint32_t>(mSetHashes.size()));
+  }
+  mSets.clear();
+  mSetHashes.clear();
+  DestroyPools(mPersistentPools);
+  for (const auto& entry : mLayouts) {
+    vkDestroyDescriptorSetLayout(mDevice, entry.layout, nullptr);
+  }
+  mLayouts.clear();
+}
+
+VkDescriptorSetLayout VulkanDescriptorAllocator::GetLayout(
+        const std::vector<VkDescriptorSetLayoutBinding>& aBindings) {
+  for (const auto& entry : mLayouts) {
+    if (entry.bindings.size() != aBindings.size()) {
+      continue;
+    }
+    bool same = true;
+    for (size_t i = 0; i < aBindings.size() && same; i++) {
+      const VkDescriptorSetLayoutBinding& a = entry.bindings[i];
+      const VkDescriptorSetLayoutBinding& b = aBindings[i];
+      same = a.binding == b.binding && a.descriptorType == b.descriptorType &&
+             a.descriptorCount == b.descriptorCount && a.stageFlags == b.stageFlags &&
+             a.pImmutableSamplers == b.pImmutableSamplers;
+    }
+    if (same) {
+      return entry.layout;
+    }
+  }
+
+  VkDescriptorSetLayoutCreateInfo layoutInfo{
+    .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+    .bindingCount = static_cast<uint32_t>(aBindings.size()),
+    .pBindings = aBindings.data(),
+  };
+  LayoutEntry entry;
+  entry.bindings = aBindings;
+  if (vkCreateDescriptorSetLayout(mDevice, &layoutInfo, nullptr, &entry.layout) != VK_SUCCESS) {
+    LOG_E(kTAG, "vkCreateDescriptorSetLayout failed.");
+    assert(false);
+    return VK_NULL_HANDLE;
+  }
+  mLayouts.push_back(entry);
+  return entry.layout;
+}
+
+VkDescriptorSet VulkanDescriptorAllocator::GetPersistentSet(
+        VkDescriptorSetLayout aLayout, const std::vector<ResourceBinding>& aResources) {
+  const uint64_t hash = HashSet(aLayout, aResources);
+  std::vector<SetEntry>& bucket = mSets[hash];
+  for (auto& entry : bucket) {
+    if (IsSameSet(entry, aLayout, aResources)) {
+      ++entry.refCount;
+      return entry.set;
+    }
+  }
+
+  SetEntry entry;
+  entry.layout = aLayout;
+  entry.resources = aResources;
+  entry.refCount = 1;
+  entry.set = Allocate(mPersistentPools, aLayout,
+                       VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT, entry.pool);
+  if (entry.set == VK_NULL_HANDLE) {
+    if (bucket.empty()) {
+      mSets.erase(hash);
+    }
+    return VK_NULL_HANDLE;
+  }
+
+  std::vector<VkWriteDescriptorSet> writes(aResources.size());
+  for (size_t i = 0; i < aResources.size(); i++) {
+    const ResourceBinding& resource = entry.resources[i];
+    const bool isImage = resource.type == VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER ||
+                         resource.type == VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE ||
+                         resource.type == VK_DESCRIPTOR_TYPE_STORAGE_IMAGE ||
+                         resource.type == VK_DESCRIPTOR_TYPE_SAMPLER;
+    writes[i] = {
+      .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+      .dstSet = entry.set,
+      .dstBinding = resource.binding,
+      .dstArrayElement = 0,
+      .descriptorCount = 1,
+      .descriptorType = resource.type,
+      .pImageInfo = isImage ? &resource.imageInfo : nullptr,
+      .pBufferInfo = isImage ? nullptr : &resource.bufferInfo,
+    };
+  }
+  vkUpdateDescriptorSets(mDevice, static_cast<uint32_t>(writes.size()), writes.data(),
+                         0, nullptr);
+
+  bucket.push_back(entry);
+  mSetHashes[entry.set] = hash;
+  return entry.set;
+}
+
+void VulkanDescriptorAllocator::ReleasePersistentSet(VkDescriptorSet aSet) {
+  auto hash = mSetHashes.find(aSet);
+  if (hash == mSetHashes.end()) {
+    LOG_E(kTAG, "Releasing a descriptor set which isn't cached.");
+    assert(false);
+    return;
+  }
+
+  std::vector<SetEntry>& bucket = mSets[hash->second];
+  for (auto entry = bucket.begin(); entry != bucket.end(); ++entry) {
+    if (entry->set != aSet) {
+      continue;
+    }
+    if (--entry->refCount) {
+      return;
+    }
+    vkFreeDescriptorSets(mDevice, entry->pool, 1, &entry->set);
+    bucket.erase(entry);
+    break;
+  }
+  if (bucket.empty()) {
+    mSets.erase(hash->second);
+  }
+  mSetHashes.erase(hash);
+  // The freed space can be reused, try the pools from the first one again.
+  mPersistentPools.current = 0;
+}
+
+VkDescriptorSet VulkanDescriptorAllocator::Allocate(PoolList& aList, VkDescriptorSetLayout aLayout,
+                                                    VkDescriptorPoolCreateFlags aFlags,
+                                                    VkDescriptorPool& aPool) {
+  VkDescriptorSetAllocateInfo allocInfo{
+    .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+    .descriptorSetCount = 1,
+    .pSetLayouts = &aLayout,
+  };
+  VkDescriptorSet set = VK_NULL_HANDLE;
+  // A full or fragmented pool fails the allocation, move on to the next one.
+  for (; aList.current < aList.pools.size(); aList.current++) {
+    allocInfo.descriptorPool = aList.pools[aList.current];
+    if (vkAllocateDescriptorSets(mDevice, &allocInfo, &set) == VK_SUCCESS) {
+      aPool = allocInfo.descriptorPool;
+      return set;
+    }
+  }
+
+  // Every pool is full, grow the list with a larger one.
+  aList.nextSetCount = std::min(std::max(aList.nextSetCount * 2, kMinPoolSetCount),
+                                kMaxPoolSetCount);
+  allocInfo.descriptorPool = CreatePool(aList.nextSetCount, aFlags);
+  if (allocInfo.descriptorPool == VK_NULL_HANDLE) {
+    return VK_NULL_HANDLE;
+  }
+  aList.pools.push_back(allocInfo.descriptorPool);
+  aList.current = static_cast<uint32_t>(aList.pools.size() - 1);
+  if (vkAllocateDescriptorSets(mDevice, &allocInfo, &set) != VK_SUCCESS) {
+    LOG_E(kTAG, "vkAllocateDescriptorSets failed from a new pool.");
+    assert(false);
+    return VK_NULL_HANDLE;
+  }
+  aPool = allocInfo.descriptorPool;
+  return set;
+}
+
+VkDescriptorPool VulkanDescriptorAllocator::CreatePool(uint32_t aSetCount,
+                                                       VkDescriptorPoolCreateFlags aFlags) {
+  std::vector<VkDescriptorPoolSize> poolSizes;
+  for (const auto& ratio : kPoolRatios) {
+    poolSizes.push_back({
+      .type = ratio.type,
+      .descriptorCount = ratio.countPerSet * aSetCount,
+    });
+  }
+
+  VkDescriptorPoolCreateInfo poolInfo{
+    .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+    .flags = aFlags,
+    .maxSets = aSetCount,
+    .poolSizeCount = static_cast<uint32_t>(poolSizes.size()),
+    .pPoolSizes = poolSizes.data(),
+  };
+  VkDescriptorPool pool = VK_NULL_HANDLE;
+  if (vkCreateDescriptorPool(mDevice, &poolInfo, nullptr, &pool) != VK_SUCCESS) {
+    LOG_E(kTAG, "vkCreateDescriptorPool of %u sets failed.", aSetCount);
+    assert(false);
+    return VK_NULL_HANDLE;
+  }
+  return pool;
+}
+
+void VulkanDescriptorAllocator::DestroyPools(PoolList& aList) {
+  for (const auto& pool : aList.pools) {
+    vkDestroyDescriptorPool(mDevice, pool, nullptr);
+  }
+  aList = PoolList();
+}
+
+uint64_t VulkanDescriptorAllocator::HashSet(VkDescriptorSetLayout aLayout,
+                                            const std::vector<ResourceBinding>& aResources) {
+  uint64_t hash = HashValue(14695981039346656037ull, HandleValue(aLayout));
+  for (const auto& resource : aResources) {
+    hash = HashValue(hash, resource.binding);
+    hash = HashValue(hash, resource.type);
+    hash = HashValue(hash, HandleValue(resource.bufferInfo.buffer));
+    hash = HashValue(hash, resource.bufferInfo.offset);
+    hash = HashValue(hash, resource.bufferInfo.range);
+    hash = HashValue(hash, HandleValue(resource.imageInfo.sampler));
+    hash = HashValue(hash, HandleValue(resource.imageInfo.imageView));
+    hash = HashValue(hash, resource.imageInfo.imageLayout);
+  }
+  return hash;
+}
+
+bool VulkanDescriptorAllocator::IsSameSet(const SetEntry& aEntry, VkDescriptorSetLayout aLayout,
+                                          const std::vector<ResourceBinding>& aResources) {
+  if (aEntry.layout != aLayout || aEntry.resources.size() != aResources.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < aResources.size(); i++) {
+    const ResourceBinding& a = aEntry.resources[i];
+    const ResourceBinding& b = aResources[i];
+    if (a.binding != b.binding || a.type != b.type ||
+        a.bufferInfo.buffer != b.bufferInfo.buffer ||
+        a.bufferInfo.offset != b.bufferInfo.offset ||
+        a.bufferInfo.range != b.bufferInfo.range ||
+        a.imageInfo.sampler != b.imageInfo.sampler ||
+        a.imageInfo.imageView != b.imageInfo.imageView ||
+        a.imageInfo.imageLayout != b.imageInfo.imageLayout) {
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,76 @@
+#ifndef VULKANANDROID_VULKANDESCRIPTORALLOCATOR_H
+#define VULKANANDROID_VULKANDESCRIPTORALLOCATOR_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "vulkan_wrapper.h"
+
+// Allocates descriptor sets from growable lists of shared pools instead of
+// one pool per surface. Sets are cached by their layout and the resources
+// they point at, so identical surfaces share a set. They live as long as
+// the command buffers recorded with them, which are only recorded again
+// when the scene changes.
+class VulkanDescriptorAllocator {
+public:
+  // The resource written at |binding|, |bufferInfo| or |imageInfo| depending
+  // on |type|.
+  struct ResourceBinding {
+    uint32_t binding;
+    VkDescriptorType type;
+    VkDescriptorBufferInfo bufferInfo;
+    VkDescriptorImageInfo imageInfo;
+  };
+
+  VulkanDescriptorAllocator() : mDevice(VK_NULL_HANDLE) {}
+  void Init(VkDevice aDevice);
+  void Terminate();
+
+  // Layouts are cached too, the allocator owns them until Terminate().
+  VkDescriptorSetLayout GetLayout(const std::vector<VkDescriptorSetLayoutBinding>& aBindings);
+  // Returns the set of |aLayout| already written with |aResources|, or
+  // allocates and writes a new one. Every call has to be paired with a
+  // ReleasePersistentSet() once the GPU is done with the set.
+  VkDescriptorSet GetPersistentSet(VkDescriptorSetLayout aLayout,
+                                   const std::vector<ResourceBinding>& aResources);
+  void ReleasePersistentSet(VkDescriptorSet aSet);
+
+private:
+  struct PoolList {
+    std::vector<VkDescriptorPool> pools;
+    // Pools before it were full the last time we tried them.
+    uint32_t current = 0;
+    uint32_t nextSetCount = 0;
+  };
+
+  struct LayoutEntry {
+    std::vector<VkDescriptorSetLayoutBinding> bindings;
+    VkDescriptorSetLayout layout;
+  };
+
+  struct SetEntry {
+    VkDescriptorSetLayout layout;
+    std::vector<ResourceBinding> resources;
+    VkDescriptorSet set;
+    VkDescriptorPool pool;
+    uint32_t refCount;
+  };
+
+  VkDescriptorSet Allocate(PoolList& aList, VkDescriptorSetLayout aLayout,
+                           VkDescriptorPoolCreateFlags aFlags, VkDescriptorPool& aPool);
+  VkDescriptorPool CreatePool(uint32_t aSetCount, VkDescriptorPoolCreateFlags aFlags);
+  void DestroyPools(PoolList& aList);
+  static uint64_t HashSet(VkDescriptorSetLayout aLayout,
+                          const std::vector<ResourceBinding>& aResources);
+  static bool IsSameSet(const SetEntry& aEntry, VkDescriptorSetLayout aLayout,
+                        const std::vector<ResourceBinding>& aResources);
+
+  VkDevice mDevice;
+  std::vector<LayoutEntry> mLayouts;
+  PoolList mPersistentPools;
+  // Colliding hashes share a bucket, entries are told apart by a full compare.
+  std::unordered_map<uint64_t, std::vector<SetEntry>> mSets;
+  std::unordered_map<VkDescriptorSet, uint64_t> mSetHashes;
+};
+
+#endif //VULKANANDROID_VULKANDESCRIPTORALLOCATOR_H
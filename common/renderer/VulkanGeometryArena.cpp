@@ -0,0 +1,195 @@
+#include "VulkanGeometryArena.h"
+
+#include <algorithm>
+#include <cassert>
+
+static VkDeviceSize AlignUp(VkDeviceSize aValue, VkDeviceSize aAlignment) {
+  return aAlignment ? (aValue + aAlignment - 1) / aAlignment * aAlignment : aValue;
+}
+
+void VulkanGeometryArena::Init(VkDeviceSize aCapacity) {
+  mCapacity = aCapacity;
+  mUsedSize = 0;
+  mRanges.clear();
+  mFreeRangeIds.clear();
+  mFreeList.assign(1, FreeRange{0, aCapacity});
+}
+
+void VulkanGeometryArena::Terminate() {
+  mCapacity = mUsedSize = 0;
+  mRanges.clear();
+  mFreeRangeIds.clear();
+  mFreeList.clear();
+}
+
+bool VulkanGeometryArena::AllocateSpace(VkDeviceSize aSize, VkDeviceSize aAlignment,
+                                        VkDeviceSize& aOffset) {
+  // First fit, the same policy as the memory blocks of VulkanMemoryAllocator.
+  for (size_t i = 0; i < mFreeList.size(); i++) {
+    FreeRange& range = mFreeList[i];
+    const VkDeviceSize alignedOffset = AlignUp(range.offset, aAlignment);
+    const VkDeviceSize padding = alignedOffset - range.offset;
+    if (range.size < padding + aSize) {
+      continue;
+    }
+
+    const VkDeviceSize remainOffset = alignedOffset + aSize;
+    const VkDeviceSize remainSize = range.size - padding - aSize;
+    if (padding) {
+      range.size = padding;
+      if (remainSize) {
+        mFreeList.insert(mFreeList.begin() + i + 1, FreeRange{remainOffset, remainSize});
+      }
+    } else if (remainSize) {
+      range.offset = remainOffset;
+      range.size = remainSize;
+    } else {
+      mFreeList.erase(mFreeList.begin() + i);
+    }
+
+    mUsedSize += aSize;
+    aOffset = alignedOffset;
+    return true;
+  }
+  return false;
+}
+
+void VulkanGeometryArena::FreeSpace(VkDeviceSize aOffset, VkDeviceSize aSize) {
+  size_t index = 0;
+  while (index < mFreeList.size() && mFreeList[index].offset < aOffset) {
+    ++index;
+  }
+  mFreeList.insert(mFreeList.begin() + index, FreeRange{aOffset, aSize});
+
+  if (index + 1 < mFreeList.size() &&
+      mFreeList[index].offset + mFreeList[index].size == mFreeList[index + 1].offset) {
+    mFreeList[index].size += mFreeList[index + 1].size;
+    mFreeList.erase(mFreeList.begin() + index + 1);
+  }
+  if (index > 0 &&
+      mFreeList[index - 1].offset + mFreeList[index - 1].size == mFreeList[index].offset) {
+    mFreeList[index - 1].size += mFreeList[index].size;
+    mFreeList.erase(mFreeList.begin() + index);
+  }
+  mUsedSize -= aSize;
+}
+
+uint32_t VulkanGeometryArena::Allocate(VkDeviceSize aSize, VkDeviceSize aAlignment) {
+  VkDeviceSize offset = 0;
+  if (!aSize || !AllocateSpace(aSize, aAlignment, offset)) {
+    return kInvalidRange;
+  }
+
+  const Range range = {offset, aSize, aAlignment, true};
+  if (mFreeRangeIds.size()) {
+    const uint32_t id = mFreeRangeIds.back();
+    mFreeRangeIds.pop_back();
+    mRanges[id] = range;
+    return id;
+  }
+  mRanges.push_back(range);
+  return static_cast<uint32_t>(mRanges.size() - 1);
+}
+
+void VulkanGeometryArena::Free(uint32_t aRange) {
+  if (aRange == kInvalidRange) {
+    return;
+  }
+  assert(aRange < mRanges.size() && mRanges[aRange].used);
+  FreeSpace(mRanges[aRange].offset, mRanges[aRange].size);
+  mRanges[aRange].used = false;
+  mFreeRangeIds.push_back(aRange);
+}
+
+VkDeviceSize VulkanGeometryArena::GetOffset(uint32_t aRange) const {
+  assert(aRange < mRanges.size() && mRanges[aRange].used);
+  return mRanges[aRange].offset;
+}
+
+VkDeviceSize VulkanGeometryArena::GetSize(uint32_t aRange) const {
+  assert(aRange < mRanges.size() && mRanges[aRange].used);
+  return mRanges[aRange].size;
+}
+
+bool VulkanGeometryArena::Compact(VkDeviceSize aCapacity, std::vector<VkBufferCopy>& aCopies) {
+  // Move the ranges in their current order, it keeps the copies sequential.
+  std::vector<uint32_t> order;
+  for (uint32_t i = 0; i < mRanges.size(); i++) {
+    if (mRanges[i].used) {
+      order.push_back(i);
+    }
+  }
+  std::sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+    return mRanges[a].offset < mRanges[b].offset;
+  });
+
+  std::vector<VkDeviceSize> offsets(order.size());
+  VkDeviceSize end = 0;
+  for (size_t i = 0; i < order.size(); i++) {
+    const Range& range = mRanges[order[i]];
+    offsets[i] = AlignUp(end, range.alignment);
+    end = offsets[i] + range.size;
+  }
+  if (end > aCapacity) {
+    return false;
+  }
+
+  aCopies.clear();
+  mFreeList.clear();
+  mUsedSize = 0;
+  VkDeviceSize freeOffset = 0;
+  for (size_t i = 0; i < order.size(); i++) {
+    Range& range = mRanges[order[i]];
+    aCopies.push_back({range.offset, offsets[i], range.size});
+    if (offsets[i] > freeOffset) {
+      // Alignment padding between two ranges.
+      mFreeList.push_back(FreeRange{freeOffset, offsets[i] - freeOffset});
+    }
+    range.offset = offsets[i];
+    freeOffset = offsets[i] + range.size;
+    mUsedSize += range.size;
+  }
+  if (aCapacity > freeOffset) {
+    mFreeList.push_back(FreeRange{freeOffset, aCapacity - freeOffset});
+  }
+  mCapacity = aCapacity;
+  return true;
+}
+
+VkDeviceSize VulkanGeometryArena::GetCapacity() const {
+  return mCapacity;
+}
+
+VkDeviceSize VulkanGeometryArena::GetUsedSize() const {
+  return mUsedSize;
+}
+
+bool VulkanGeometryArena::IsPacked() const {
+  // Lay the live ranges out in offset order as Compact() does, only the
+  // padding of their alignment may be left before each of them.
+  std::vector<const Range*> used;
+  for (const auto& range : mRanges) {
+    if (range.used) {
+      used.push_back(&range);
+    }
+  }
+  std::sort(used.begin(), used.end(), [](const Range* a, const Range* b) {
+    return a->offset < b->offset;
+  });
+  VkDeviceSize end = 0;
+  for (const Range* range : used) {
+    if (range->offset != AlignUp(end, range->alignment)) {
+      return false;
+    }
+    end = range->offset + range->size;
+  }
+  return true;
+}
+
+VkDeviceSize VulkanGeometryArena::GetLargestFreeSize() const {
+  VkDeviceSize largest = 0;
+  for (const auto& range : mFreeList) {
+    largest = std::max(largest, range.size);
+  }
+  return largest;
+}
@@ -0,0 +1,58 @@
+#ifndef VULKANANDROID_VULKANGEOMETRYARENA_H
+#define VULKANANDROID_VULKANGEOMETRYARENA_H
+
+#include <cstdint>
+#include <vector>
+#include "vulkan_wrapper.h"
+
+// Hands out ranges of one big vertex or index buffer to many surfaces, so
+// they can be drawn with offsets after a single bind. Surfaces keep a range
+// id instead of an offset, so Compact() can move their data around.
+class VulkanGeometryArena {
+public:
+  VulkanGeometryArena() : mCapacity(0), mUsedSize(0) {}
+  void Init(VkDeviceSize aCapacity);
+  void Terminate();
+  // Returns kInvalidRange if there is no free range large enough.
+  uint32_t Allocate(VkDeviceSize aSize, VkDeviceSize aAlignment);
+  void Free(uint32_t aRange);
+  VkDeviceSize GetOffset(uint32_t aRange) const;
+  VkDeviceSize GetSize(uint32_t aRange) const;
+  // Packs all live ranges from the beginning of a |aCapacity| sized space.
+  // |aCopies| receives the regions moving the data from the old layout to
+  // the new one, which have to be copied into a new buffer.
+  bool Compact(VkDeviceSize aCapacity, std::vector<VkBufferCopy>& aCopies);
+  VkDeviceSize GetCapacity() const;
+  VkDeviceSize GetUsedSize() const;
+  VkDeviceSize GetLargestFreeSize() const;
+  // Whether every live range already sits where Compact() would move it,
+  // the free space left is then alignment padding and the trailing range.
+  bool IsPacked() const;
+
+  static const uint32_t kInvalidRange = UINT32_MAX;
+
+private:
+  struct Range {
+    VkDeviceSize offset;
+    VkDeviceSize size;
+    VkDeviceSize alignment;
+    bool used;
+  };
+
+  struct FreeRange {
+    VkDeviceSize offset;
+    VkDeviceSize size;
+  };
+
+  bool AllocateSpace(VkDeviceSize aSize, VkDeviceSize aAlignment, VkDeviceSize& aOffset);
+  void FreeSpace(VkDeviceSize aOffset, VkDeviceSize aSize);
+
+  VkDeviceSize mCapacity;
+  VkDeviceSize mUsedSize;
+  std::vector<Range> mRanges;
+  std::vector<uint32_t> mFreeRangeIds;
+  // Sorted by offset, adjacent ranges are always coalesced.
+  std::vector<FreeRange> mFreeList;
+};
+
+#endif //VULKANANDROID_VULKANGEOMETRYARENA_H
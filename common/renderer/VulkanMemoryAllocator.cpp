@@ -0,0 +1,264 @@
+#include "VulkanMemoryAllocator.h"
+
+#include <algorithm>
+#include <iterator>
+#include <cassert>
+#include "Logger.h"
+
+static const char* kTAG = "VulkanMemoryAllocator";
+
+// 16 MB is large enough to hold hundreds of glTF primitives per block while
+// staying small relative to the heaps of 3-4 GB phones.
+static const VkDeviceSize kDefaultBlockSize = 16 * 1024 * 1024;
+
+static VkDeviceSize AlignUp(VkDeviceSize aValue, VkDeviceSize aAlignment) {
+  return aAlignment ? (aValue + aAlignment - 1) / aAlignment * aAlignment : aValue;
+}
+
+void VulkanMemoryAllocator::Init(VkDevice aDevice,
+                                 const VkPhysicalDeviceMemoryProperties& aMemoryProperties) {
+  mDevice = aDevice;
+  mMemoryProperties = aMemoryProperties;
+  mDeviceMemoryCount = 0;
+  std::fill(std::begin(mCategoryUsage), std::end(mCategoryUsage), 0);
+  std::fill(std::begin(mHeapAllocatedSize), std::end(mHeapAllocatedSize), 0);
+  mPools.resize(mMemoryProperties.memoryTypeCount * 2);
+
+  for (uint32_t i = 0; i < mPools.size(); i++) {
+    const uint32_t typeIndex = i / 2;
+    const uint32_t heapIndex = mMemoryProperties.memoryTypes[typeIndex].heapIndex;
+    const VkDeviceSize heapSize = mMemoryProperties.memoryHeaps[heapIndex].size;
+    mPools[i].memoryTypeIndex = typeIndex;
+    // Small heaps (ex: the host visible window on some desktop-class GPUs)
+    // shouldn't be eaten by a single block.
+    mPools[i].blockSize = std::min(kDefaultBlockSize, heapSize / 8);
+  }
+}
+
+void VulkanMemoryAllocator::Terminate() {
+  for (auto& pool : mPools) {
+    for (auto& block : pool.blocks) {
+      if (block.memory == VK_NULL_HANDLE) {
+        continue;
+      }
+      if (block.usedSize) {
+        LOG_W(kTAG, "Memory type %u block is freed with %llu bytes in use.",
+              pool.memoryTypeIndex, (unsigned long long)block.usedSize);
+      }
+      FreeDeviceMemory(block.memory, block.size, pool.memoryTypeIndex,
+                       block.mappedData != nullptr);
+    }
+    pool.blocks.clear();
+  }
+  mPools.clear();
+}
+
+bool VulkanMemoryAllocator::IsHostVisible(uint32_t aMemoryTypeIndex) const {
+  return (mMemoryProperties.memoryTypes[aMemoryTypeIndex].propertyFlags &
+          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) != 0;
+}
+
+bool VulkanMemoryAllocator::AllocateDeviceMemory(VkDeviceSize aSize, uint32_t aMemoryTypeIndex,
+                                                 VkDeviceMemory& aMemory, void** aMappedData) {
+  VkMemoryAllocateInfo allocInfo{
+    .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+    .pNext = nullptr,
+    .allocationSize = aSize,
+    .memoryTypeIndex = aMemoryTypeIndex,
+  };
+
+  if (vkAllocateMemory(mDevice, &allocInfo, nullptr, &aMemory) != VK_SUCCESS) {
+    LOG_E(kTAG, "vkAllocateMemory of %llu bytes from memory type %u failed.",
+          (unsigned long long)aSize, aMemoryTypeIndex);
+    return false;
+  }
+  ++mDeviceMemoryCount;
+  mHeapAllocatedSize[mMemoryProperties.memoryTypes[aMemoryTypeIndex].heapIndex] += aSize;
+
+  *aMappedData = nullptr;
+  // A VkDeviceMemory can only be mapped once, and it is shared by many
+  // resources, so host visible memory is mapped for its whole lifetime.
+  if (IsHostVisible(aMemoryTypeIndex) &&
+      vkMapMemory(mDevice, aMemory, 0, VK_WHOLE_SIZE, 0, aMappedData) != VK_SUCCESS) {
+    LOG_E(kTAG, "vkMapMemory of memory type %u failed.", aMemoryTypeIndex);
+    FreeDeviceMemory(aMemory, aSize, aMemoryTypeIndex, false);
+    return false;
+  }
+  return true;
+}
+
+void VulkanMemoryAllocator::FreeDeviceMemory(VkDeviceMemory aMemory, VkDeviceSize aSize,
+                                             uint32_t aMemoryTypeIndex, bool aMapped) {
+  if (aMapped) {
+    vkUnmapMemory(mDevice, aMemory);
+  }
+  vkFreeMemory(mDevice, aMemory, nullptr);
+  --mDeviceMemoryCount;
+  mHeapAllocatedSize[mMemoryProperties.memoryTypes[aMemoryTypeIndex].heapIndex] -= aSize;
+}
+
+bool VulkanMemoryAllocator::AllocateFromBlock(MemoryBlock& aBlock, VkDeviceSize aSize,
+                                              VkDeviceSize aAlignment, VkDeviceSize& aOffset) {
+  // First fit, the free list is sorted by offset so we tend to keep
+  // the allocations packed at the beginning of a block.
+  for (size_t i = 0; i < aBlock.freeList.size(); i++) {
+    FreeRange& range = aBlock.freeList[i];
+    const VkDeviceSize alignedOffset = AlignUp(range.offset, aAlignment);
+    const VkDeviceSize padding = alignedOffset - range.offset;
+    if (range.size < padding + aSize) {
+      continue;
+    }
+
+    const VkDeviceSize remainOffset = alignedOffset + aSize;
+    const VkDeviceSize remainSize = range.size - padding - aSize;
+    if (padding) {
+      // Keep the alignment padding in the free list.
+      range.size = padding;
+      if (remainSize) {
+        aBlock.freeList.insert(aBlock.freeList.begin() + i + 1,
+                               FreeRange{remainOffset, remainSize});
+      }
+    } else if (remainSize) {
+      range.offset = remainOffset;
+      range.size = remainSize;
+    } else {
+      aBlock.freeList.erase(aBlock.freeList.begin() + i);
+    }
+
+    aBlock.usedSize += aSize;
+    aOffset = alignedOffset;
+    return true;
+  }
+  return false;
+}
+
+void VulkanMemoryAllocator::FreeToBlock(MemoryBlock& aBlock, VkDeviceSize aOffset,
+                                        VkDeviceSize aSize) {
+  auto& freeList = aBlock.freeList;
+  size_t index = 0;
+  while (index < freeList.size() && freeList[index].offset < aOffset) {
+    ++index;
+  }
+  freeList.insert(freeList.begin() + index, FreeRange{aOffset, aSize});
+
+  // Merge with the next range.
+  if (index + 1 < freeList.size() &&
+      freeList[index].offset + freeList[index].size == freeList[index + 1].offset) {
+    freeList[index].size += freeList[index + 1].size;
+    freeList.erase(freeList.begin() + index + 1);
+  }
+  // Merge with the previous range.
+  if (index > 0 &&
+      freeList[index - 1].offset + freeList[index - 1].size == freeList[index].offset) {
+    freeList[index - 1].size += freeList[index].size;
+    freeList.erase(freeList.begin() + index);
+  }
+  aBlock.usedSize -= aSize;
+}
+
+bool VulkanMemoryAllocator::Allocate(const VkMemoryRequirements& aRequirements,
+                                     uint32_t aMemoryTypeIndex, bool aLinear,
+                                     MemoryCategory aCategory, VulkanAllocation& aAllocation) {
+  assert(aMemoryTypeIndex < mMemoryProperties.memoryTypeCount);
+  const uint32_t poolIndex = aMemoryTypeIndex * 2 + (aLinear ? 0 : 1);
+  MemoryPool& pool = mPools[poolIndex];
+
+  aAllocation.memoryTypeIndex = aMemoryTypeIndex;
+  aAllocation.category = aCategory;
+  aAllocation.poolIndex = poolIndex;
+  aAllocation.size = aRequirements.size;
+
+  if (aRequirements.size > pool.blockSize / 2) {
+    aAllocation.blockIndex = kDedicatedBlock;
+    aAllocation.offset = 0;
+    if (!AllocateDeviceMemory(aRequirements.size, aMemoryTypeIndex,
+                              aAllocation.memory, &aAllocation.mappedData)) {
+      return false;
+    }
+    mCategoryUsage[aCategory] += aRequirements.size;
+    return true;
+  }
+
+  VkDeviceSize offset = 0;
+  uint32_t blockIndex = 0;
+  for (; blockIndex < pool.blocks.size(); blockIndex++) {
+    MemoryBlock& block = pool.blocks[blockIndex];
+    if (block.memory != VK_NULL_HANDLE &&
+        AllocateFromBlock(block, aRequirements.size, aRequirements.alignment, offset)) {
+      break;
+    }
+  }
+
+  if (blockIndex == pool.blocks.size()) {
+    // No room in the existing blocks, reuse a released slot or append a new one.
+    for (blockIndex = 0; blockIndex < pool.blocks.size(); blockIndex++) {
+      if (pool.blocks[blockIndex].memory == VK_NULL_HANDLE) {
+        break;
+      }
+    }
+    if (blockIndex == pool.blocks.size()) {
+      pool.blocks.push_back(MemoryBlock());
+    }
+
+    MemoryBlock& block = pool.blocks[blockIndex];
+    if (!AllocateDeviceMemory(pool.blockSize, aMemoryTypeIndex, block.memory,
+                              &block.mappedData)) {
+      block.memory = VK_NULL_HANDLE;
+      return false;
+    }
+    block.size = pool.blockSize;
+    block.usedSize = 0;
+    block.freeList.assign(1, FreeRange{0, pool.blockSize});
+    AllocateFromBlock(block, aRequirements.size, aRequirements.alignment, offset);
+  }
+
+  const MemoryBlock& block = pool.blocks[blockIndex];
+  aAllocation.memory = block.memory;
+  aAllocation.offset = offset;
+  aAllocation.blockIndex = blockIndex;
+  aAllocation.mappedData = block.mappedData ?
+                           static_cast<uint8_t*>(block.mappedData) + offset : nullptr;
+  mCategoryUsage[aCategory] += aRequirements.size;
+  return true;
+}
+
+void VulkanMemoryAllocator::Free(VulkanAllocation& aAllocation) {
+  if (aAllocation.memory == VK_NULL_HANDLE) {
+    return;
+  }
+
+  mCategoryUsage[aAllocation.category] -= aAllocation.size;
+  if (aAllocation.blockIndex == kDedicatedBlock) {
+    FreeDeviceMemory(aAllocation.memory, aAllocation.size, aAllocation.memoryTypeIndex,
+                     aAllocation.mappedData != nullptr);
+  } else {
+    assert(aAllocation.poolIndex < mPools.size());
+    MemoryPool& pool = mPools[aAllocation.poolIndex];
+    assert(aAllocation.blockIndex < pool.blocks.size());
+    MemoryBlock& block = pool.blocks[aAllocation.blockIndex];
+    assert(block.memory == aAllocation.memory);
+    FreeToBlock(block, aAllocation.offset, aAllocation.size);
+
+    // Give empty blocks back to the driver, but keep the first one around
+    // to avoid allocating and releasing it again while streaming resources.
+    if (!block.usedSize && aAllocation.blockIndex > 0) {
+      FreeDeviceMemory(block.memory, block.size, pool.memoryTypeIndex,
+                       block.mappedData != nullptr);
+      block = MemoryBlock();
+    }
+  }
+
+  aAllocation = VulkanAllocation();
+}
+
+uint32_t VulkanMemoryAllocator::GetDeviceMemoryCount() const {
+  return mDeviceMemoryCount;
+}
+
+VkDeviceSize VulkanMemoryAllocator::GetCategoryUsage(MemoryCategory aCategory) const {
+  return mCategoryUsage[aCategory];
+}
+
+VkDeviceSize VulkanMemoryAllocator::GetHeapAllocatedSize(uint32_t aHeapIndex) const {
+  return aHeapIndex < VK_MAX_MEMORY_HEAPS ? mHeapAllocatedSize[aHeapIndex] : 0;
+}
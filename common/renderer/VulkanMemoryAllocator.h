@@ -0,0 +1,96 @@
+#ifndef VULKANANDROID_VULKANMEMORYALLOCATOR_H
+#define VULKANANDROID_VULKANMEMORYALLOCATOR_H
+
+#include <cstdint>
+#include <vector>
+#include "vulkan_wrapper.h"
+
+// What an allocation is used for, memory usage is accounted per category.
+enum MemoryCategory {
+  MemoryCategory_Vertex,
+  MemoryCategory_Index,
+  MemoryCategory_Uniform,
+  MemoryCategory_Texture,
+  MemoryCategory_Staging,
+  MemoryCategory_Indirect,
+  MemoryCategory_Swapchain,
+  MemoryCategory_Count
+};
+
+// A piece of device memory handed out by VulkanMemoryAllocator. Resources bind
+// to |memory| at |offset|, and host visible allocations are persistently
+// mapped, so |mappedData| points at the first byte of this allocation.
+struct VulkanAllocation {
+  VkDeviceMemory memory = VK_NULL_HANDLE;
+  VkDeviceSize offset = 0;
+  VkDeviceSize size = 0;
+  void* mappedData = nullptr;
+  uint32_t memoryTypeIndex = 0;
+  MemoryCategory category = MemoryCategory_Vertex;
+  uint32_t poolIndex = 0;
+  uint32_t blockIndex = 0;
+};
+
+// Sub-allocates resources from large VkDeviceMemory blocks per memory type
+// instead of calling vkAllocateMemory once per buffer or image. Linear resources
+// (buffers) and optimal tiled images are kept in separate pools, so we never
+// have to care about bufferImageGranularity between neighbours.
+class VulkanMemoryAllocator {
+public:
+  VulkanMemoryAllocator() : mDevice(VK_NULL_HANDLE), mMemoryProperties() {}
+  void Init(VkDevice aDevice, const VkPhysicalDeviceMemoryProperties& aMemoryProperties);
+  void Terminate();
+  bool Allocate(const VkMemoryRequirements& aRequirements, uint32_t aMemoryTypeIndex,
+                bool aLinear, MemoryCategory aCategory, VulkanAllocation& aAllocation);
+  void Free(VulkanAllocation& aAllocation);
+  uint32_t GetDeviceMemoryCount() const;
+  // Bytes handed out to resources of |aCategory|.
+  VkDeviceSize GetCategoryUsage(MemoryCategory aCategory) const;
+  // Bytes of VkDeviceMemory allocated from |aHeapIndex|, including the free
+  // space of the blocks.
+  VkDeviceSize GetHeapAllocatedSize(uint32_t aHeapIndex) const;
+
+  // Allocations larger than a half block get their own VkDeviceMemory.
+  static const uint32_t kDedicatedBlock = UINT32_MAX;
+
+private:
+  struct FreeRange {
+    VkDeviceSize offset;
+    VkDeviceSize size;
+  };
+
+  struct MemoryBlock {
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize size = 0;
+    VkDeviceSize usedSize = 0;
+    void* mappedData = nullptr;
+    // Sorted by offset, adjacent ranges are always coalesced.
+    std::vector<FreeRange> freeList;
+  };
+
+  struct MemoryPool {
+    uint32_t memoryTypeIndex = 0;
+    VkDeviceSize blockSize = 0;
+    std::vector<MemoryBlock> blocks;
+  };
+
+  bool AllocateDeviceMemory(VkDeviceSize aSize, uint32_t aMemoryTypeIndex,
+                            VkDeviceMemory& aMemory, void** aMappedData);
+  void FreeDeviceMemory(VkDeviceMemory aMemory, VkDeviceSize aSize, uint32_t aMemoryTypeIndex,
+                        bool aMapped);
+  bool AllocateFromBlock(MemoryBlock& aBlock, VkDeviceSize aSize,
+                         VkDeviceSize aAlignment, VkDeviceSize& aOffset);
+  void FreeToBlock(MemoryBlock& aBlock, VkDeviceSize aOffset, VkDeviceSize aSize);
+  bool IsHostVisible(uint32_t aMemoryTypeIndex) const;
+
+  VkDevice mDevice;
+  VkPhysicalDeviceMemoryProperties mMemoryProperties;
+  // Two pools per memory type, [type * 2] for linear and [type * 2 + 1] for
+  // optimal tiled resources.
+  std::vector<MemoryPool> mPools;
+  uint32_t mDeviceMemoryCount = 0;
+  VkDeviceSize mCategoryUsage[MemoryCategory_Count] = {};
+  VkDeviceSize mHeapAllocatedSize[VK_MAX_MEMORY_HEAPS] = {};
+};
+
+#endif //VULKANANDROID_VULKANMEMORYALLOCATOR_H
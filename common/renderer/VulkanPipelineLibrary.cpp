@@ -0,0 +1,126 @@
+#include "VulkanPipelineLibrary.h"
+
+#include <cassert>
+#include "Logger.h"
+
+static const char* kTAG = "VulkanPipelineLibrary";
+
+static uint64_t HashBytes(uint64_t aHash, const void* aData, size_t aSize) {
+  // FNV-1a.
+  const uint8_t* bytes = static_cast<const uint8_t*>(aData);
+  for (size_t i = 0; i < aSize; i++) {
+    aHash ^= bytes[i];
+    aHash *= 1099511628211ull;
+  }
+  return aHash;
+}
+
+template <typename T>
+static uint64_t HashValue(uint64_t aHash, const T& aValue) {
+  return HashBytes(aHash, &aValue, sizeof(aValue));
+}
+
+uint64_t VulkanPipelineKey::Hash() const {
+  uint64_t hash = 14695981039346656037ull;
+  hash = HashBytes(hash, vertexShader.data(), vertexShader.size());
+  hash = HashBytes(hash, fragmentShader.data(), fragmentShader.size());
+  hash = HashValue(hash, vertexInput);
+  hash = HashValue(hash, itemSize);
+  hash = HashValue(hash, instanceItemSize);
+  for (const auto& setLayout : setLayouts) {
+    hash = HashValue(hash, setLayout);
+  }
+  hash = HashValue(hash, pushConstantStages);
+  hash = HashValue(hash, pushConstantSize);
+  hash = HashValue(hash, renderPass);
+  for (const auto& constant : shaderConstants) {
+    hash = HashValue(hash, constant.first);
+    hash = HashValue(hash, constant.second);
+  }
+  hash = HashValue(hash, cullMode);
+  hash = HashValue(hash, frontFace);
+  hash = HashValue(hash, alphaBlend);
+  return hash;
+}
+
+bool VulkanPipelineKey::operator==(const VulkanPipelineKey& aOther) const {
+  return vertexShader == aOther.vertexShader && fragmentShader == aOther.fragmentShader &&
+         vertexInput == aOther.vertexInput && itemSize == aOther.itemSize &&
+         instanceItemSize == aOther.instanceItemSize && setLayouts == aOther.setLayouts &&
+         pushConstantStages == aOther.pushConstantStages &&
+         pushConstantSize == aOther.pushConstantSize && renderPass == aOther.renderPass &&
+         shaderConstants == aOther.shaderConstants &&
+         cullMode == aOther.cullMode && frontFace == aOther.frontFace &&
+         alphaBlend == aOther.alphaBlend;
+}
+
+void VulkanPipelineLibrary::Init(VkDevice aDevice) {
+  mDevice = aDevice;
+}
+
+void VulkanPipelineLibrary::Terminate() {
+  for (const auto& bucket : mEntries) {
+    for (const auto& entry : bucket.second) {
+      vkDestroyPipeline(mDevice, entry.pipeline, nullptr);
+      vkDestroyPipelineLayout(mDevice, entry.layout, nullptr);
+    }
+  }
+  mEntries.clear();
+  mPipelineHashes.clear();
+}
+
+bool VulkanPipelineLibrary::Acquire(const VulkanPipelineKey& aKey, VkPipeline& aPipeline,
+                                    VkPipelineLayout& aLayout) {
+  auto bucket = mEntries.find(aKey.Hash());
+  if (bucket == mEntries.end()) {
+    return false;
+  }
+  for (auto& entry : bucket->second) {
+    if (entry.key == aKey) {
+      ++entry.refCount;
+      aPipeline = entry.pipeline;
+      aLayout = entry.layout;
+      return true;
+    }
+  }
+  return false;
+}
+
+void VulkanPipelineLibrary::Add(const VulkanPipelineKey& aKey, VkPipeline aPipeline,
+                                VkPipelineLayout aLayout) {
+  const uint64_t hash = aKey.Hash();
+  Entry entry = { aKey, aPipeline, aLayout, 1 };
+  mEntries[hash].push_back(entry);
+  mPipelineHashes[aPipeline] = hash;
+}
+
+void VulkanPipelineLibrary::Release(VkPipeline aPipeline) {
+  auto hash = mPipelineHashes.find(aPipeline);
+  if (hash == mPipelineHashes.end()) {
+    LOG_E(kTAG, "Releasing a pipeline which isn't in the library.");
+    assert(false);
+    return;
+  }
+
+  std::vector<Entry>& bucket = mEntries[hash->second];
+  for (auto entry = bucket.begin(); entry != bucket.end(); ++entry) {
+    if (entry->pipeline != aPipeline) {
+      continue;
+    }
+    if (--entry->refCount) {
+      return;
+    }
+    vkDestroyPipeline(mDevice, entry->pipeline, nullptr);
+    vkDestroyPipelineLayout(mDevice, entry->layout, nullptr);
+    bucket.erase(entry);
+    break;
+  }
+  if (bucket.empty()) {
+    mEntries.erase(hash->second);
+  }
+  mPipelineHashes.erase(hash);
+}
+
+uint32_t VulkanPipelineLibrary::GetPipelineCount() const {
+  return static_cast<uint32_t>(mPipelineHashes.size());
+}
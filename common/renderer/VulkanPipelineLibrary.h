@@ -0,0 +1,66 @@
+#ifndef VULKANANDROID_VULKANPIPELINELIBRARY_H
+#define VULKANANDROID_VULKANPIPELINELIBRARY_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "vulkan_wrapper.h"
+
+// Everything a graphics pipeline and its layout are created from. Surfaces
+// with equal keys can draw with the same pipeline.
+struct VulkanPipelineKey {
+  std::string vertexShader;
+  std::string fragmentShader;
+  uint32_t vertexInput = 0;
+  uint32_t itemSize = 0;
+  uint32_t instanceItemSize = 0;
+  // Set layouts of the pipeline layout, in set order.
+  std::vector<VkDescriptorSetLayout> setLayouts;
+  VkShaderStageFlags pushConstantStages = 0;
+  uint32_t pushConstantSize = 0;
+  VkRenderPass renderPass = VK_NULL_HANDLE;
+  // Specialization constants of both shader stages, (constant_id, value)
+  // pairs sorted by id.
+  std::vector<std::pair<uint32_t, uint32_t>> shaderConstants;
+  // Fixed-function state.
+  VkCullModeFlags cullMode = VK_CULL_MODE_BACK_BIT;
+  VkFrontFace frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+  bool alphaBlend = false;
+
+  uint64_t Hash() const;
+  bool operator==(const VulkanPipelineKey& aOther) const;
+};
+
+// Shares the pipelines and their layouts between the surfaces created with
+// the same key, they are destroyed when the last surface releases them.
+class VulkanPipelineLibrary {
+public:
+  VulkanPipelineLibrary() : mDevice(VK_NULL_HANDLE) {}
+  void Init(VkDevice aDevice);
+  // Destroys all the pipelines, the GPU must be done with them.
+  void Terminate();
+
+  // Adds a reference to the pipeline of |aKey| if there is one.
+  bool Acquire(const VulkanPipelineKey& aKey, VkPipeline& aPipeline, VkPipelineLayout& aLayout);
+  // The library takes ownership of |aPipeline| and |aLayout|, with one reference.
+  void Add(const VulkanPipelineKey& aKey, VkPipeline aPipeline, VkPipelineLayout aLayout);
+  void Release(VkPipeline aPipeline);
+  uint32_t GetPipelineCount() const;
+
+private:
+  struct Entry {
+    VulkanPipelineKey key;
+    VkPipeline pipeline;
+    VkPipelineLayout layout;
+    uint32_t refCount;
+  };
+
+  VkDevice mDevice;
+  // Colliding hashes share a bucket, entries are told apart by a full compare.
+  std::unordered_map<uint64_t, std::vector<Entry>> mEntries;
+  std::unordered_map<VkPipeline, uint64_t> mPipelineHashes;
+};
+
+#endif //VULKANANDROID_VULKANPIPELINELIBRARY_H
@@ -8,8 +8,14 @@
 #include <android_native_app_glue.h>
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <filesystem>
+#include <unordered_map>
 #include "ktx.h"
 #include "vulkan_wrapper.h"
 #include "Logger.h"
@@ -18,6 +24,196 @@
 
 static std::string gAppName;
 
+// Every upload is staged through this ring, larger uploads are split into chunks.
+static const VkDeviceSize kStagingRingSize = 8 * 1024 * 1024;
+// Uniform space per swapchain image, 2k surfaces with an MVP matrix at 256 bytes alignment.
+static const VkDeviceSize kUniformArenaFrameSize = 512 * 1024;
+
+// Initial size of the shared geometry arenas, they grow when they are full.
+static const VkDeviceSize kVertexArenaSize = 16 * 1024 * 1024;
+static const VkDeviceSize kIndexArenaSize = 4 * 1024 * 1024;
+// Preferred for static geometry, it lets us skip the staging copy on unified memory.
+static const VkMemoryPropertyFlags kUnifiedMemoryFlags =
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+
+// Recording threads only pay off with enough draws for each of them.
+static const size_t kMinSurfacesPerRecordThread = 64;
+// Matrices are uploaded as they are, this reads them the way the shaders do.
+static float GetMatrixElement(const Matrix4x4f& aMatrix, int aRow, int aColumn) {
+  return reinterpret_cast<const float*>(&aMatrix)[aColumn * 4 + aRow];
+}
+
+// Planes (a, b, c, d) bounding the clip volume of |aViewProj|, a point is
+// inside when a * x + b * y + c * z + d >= 0 for all of them. Vulkan clips
+// z to [0, w] rather than [-w, w].
+static void ExtractFrustumPlanes(const Matrix4x4f& aViewProj, float aPlanes[6][4]) {
+  for (int i = 0; i < 4; i++) {
+    const float row0 = GetMatrixElement(aViewProj, 0, i);
+    const float row1 = GetMatrixElement(aViewProj, 1, i);
+    const float row2 = GetMatrixElement(aViewProj, 2, i);
+    const float row3 = GetMatrixElement(aViewProj, 3, i);
+    aPlanes[0][i] = row3 + row0;
+    aPlanes[1][i] = row3 - row0;
+    aPlanes[2][i] = row3 + row1;
+    aPlanes[3][i] = row3 - row1;
+    aPlanes[4][i] = row2;
+    aPlanes[5][i] = row3 - row2;
+  }
+}
+
+// Moves the local bounds of |aSurf| to world space and tests the box against
+// the planes, as SphereIntersectWithAABBox() does with a sphere.
+static bool IsSurfaceInFrustum(const RenderSurface& aSurf, const float aPlanes[6][4]) {
+  float boundsMin[3];
+  float boundsMax[3];
+  if (!aSurf.GetCullingBounds(boundsMin, boundsMax)) {
+    return true;
+  }
+
+  float center[3];
+  float extent[3];
+  for (int row = 0; row < 3; row++) {
+    center[row] = GetMatrixElement(aSurf.mTransformMatrix, row, 3);
+    extent[row] = 0.0f;
+    for (int column = 0; column < 3; column++) {
+      const float element = GetMatrixElement(aSurf.mTransformMatrix, row, column);
+      center[row] += element * (boundsMin[column] + boundsMax[column]) * 0.5f;
+      extent[row] += std::fabs(element) * (boundsMax[column] - boundsMin[column]) * 0.5f;
+    }
+  }
+
+  for (int i = 0; i < 6; i++) {
+    const float* plane = aPlanes[i];
+    const float distance = plane[0] * center[0] + plane[1] * center[1] +
+                           plane[2] * center[2] + plane[3];
+    const float radius = std::fabs(plane[0]) * extent[0] + std::fabs(plane[1]) * extent[1] +
+                         std::fabs(plane[2]) * extent[2];
+    if (distance + radius < 0.0f) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Bits of the draw sort keys, from the most significant ones: draw layer,
+// pipeline, descriptor set, vertex streams, then depth from front to back.
+static const int kDrawKeyLayerBits = 4;
+static const int kDrawKeyPipelineBits = 12;
+static const int kDrawKeyDescriptorBits = 16;
+static const int kDrawKeyStreamBits = 12;
+static const int kDrawKeyDepthBits = 20;
+
+// Updates a depth-only reorder waits for before it is recorded.
+static const uint32_t kDepthReorderInterval = 30;
+
+static uint64_t PackDrawKey(uint64_t aKey, uint32_t aField, int aBits) {
+  return (aKey << aBits) | (aField & ((1u << aBits) - 1));
+}
+
+// Distance of the surface center along the view direction, quantized to the
+// high bits of its float. Positive floats sort as their bit patterns.
+static uint32_t GetDrawDepth(const RenderSurface& aSurf, const Matrix4x4f& aViewProj) {
+  float center[4] = {0.0f, 0.0f, 0.0f, 1.0f};
+  float boundsMin[3];
+  float boundsMax[3];
+  if (aSurf.GetCullingBounds(boundsMin, boundsMax)) {
+    for (int i = 0; i < 3; i++) {
+      center[i] = (boundsMin[i] + boundsMax[i]) * 0.5f;
+    }
+  }
+
+  // The w of a perspective projection is the view depth.
+  float depth = 0.0f;
+  for (int row = 0; row < 4; row++) {
+    float world = 0.0f;
+    for (int column = 0; column < 4; column++) {
+      world += GetMatrixElement(aSurf.mTransformMatrix, row, column) * center[column];
+    }
+    depth += GetMatrixElement(aViewProj, 3, row) * world;
+  }
+  depth = std::max(depth, 0.0f);
+  uint32_t bits;
+  memcpy(&bits, &depth, sizeof(bits));
+  // The sign bit is always 0.
+  return bits >> (31 - kDrawKeyDepthBits);
+}
+
+// Push constants of the surfaces: the mvp matrix of a pushed transform, then
+// the texture table slots of the surface textures.
+static const uint32_t kPushTextureSlotsOffset = sizeof(Matrix4x4f);
+static const uint32_t kMaxSurfaceTextures = 4;
+static const uint32_t kPushConstantSize =
+        kPushTextureSlotsOffset + kMaxSurfaceTextures * sizeof(uint32_t);
+// Most slots the texture table has, if the device allows them.
+static const uint32_t kTextureTableSize = 1024;
+static const uint32_t kNoTextureSlot = UINT32_MAX;
+
+// First shader location of the per-instance attributes, after the ones of
+// every VertexInputType.
+static const uint32_t kInstanceAttributeLocation = 4;
+// Work group size of the culling compute shader.
+static const uint32_t kCullGroupSize = 64;
+// Initial number of objects of the culling buffers, they grow when they are full.
+static const uint32_t kCullInitialCapacity = 1024;
+static const uint32_t kNoCullObject = UINT32_MAX;
+
+// Storage buffer layouts (std430) of the culling compute shader.
+struct CullHeader {
+  float planes[6][4];
+  uint32_t objectCount;
+  uint32_t padding[3];
+};
+
+struct CullObject {
+  float boundsMin[4];  // w is 1 if the surface has bounds.
+  float boundsMax[4];
+  float transform[16];
+  uint32_t indexCount;
+  uint32_t firstIndex;
+  int32_t vertexOffset;
+  uint32_t firstInstance;
+  uint32_t instanceCount;
+  uint32_t padding[3];
+};
+
+// Dump the GPU memory usage and the recording stats every so many frames,
+// ~10 seconds at 60 fps.
+static const uint32_t kMemoryStatsLogInterval = 600;
+static const char* kMemoryCategoryNames[MemoryCategory_Count] = {
+  "vertex", "index", "uniform", "texture", "staging", "indirect", "swapchain"
+};
+
+// The pipeline cache file is our header followed by the data of
+// vkGetPipelineCacheData(). Drivers don't all validate that data, so it is
+// only given back to the same device and driver, and only if it is intact.
+static const char* kPipelineCacheFileName = "pipeline_cache.bin";
+static const uint32_t kPipelineCacheMagic = 0x43504b56; // "VKPC"
+
+struct PipelineCacheFileHeader {
+  uint32_t magic;
+  uint32_t headerSize;
+  uint32_t vendorID;
+  uint32_t deviceID;
+  uint32_t driverVersion;
+  uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+  uint64_t dataSize;
+  uint64_t dataHash;
+};
+
+static uint64_t HashBytes(const uint8_t* aData, size_t aSize) {
+  // FNV-1a, to detect truncated or corrupted files.
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < aSize; i++) {
+    hash ^= aData[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+static VkDeviceSize AlignUp(VkDeviceSize aValue, VkDeviceSize aAlignment) {
+  return (aValue + aAlignment - 1) / aAlignment * aAlignment;
+}
+
 // Vulkan call wrapper
 #define CALL_VK(func)                                                 \
   if (VK_SUCCESS != (func)) {                                         \
@@ -60,11 +256,15 @@ static VKAPI_ATTR VkBool32 VKAPI_CALL debugReportCallback(
   return VK_FALSE;
 }
 
-const std::vector<VkVertexInputBindingDescription>&
-GetVertexInputBindingDescription(RenderSurface::VertexInputType aType, uint aItemSize) {
+// The per-vertex bindings of |aType|, followed by a per-instance binding if
+// the surface has |aInstanceItemSize| floats of instance data.
+std::vector<VkVertexInputBindingDescription>
+GetVertexInputBindingDescription(RenderSurface::VertexInputType aType, uint aItemSize,
+                                 uint aInstanceItemSize) {
+  std::vector<VkVertexInputBindingDescription> bindings;
   switch (aType) {
     case RenderSurface::VertexInputType_Pos3Normal3Tangent4UV2:
-      const static std::vector<VkVertexInputBindingDescription> vertexInputPos3Normal3Tangent4UV2Bindings({
+      bindings = {
         {
              .binding = 0,
              .stride = 3 * uint32_t(sizeof(float)),
@@ -85,23 +285,37 @@ GetVertexInputBindingDescription(RenderSurface::VertexInputType aType, uint aIte
             .stride = 2 * uint32_t(sizeof(float)),
             .inputRate = VK_VERTEX_INPUT_RATE_VERTEX
         }
-      });
-      return vertexInputPos3Normal3Tangent4UV2Bindings;
+      };
+      break;
 
     default:
-      const static std::vector<VkVertexInputBindingDescription> vertexInputBindings({
+      bindings = {
          {
            .binding = 0,
            .stride = aItemSize * uint32_t(sizeof(float)),
            .inputRate = VK_VERTEX_INPUT_RATE_VERTEX
          }
-      });
-      return vertexInputBindings;
+      };
+      break;
+  }
+
+  if (aInstanceItemSize) {
+    bindings.push_back({
+      .binding = static_cast<uint32_t>(bindings.size()),
+      .stride = aInstanceItemSize * uint32_t(sizeof(float)),
+      .inputRate = VK_VERTEX_INPUT_RATE_INSTANCE
+    });
   }
+  return bindings;
 }
 
-const std::vector<VkVertexInputAttributeDescription>&
-GetVertexInputAttributeDescription(RenderSurface::VertexInputType aType) {
+// The per-vertex attributes of |aType|, followed by the per-instance ones at
+// kInstanceAttributeLocation: the instance model matrix as 4 columns, then
+// the rest of the instance data as vec4s.
+std::vector<VkVertexInputAttributeDescription>
+GetVertexInputAttributeDescription(RenderSurface::VertexInputType aType,
+                                   uint aInstanceItemSize) {
+  std::vector<VkVertexInputAttributeDescription> attributes;
   switch (aType) {
     case RenderSurface::VertexInputType_Pos3:
       const static std::vector<VkVertexInputAttributeDescription> vertexPos = {
@@ -112,7 +326,8 @@ GetVertexInputAttributeDescription(RenderSurface::VertexInputType aType) {
           .offset = 0
         }
       };
-      return vertexPos;
+      attributes = vertexPos;
+      break;
     case RenderSurface::VertexInputType_Pos3Color4Normal3UV2:
       const static std::vector<VkVertexInputAttributeDescription> vertexPosColorNormalUV = {
         {
@@ -140,7 +355,8 @@ GetVertexInputAttributeDescription(RenderSurface::VertexInputType aType) {
           .offset = 10 * sizeof(float)
         }
       };
-      return vertexPosColorNormalUV;
+      attributes = vertexPosColorNormalUV;
+      break;
     case RenderSurface::VertexInputType_Pos3Normal3Tangent4UV2:
       // THIS IS for TinyGLTF!
       // The vertex buffer format in TinyGLTF is multiple binding instead of
@@ -171,13 +387,26 @@ GetVertexInputAttributeDescription(RenderSurface::VertexInputType aType) {
           .offset = 0 * sizeof(float)
         }
       };
-      return vertexPosNormalTangentUV;
+      attributes = vertexPosNormalTangentUV;
+      break;
     default:
-      const static std::vector<VkVertexInputAttributeDescription> undefined;
       LOG_E(gAppName.data(), "Undefined VertexInputType.");
       assert(false);
-      return undefined;
+      return attributes;
+  }
+
+  if (aInstanceItemSize) {
+    const uint32_t binding = attributes.back().binding + 1;
+    for (uint32_t i = 0; i < aInstanceItemSize / 4; i++) {
+      attributes.push_back({
+        .binding = binding,
+        .location = kInstanceAttributeLocation + i,
+        .format = VK_FORMAT_R32G32B32A32_SFLOAT,
+        .offset = i * 4 * uint32_t(sizeof(float))
+      });
+    }
   }
+  return attributes;
 }
 
 void VulkanRenderer::CreateVulkanDevice(ANativeWindow* platformWindow,
@@ -194,6 +423,23 @@ void VulkanRenderer::CreateVulkanDevice(ANativeWindow* platformWindow,
     instance_extensions.push_back(VK_EXT_DEBUG_REPORT_EXTENSION_NAME);
   }
 
+#ifdef VK_KHR_get_physical_device_properties2
+  // Needed to query the heap budget of VK_EXT_memory_budget.
+  bool hasProperties2 = false;
+  uint32_t instanceExtensionCount = 0;
+  vkEnumerateInstanceExtensionProperties(nullptr, &instanceExtensionCount, nullptr);
+  std::vector<VkExtensionProperties> instanceExtensions(instanceExtensionCount);
+  vkEnumerateInstanceExtensionProperties(nullptr, &instanceExtensionCount,
+                                         instanceExtensions.data());
+  for (const auto& extension : instanceExtensions) {
+    if (!strcmp(extension.extensionName, VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME)) {
+      instance_extensions.push_back(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+      hasProperties2 = true;
+      break;
+    }
+  }
+#endif
+
   device_extensions.push_back("VK_KHR_swapchain");
 
   // Create the Vulkan instance
@@ -283,6 +529,98 @@ void VulkanRenderer::CreateVulkanDevice(ANativeWindow* platformWindow,
   assert(queueFamilyIndex < queueFamilyCount);
   mDeviceInfo.queueFamilyIndex = queueFamilyIndex;
 
+  uint32_t deviceExtensionCount = 0;
+  vkEnumerateDeviceExtensionProperties(mDeviceInfo.gpuDevice, nullptr,
+                                       &deviceExtensionCount, nullptr);
+  std::vector<VkExtensionProperties> deviceExtensions(deviceExtensionCount);
+  vkEnumerateDeviceExtensionProperties(mDeviceInfo.gpuDevice, nullptr,
+                                       &deviceExtensionCount, deviceExtensions.data());
+  mDeviceInfo.memoryBudget = false;
+  mDeviceInfo.drawIndirectCount = false;
+  mDeviceInfo.textureTableSize = 0;
+#if defined(VK_KHR_get_physical_device_properties2) && defined(VK_EXT_descriptor_indexing)
+  bool hasDescriptorIndexing = false;
+  bool hasMaintenance3 = false;
+#endif
+  for (const auto& extension : deviceExtensions) {
+#if defined(VK_KHR_get_physical_device_properties2) && defined(VK_EXT_memory_budget)
+    if (hasProperties2 &&
+        !strcmp(extension.extensionName, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME)) {
+      device_extensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+      mDeviceInfo.memoryBudget = true;
+    }
+#endif
+#ifdef VK_KHR_draw_indirect_count
+    if (!strcmp(extension.extensionName, VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME)) {
+      device_extensions.push_back(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+      mDeviceInfo.drawIndirectCount = vkCmdDrawIndexedIndirectCountKHR != nullptr;
+    }
+#endif
+#if defined(VK_KHR_get_physical_device_properties2) && defined(VK_EXT_descriptor_indexing)
+    hasDescriptorIndexing |=
+            !strcmp(extension.extensionName, VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
+    hasMaintenance3 |= !strcmp(extension.extensionName, VK_KHR_MAINTENANCE3_EXTENSION_NAME);
+#endif
+  }
+
+#if defined(VK_KHR_get_physical_device_properties2) && defined(VK_EXT_descriptor_indexing)
+  // The texture table only needs partially bound, update-after-bind arrays
+  // indexed with dynamically uniform slots.
+  VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexingFeatures{
+    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT,
+    .pNext = nullptr,
+  };
+  if (hasProperties2 && hasDescriptorIndexing && hasMaintenance3 &&
+      vkGetPhysicalDeviceFeatures2KHR && vkGetPhysicalDeviceProperties2KHR) {
+    VkPhysicalDeviceFeatures2KHR features2{
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR,
+      .pNext = &indexingFeatures,
+    };
+    vkGetPhysicalDeviceFeatures2KHR(mDeviceInfo.gpuDevice, &features2);
+    if (indexingFeatures.runtimeDescriptorArray &&
+        indexingFeatures.descriptorBindingPartiallyBound &&
+        indexingFeatures.descriptorBindingSampledImageUpdateAfterBind &&
+        indexingFeatures.descriptorBindingUpdateUnusedWhilePending) {
+      VkPhysicalDeviceDescriptorIndexingPropertiesEXT indexingProperties{
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_PROPERTIES_EXT,
+        .pNext = nullptr,
+      };
+      VkPhysicalDeviceProperties2KHR properties2{
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2_KHR,
+        .pNext = &indexingProperties,
+      };
+      vkGetPhysicalDeviceProperties2KHR(mDeviceInfo.gpuDevice, &properties2);
+      mDeviceInfo.textureTableSize = std::min({
+        kTextureTableSize,
+        indexingProperties.maxPerStageDescriptorUpdateAfterBindSamplers,
+        indexingProperties.maxPerStageDescriptorUpdateAfterBindSampledImages,
+        indexingProperties.maxDescriptorSetUpdateAfterBindSamplers,
+        indexingProperties.maxDescriptorSetUpdateAfterBindSampledImages
+      });
+      device_extensions.push_back(VK_KHR_MAINTENANCE3_EXTENSION_NAME);
+      device_extensions.push_back(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
+    }
+  }
+  // Only turn on the indexing features we use.
+  indexingFeatures = {
+    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT,
+    .pNext = nullptr,
+    .descriptorBindingSampledImageUpdateAfterBind = VK_TRUE,
+    .descriptorBindingUpdateUnusedWhilePending = VK_TRUE,
+    .descriptorBindingPartiallyBound = VK_TRUE,
+    .runtimeDescriptorArray = VK_TRUE,
+  };
+#endif
+  LOG_I(gAppName.c_str(), "Memory budget: %s",
+        mDeviceInfo.memoryBudget ? "available" : "unavailable");
+  LOG_I(gAppName.c_str(), "Draw indirect count: %s",
+        mDeviceInfo.drawIndirectCount ? "available" : "unavailable");
+  LOG_I(gAppName.c_str(), "Texture table: %u slots", mDeviceInfo.textureTableSize);
+
+  // Only turn on the optional features we use.
+  VkPhysicalDeviceFeatures enabledFeatures = {};
+  enabledFeatures.samplerAnisotropy = mDeviceInfo.gpuDeviceFeatures.samplerAnisotropy;
+
   // Create a logical device (Vulkan device)
   float priorities[] = {1.0f};
   VkDeviceQueueCreateInfo queueCreateInfo{
@@ -303,8 +641,13 @@ void VulkanRenderer::CreateVulkanDevice(ANativeWindow* platformWindow,
     .ppEnabledLayerNames = nullptr,
     .enabledExtensionCount = static_cast<uint32_t>(device_extensions.size()),
     .ppEnabledExtensionNames = device_extensions.data(),
-    .pEnabledFeatures = nullptr,
+    .pEnabledFeatures = &enabledFeatures,
   };
+#if defined(VK_KHR_get_physical_device_properties2) && defined(VK_EXT_descriptor_indexing)
+  if (mDeviceInfo.textureTableSize) {
+    deviceCreateInfo.pNext = &indexingFeatures;
+  }
+#endif
 
   CALL_VK(vkCreateDevice(mDeviceInfo.gpuDevice, &deviceCreateInfo, nullptr,
                                &mDeviceInfo.device));
@@ -314,9 +657,10 @@ void VulkanRenderer::CreateVulkanDevice(ANativeWindow* platformWindow,
                    &mDeviceInfo.graphicsQueue);
 }
 
-void VulkanRenderer::CreateSwapChain() {
+void VulkanRenderer::CreateSwapChain(VkSwapchainKHR aOldSwapchain) {
   LOG_I(gAppName.c_str(), "CreateSwapChain");
-  memset(&mSwapchain, 0, sizeof(mSwapchain));
+  mSwapchain.swapchain = VK_NULL_HANDLE;
+  mSwapchain.swapchainLength = 0;
 
   // Get the surface capabilities because:
   //   - It contains the minimal and max length of the chain, we will need it
@@ -343,27 +687,76 @@ void VulkanRenderer::CreateSwapChain() {
   }
   assert(chosenFormat < formatCount);
 
+  // Render in the native orientation of the display and rotate in the
+  // projection matrix, otherwise the compositor does an extra rotation pass.
+  // The current extent is in the current orientation, swap it back.
+  mSwapchain.preTransform = surfaceCapabilities.currentTransform;
   mSwapchain.displaySize = surfaceCapabilities.currentExtent;
+  if (mSwapchain.preTransform & (VK_SURFACE_TRANSFORM_ROTATE_90_BIT_KHR |
+                                 VK_SURFACE_TRANSFORM_ROTATE_270_BIT_KHR)) {
+    std::swap(mSwapchain.displaySize.width, mSwapchain.displaySize.height);
+  }
   mSwapchain.displayFormat = formats[chosenFormat].format;
 
-  // Create a swap chain (here we choose the minimum available number of surface
-  // in the chain)
+  // The requested number of images, within the limits of the surface
+  // (a maxImageCount of 0 means there is no limit).
+  uint32_t imageCount = std::max(mSwapchainConfig.imageCount, surfaceCapabilities.minImageCount);
+  if (surfaceCapabilities.maxImageCount) {
+    imageCount = std::min(imageCount, surfaceCapabilities.maxImageCount);
+  }
+
+  // FIFO is the only present mode every device has to support.
+  uint32_t presentModeCount = 0;
+  vkGetPhysicalDeviceSurfacePresentModesKHR(mDeviceInfo.gpuDevice, mDeviceInfo.surface,
+                                            &presentModeCount, nullptr);
+  std::vector<VkPresentModeKHR> presentModes(presentModeCount);
+  vkGetPhysicalDeviceSurfacePresentModesKHR(mDeviceInfo.gpuDevice, mDeviceInfo.surface,
+                                            &presentModeCount, presentModes.data());
+  VkPresentModeKHR presentMode = VK_PRESENT_MODE_FIFO_KHR;
+  if (std::find(presentModes.begin(), presentModes.end(), mSwapchainConfig.presentMode) !=
+      presentModes.end()) {
+    presentMode = mSwapchainConfig.presentMode;
+  } else {
+    LOG_W(gAppName.c_str(), "Present mode %d is unsupported, use FIFO.",
+          mSwapchainConfig.presentMode);
+  }
+
+  VkCompositeAlphaFlagBitsKHR compositeAlpha = mSwapchainConfig.compositeAlpha;
+  if (!(surfaceCapabilities.supportedCompositeAlpha & compositeAlpha)) {
+    const VkCompositeAlphaFlagBitsKHR compositeAlphas[] = {
+      VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
+      VK_COMPOSITE_ALPHA_INHERIT_BIT_KHR,
+      VK_COMPOSITE_ALPHA_PRE_MULTIPLIED_BIT_KHR,
+      VK_COMPOSITE_ALPHA_POST_MULTIPLIED_BIT_KHR,
+    };
+    for (const auto alpha : compositeAlphas) {
+      if (surfaceCapabilities.supportedCompositeAlpha & alpha) {
+        compositeAlpha = alpha;
+        break;
+      }
+    }
+    LOG_W(gAppName.c_str(), "Composite alpha %d is unsupported, use %d.",
+          mSwapchainConfig.compositeAlpha, compositeAlpha);
+  }
+
+  // Create a swap chain, the old one keeps presenting until the new one is ready.
   VkSwapchainCreateInfoKHR swapchainCreateInfo{
     .sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
     .pNext = nullptr,
     .surface = mDeviceInfo.surface,
-    .minImageCount = surfaceCapabilities.minImageCount,
+    .minImageCount = imageCount,
     .imageFormat = formats[chosenFormat].format,
     .imageColorSpace = formats[chosenFormat].colorSpace,
-    .imageExtent = surfaceCapabilities.currentExtent,
+    .imageExtent = mSwapchain.displaySize,
     .imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
-    .preTransform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR,
+    .preTransform = mSwapchain.preTransform,
+    .compositeAlpha = compositeAlpha,
     .imageArrayLayers = 1,
     .imageSharingMode = VK_SHARING_MODE_EXCLUSIVE,
     .queueFamilyIndexCount = 1,
     .pQueueFamilyIndices = &mDeviceInfo.queueFamilyIndex,
-    .presentMode = VK_PRESENT_MODE_FIFO_KHR,
-    .oldSwapchain = VK_NULL_HANDLE,
+    .presentMode = presentMode,
+    .oldSwapchain = aOldSwapchain,
     .clipped = VK_FALSE,
   };
   CALL_VK(vkCreateSwapchainKHR(mDeviceInfo.device, &swapchainCreateInfo, nullptr,
@@ -372,12 +765,85 @@ void VulkanRenderer::CreateSwapChain() {
   // Get the length of the created swap chain
   CALL_VK(vkGetSwapchainImagesKHR(mDeviceInfo.device, mSwapchain.swapchain,
                                         &mSwapchain.swapchainLength, nullptr));
+  LOG_I(gAppName.c_str(), "Swapchain of %u images, present mode %d, composite alpha %d, "
+        "pre-transform %d", mSwapchain.swapchainLength, presentMode, compositeAlpha,
+        mSwapchain.preTransform);
   delete[] formats;
 }
 
-bool VulkanRenderer::Init(android_app* app, const std::string& aAppName) {
+void VulkanRenderer::RecreateSwapChain(const VulkanSwapchainConfig& aConfig) {
+  mSwapchainConfig = aConfig;
+  // The frames in flight are still rendering to the framebuffers.
+  CALL_VK(vkDeviceWaitIdle(mDeviceInfo.device));
+
+  // The command buffers refer to the framebuffers and their number depends
+  // on the swapchain length.
+  const bool recorded = mRenderInfo.cmdBuffer != nullptr;
+  DeleteCommandBuffers();
+  DeleteFrameBuffers();
+  DeleteDepthBuffer();
+  VkSwapchainKHR oldSwapchain = mSwapchain.swapchain;
+  CreateSwapChain(oldSwapchain);
+  vkDestroySwapchainKHR(mDeviceInfo.device, oldSwapchain, nullptr);
+  CreateDepthBuffer();
+  CreateFrameBuffers(mRenderInfo.renderPass, mSwapchain.depthView);
+  UpdateProjectionMatrix();
+
+  // The new command buffers are recorded when their frame is rendered.
+  if (recorded) {
+    CreateCommandBuffer();
+  }
+}
+
+void VulkanRenderer::UpdateProjectionMatrix() {
+  // The aspect ratio is the one of the current orientation.
+  float cosAngle = 1.0f;
+  float sinAngle = 0.0f;
+  float aspect = (float)mSwapchain.displaySize.width / mSwapchain.displaySize.height;
+  switch (mSwapchain.preTransform) {
+    case VK_SURFACE_TRANSFORM_ROTATE_90_BIT_KHR:
+      sinAngle = 1.0f;
+      cosAngle = 0.0f;
+      aspect = 1.0f / aspect;
+      break;
+    case VK_SURFACE_TRANSFORM_ROTATE_180_BIT_KHR:
+      cosAngle = -1.0f;
+      break;
+    case VK_SURFACE_TRANSFORM_ROTATE_270_BIT_KHR:
+      sinAngle = -1.0f;
+      cosAngle = 0.0f;
+      aspect = 1.0f / aspect;
+      break;
+    default:
+      break;
+  }
+
+  mProjMatrix = Matrix4x4f::Perspective(DegreesToRadians(60.0f), aspect, 0.001f, 256.0f);
+  // gfx_math Matrix was originally designed for OpenGL,
+  // where the Y coordinate of the clip coordinates is inverted with Vulkan.
+  mProjMatrix._11 *= -1.0f;
+
+  // Rotate the clip coordinates around Z into the native orientation.
+  if (sinAngle != 0.0f || cosAngle != 1.0f) {
+    Matrix4x4f preRotation;
+    preRotation._00 = cosAngle;
+    preRotation._01 = -sinAngle;
+    preRotation._10 = sinAngle;
+    preRotation._11 = cosAngle;
+    mProjMatrix = preRotation * mProjMatrix;
+  }
+}
+
+bool VulkanRenderer::Init(android_app* app, const std::string& aAppName,
+                          uint32_t aFramesInFlight, const VulkanSwapchainConfig& aSwapchainConfig) {
   mAppContext = app;
   gAppName = aAppName;
+  mSwapchainConfig = aSwapchainConfig;
+  mJobSystem.Init(mRecordThreadCount - 1);
+  // At least one worker, so the pipelines compile while the frames render.
+  mPipelineJobs.Init(std::max(JobSystem::GetDefaultWorkerCount(), 1u));
+  mRenderInfo.frames.resize(std::max(aFramesInFlight, 1u));
+  mRenderInfo.currentFrame = 0;
 
   if (!InitVulkan()) {
     LOG_W(gAppName.c_str(), "Vulkan is unavailable, install vulkan and re-start");
@@ -397,23 +863,60 @@ bool VulkanRenderer::Init(android_app* app, const std::string& aAppName) {
   // create a device
   CreateVulkanDevice(app->window, &appInfo);
 
+  // Buffers and images are sub-allocated from large memory blocks.
+  vkGetPhysicalDeviceMemoryProperties(mDeviceInfo.gpuDevice, &mDeviceInfo.memoryProperties);
+  uint32_t unifiedTypeIndex = 0;
+  mDeviceInfo.unifiedMemory = MapMemoryTypeToIndex(UINT32_MAX,
+          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &unifiedTypeIndex);
+  LOG_I(gAppName.data(), "Unified memory type: %s",
+        mDeviceInfo.unifiedMemory ? "available" : "unavailable");
+  mAllocator.Init(mDeviceInfo.device, mDeviceInfo.memoryProperties);
+  CreateUploadContext();
+  mDescriptorAllocator.Init(mDeviceInfo.device);
+  CreatePipelineCache();
+  mPipelineLibrary.Init(mDeviceInfo.device);
+  mShaderCache.Init(mDeviceInfo.device, mAppContext->activity->assetManager);
+  CreateGeometryBuffer(mVertexGeometry, kVertexArenaSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                       MemoryCategory_Vertex);
+  CreateGeometryBuffer(mIndexGeometry, kIndexArenaSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+                       MemoryCategory_Index);
+  CreateTextureTable();
+
   // create swapchain
   CreateSwapChain();
+  CreateUniformArena();
 
-  // create a render pass
-  VkAttachmentDescription attachmentDescriptions{
-    .format = mSwapchain.displayFormat,
-    .samples = VK_SAMPLE_COUNT_1_BIT,
-    .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
-    .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
-    .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
-    .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
-    .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-    .finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+  // create a render pass, the depth is cleared and never stored so tilers
+  // keep it on chip.
+  mSwapchain.depthFormat = GetDepthFormat();
+  VkAttachmentDescription attachmentDescriptions[2] = {
+    {
+      .format = mSwapchain.displayFormat,
+      .samples = VK_SAMPLE_COUNT_1_BIT,
+      .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+      .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+      .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+      .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+      .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+      .finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+    },
+    {
+      .format = mSwapchain.depthFormat,
+      .samples = VK_SAMPLE_COUNT_1_BIT,
+      .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+      .storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+      .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+      .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+      .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+      .finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+    },
   };
 
   VkAttachmentReference colourReference = {
     .attachment = 0, .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL};
+  VkAttachmentReference depthReference = {
+    .attachment = 1, .layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL};
 
   VkSubpassDescription subpassDescription{
     .pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
@@ -423,87 +926,70 @@ bool VulkanRenderer::Init(android_app* app, const std::string& aAppName) {
     .colorAttachmentCount = 1,
     .pColorAttachments = &colourReference,
     .pResolveAttachments = nullptr,
-    .pDepthStencilAttachment = nullptr,
+    .pDepthStencilAttachment = &depthReference,
     .preserveAttachmentCount = 0,
     .pPreserveAttachments = nullptr,
   };
+  // The frames in flight share the depth image, the clear of a frame waits
+  // for the depth tests of the previous one.
+  VkSubpassDependency depthDependency{
+    .srcSubpass = VK_SUBPASS_EXTERNAL,
+    .dstSubpass = 0,
+    .srcStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+                    VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+    .dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+                    VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+    .srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+                     VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+    .dependencyFlags = 0,
+  };
   VkRenderPassCreateInfo renderPassCreateInfo{
     .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
     .pNext = nullptr,
-    .attachmentCount = 1,
-    .pAttachments = &attachmentDescriptions,
+    .attachmentCount = 2,
+    .pAttachments = attachmentDescriptions,
     .subpassCount = 1,
     .pSubpasses = &subpassDescription,
-    .dependencyCount = 0,
-    .pDependencies = nullptr,
+    .dependencyCount = 1,
+    .pDependencies = &depthDependency,
   };
   CALL_VK(vkCreateRenderPass(mDeviceInfo.device, &renderPassCreateInfo, nullptr,
                                    &mRenderInfo.renderPass));
 
   // Create double frame buffers.
-  CreateFrameBuffers(mRenderInfo.renderPass);
+  CreateDepthBuffer();
+  CreateFrameBuffers(mRenderInfo.renderPass, mSwapchain.depthView);
   CreateCommandPool();
 
   // Setup view and projection matrix.
   mViewMatrix = Matrix4x4f::LookAtMatrix(Vector3Df(0,0,-5),
                                     Vector3Df(0,0,-100), Vector3Df(0, 1, 0));
-  mProjMatrix = Matrix4x4f::Perspective(DegreesToRadians(60.0f), (float)mSwapchain.displaySize.width / mSwapchain.displaySize.height,
-                                       0.001f, 256.0f);
-  // gfx_math Matrix was originally designed for OpenGL,
-  // where the Y coordinate of the clip coordinates is inverted with Vulkan.
-  mProjMatrix._11 *= -1.0f;
+  UpdateProjectionMatrix();
   mInitialized = true;
   return true;
 }
 
 bool VulkanRenderer::MapMemoryTypeToIndex(uint32_t typeBits, VkFlags requirements_mask,
-                                          uint32_t* typeIndex) {
-  VkPhysicalDeviceMemoryProperties memoryProperties;
-  vkGetPhysicalDeviceMemoryProperties(mDeviceInfo.gpuDevice, &memoryProperties);
-  // Search memtypes to find first index with those properties
-  for (uint32_t i = 0; i < 32; i++) {
-    if ((typeBits & 1) == 1) {
+                                          uint32_t* typeIndex, VkFlags preferred_mask) {
+  const VkPhysicalDeviceMemoryProperties& memoryProperties = mDeviceInfo.memoryProperties;
+  // Try the preferred properties first, and fall back to the required ones.
+  const VkFlags masks[] = { requirements_mask | preferred_mask, requirements_mask };
+  for (const VkFlags mask : masks) {
+    // Search memtypes to find first index with those properties, types are
+    // ordered by the driver from the most to the least performant.
+    for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++) {
       // Type is available, does it match user properties?
-      if ((memoryProperties.memoryTypes[i].propertyFlags & requirements_mask) ==
-          requirements_mask) {
+      if ((typeBits & (1u << i)) &&
+          (memoryProperties.memoryTypes[i].propertyFlags & mask) == mask) {
         *typeIndex = i;
         return true;
       }
     }
-    typeBits >>= 1;
   }
   return false;
 }
 
-VkResult VulkanRenderer::LoadShaderFromFile(const char* filePath, VkShaderModule* shaderOut,
-                                            ShaderType type) {
-  // Read the file
-  assert(mAppContext);
-  AAsset* file = AAssetManager_open(mAppContext->activity->assetManager,
-                                    filePath, AASSET_MODE_BUFFER);
-  size_t fileLength = AAsset_getLength(file);
-  assert(fileLength);
-  char* fileContent = new char[fileLength];
-
-  AAsset_read(file, fileContent, fileLength);
-  AAsset_close(file);
-
-  VkShaderModuleCreateInfo shaderModuleCreateInfo{
-    .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
-    .pNext = nullptr,
-    .codeSize = fileLength,
-    .pCode = (const uint32_t*)fileContent,
-    .flags = 0,
-  };
-  VkResult result = vkCreateShaderModule(mDeviceInfo.device,
-                                         &shaderModuleCreateInfo,
-                                         nullptr, shaderOut);
-  assert(result == VK_SUCCESS);
-  delete[] fileContent;
-
-  return result;
-}
-
 void VulkanRenderer::SetImageLayout(VkCommandBuffer cmdBuffer, VkImage image,
                                     VkImageLayout oldImageLayout, VkImageLayout newImageLayout,
                                     VkPipelineStageFlags srcStages,
@@ -570,21 +1056,22 @@ void VulkanRenderer::SetupPhysicalDeviceFeatures(const VkPhysicalDeviceFeatures&
   mDeviceInfo.gpuDeviceFeatures.samplerAnisotropy = aFeatures.samplerAnisotropy;
 }
 
-void VulkanRenderer::UpdateUniformBuffer(int aImageIndex) {
-  for (const auto& surf : mSurfaces) {
+void VulkanRenderer::UpdateUniformBuffer(uint32_t aFrameIndex) {
+  uint8_t* frameData = static_cast<uint8_t*>(mUniformArena.memory.mappedData) +
+                       aFrameIndex * mUniformArena.frameSize;
+  // Culled surfaces aren't drawn, their uniforms can wait.
+  for (const uint32_t surfIndex : mDrawList) {
+    const auto& surf = mSurfaces[surfIndex];
     if (!surf->mUBOSize) {
       continue;
     }
 
-    void* data;
-    vkMapMemory(mDeviceInfo.device, surf->mUniformBuffersMemory[aImageIndex], 0, surf->mUBOSize, 0, &data);
-
     Matrix4x4f mvpMtx;
     mvpMtx = mProjMatrix * mViewMatrix * surf->mTransformMatrix;
 
-    // TODO: support other uniform data, we currently only has the requirement of the MVP mtx.
-    memcpy(data, &mvpMtx, surf->mUBOSize);
-    vkUnmapMemory(mDeviceInfo.device, surf->mUniformBuffersMemory[aImageIndex]);
+    // The mvp matrix is at the start of the slice, the rest is left as it is.
+    memcpy(frameData + surf->mUBOOffset, &mvpMtx,
+           std::min<VkDeviceSize>(sizeof(mvpMtx), surf->mUBOSize));
   }
 }
 
@@ -663,76 +1150,191 @@ void VulkanRenderer::CreateFrameBuffers(VkRenderPass& renderPass,
   }
 }
 
+VkFormat VulkanRenderer::GetDepthFormat() const {
+  // Tilers keep the depth on chip, the smallest format is good enough.
+  const VkFormat formats[] = {
+    VK_FORMAT_D24_UNORM_S8_UINT, VK_FORMAT_D32_SFLOAT, VK_FORMAT_D16_UNORM,
+  };
+  for (VkFormat format : formats) {
+    VkFormatProperties formatProperties;
+    vkGetPhysicalDeviceFormatProperties(mDeviceInfo.gpuDevice, format, &formatProperties);
+    if (formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT) {
+      return format;
+    }
+  }
+  // Every device supports one of D24S8 or D32.
+  LOG_E(gAppName.data(), "No supported depth format.");
+  assert(false);
+  return VK_FORMAT_D16_UNORM;
+}
+
+void VulkanRenderer::CreateDepthBuffer() {
+  VkImageCreateInfo imageCreateInfo{
+    .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+    .pNext = nullptr,
+    .imageType = VK_IMAGE_TYPE_2D,
+    .format = mSwapchain.depthFormat,
+    .extent = {mSwapchain.displaySize.width, mSwapchain.displaySize.height, 1},
+    .mipLevels = 1,
+    .arrayLayers = 1,
+    .samples = VK_SAMPLE_COUNT_1_BIT,
+    .tiling = VK_IMAGE_TILING_OPTIMAL,
+    .usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+    .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+    .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+  };
+  CALL_VK(vkCreateImage(mDeviceInfo.device, &imageCreateInfo, nullptr, &mSwapchain.depthImage));
+  if (!AllocateImageMemory(mSwapchain.depthImage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                           false, mSwapchain.depthMemory, MemoryCategory_Swapchain)) {
+    LOG_E(gAppName.data(), "Allocate depth buffer memory failed.");
+    assert(false);
+  }
+
+  VkImageViewCreateInfo viewCreateInfo{
+    .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+    .pNext = nullptr,
+    .image = mSwapchain.depthImage,
+    .viewType = VK_IMAGE_VIEW_TYPE_2D,
+    .format = mSwapchain.depthFormat,
+    .subresourceRange =
+    {
+      // An attachment view has all the aspects of its format.
+      .aspectMask = static_cast<VkImageAspectFlags>(
+              mSwapchain.depthFormat == VK_FORMAT_D24_UNORM_S8_UINT ?
+              VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT : VK_IMAGE_ASPECT_DEPTH_BIT),
+      .baseMipLevel = 0,
+      .levelCount = 1,
+      .baseArrayLayer = 0,
+      .layerCount = 1,
+    },
+    .flags = 0,
+  };
+  CALL_VK(vkCreateImageView(mDeviceInfo.device, &viewCreateInfo, nullptr,
+                            &mSwapchain.depthView));
+}
+
+void VulkanRenderer::DeleteDepthBuffer() {
+  vkDestroyImageView(mDeviceInfo.device, mSwapchain.depthView, nullptr);
+  vkDestroyImage(mDeviceInfo.device, mSwapchain.depthImage, nullptr);
+  mAllocator.Free(mSwapchain.depthMemory);
+  mSwapchain.depthView = VK_NULL_HANDLE;
+  mSwapchain.depthImage = VK_NULL_HANDLE;
+  mSwapchain.depthMemory = VulkanAllocation();
+}
+
 void VulkanRenderer::CreateSyncObjects() {
-  // We need to create a fence to be able, in the main loop, to wait for our
-  // draw command(s) to finish before swapping the framebuffers
+  // The fence of a frame lets the main loop wait for its draw command(s) to
+  // finish before reusing its resources. It starts signaled as the first
+  // frame of each slot has nothing to wait for.
   VkFenceCreateInfo fenceCreateInfo{
           .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
           .pNext = nullptr,
-          .flags = 0,
+          .flags = VK_FENCE_CREATE_SIGNALED_BIT,
   };
-  CALL_VK(vkCreateFence(mDeviceInfo.device, &fenceCreateInfo,
-                        nullptr, &mRenderInfo.fence));
 
-  // We need to create a semaphore to be able to wait, in the main loop, for our
-  // framebuffer to be available for us before drawing.
+  // The draw waits for the framebuffer to be available, and the present
+  // waits for the draw, both on the GPU.
   VkSemaphoreCreateInfo semaphoreCreateInfo{
           .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
           .pNext = nullptr,
           .flags = 0
   };
-  CALL_VK(vkCreateSemaphore(mDeviceInfo.device, &semaphoreCreateInfo, nullptr,
-                            &mRenderInfo.semaphore));
+  for (auto& frame : mRenderInfo.frames) {
+    CALL_VK(vkCreateFence(mDeviceInfo.device, &fenceCreateInfo, nullptr, &frame.fence));
+    CALL_VK(vkCreateSemaphore(mDeviceInfo.device, &semaphoreCreateInfo, nullptr,
+                              &frame.imageAvailable));
+    CALL_VK(vkCreateSemaphore(mDeviceInfo.device, &semaphoreCreateInfo, nullptr,
+                              &frame.renderFinished));
+  }
+  mRenderInfo.currentFrame = 0;
 }
 
-VkCommandBuffer VulkanRenderer::BeginSingleTimeCommands() {
-  VkCommandBufferAllocateInfo allocInfo{
-    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-    .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-    .commandPool = mRenderInfo.cmdPool,
-    .commandBufferCount = 1,
-  };
-
-  VkCommandBuffer commandBuffer;
-  vkAllocateCommandBuffers(mDeviceInfo.device, &allocInfo, &commandBuffer);
-
-  VkCommandBufferBeginInfo beginInfo{
-    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-    .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
-  };
-
-  vkBeginCommandBuffer(commandBuffer, &beginInfo);
-  return commandBuffer;
+void VulkanRenderer::DeleteSyncObjects() {
+  for (auto& frame : mRenderInfo.frames) {
+    vkDestroyFence(mDeviceInfo.device, frame.fence, nullptr);
+    vkDestroySemaphore(mDeviceInfo.device, frame.imageAvailable, nullptr);
+    vkDestroySemaphore(mDeviceInfo.device, frame.renderFinished, nullptr);
+    frame = VulkanFrame();
+  }
 }
 
-void VulkanRenderer::EndSingleTimeCommands(VkCommandBuffer aCommandBuffer) {
-  vkEndCommandBuffer(aCommandBuffer);
-
-  VkSubmitInfo submitInfo{};
-  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-  submitInfo.commandBufferCount = 1;
-  submitInfo.pCommandBuffers = &aCommandBuffer;
-
-  // TODO: what is the difference between vkWaitForFences and vkQueueWaitIdle?
-  vkQueueSubmit(mDeviceInfo.graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
-  vkQueueWaitIdle(mDeviceInfo.graphicsQueue);
-
-  vkFreeCommandBuffers(mDeviceInfo.device, mRenderInfo.cmdPool, 1, &aCommandBuffer);
+void VulkanRenderer::CreateUploadContext() {
+  CreateBuffer(kStagingRingSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+               MemoryCategory_Staging, mStagingBuffer, mStagingMemory);
+  mUploadContext.Init(mDeviceInfo.device, mDeviceInfo.graphicsQueue, mDeviceInfo.queueFamilyIndex,
+                      mStagingBuffer, mStagingMemory.mappedData, kStagingRingSize);
 }
 
-void VulkanRenderer::CopyBuffer(VkBuffer aSrcBuffer, VkBuffer aDstBuffer, VkDeviceSize aSize) {
-  VkCommandBuffer commandBuffer = BeginSingleTimeCommands();
+void VulkanRenderer::UploadBuffer(VkBuffer aDstBuffer, VkDeviceSize aDstOffset,
+                                  const void* aData, VkDeviceSize aSize) {
+  const uint8_t* src = static_cast<const uint8_t*>(aData);
+  // Large uploads are split into chunks, so one upload never needs the whole ring.
+  const VkDeviceSize chunkSize = mUploadContext.GetStagingCapacity() / 2;
+
+  for (VkDeviceSize uploaded = 0; uploaded < aSize;) {
+    const VkDeviceSize size = std::min(chunkSize, aSize - uploaded);
+    VkDeviceSize stagingOffset = 0;
+    void* data = nullptr;
+    if (!mUploadContext.AllocateStaging(size, 4, stagingOffset, data)) {
+      assert(false);
+      return;
+    }
+    memcpy(data, src + uploaded, size);
 
-  VkBufferCopy copyRegion{};
-  copyRegion.size = aSize;
-  vkCmdCopyBuffer(commandBuffer, aSrcBuffer, aDstBuffer, 1, &copyRegion);
+    VkBufferCopy copyRegion{
+      .srcOffset = stagingOffset,
+      .dstOffset = aDstOffset + uploaded,
+      .size = size,
+    };
+    vkCmdCopyBuffer(mUploadContext.GetCommandBuffer(), mUploadContext.GetStagingBuffer(),
+                    aDstBuffer, 1, &copyRegion);
+    uploaded += size;
+  }
+}
 
-  EndSingleTimeCommands(commandBuffer);
+void VulkanRenderer::UploadImage(VkImage aImage, uint32_t aMipLevel, uint32_t aWidth,
+                                 uint32_t aHeight, uint32_t aTexelSize, const uint8_t* aData) {
+  // The image has to be in VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL. Large images are
+  // uploaded in bands of rows that fit into a half of the staging ring.
+  const VkDeviceSize rowPitch = VkDeviceSize(aWidth) * aTexelSize;
+  const uint32_t rowsPerChunk = static_cast<uint32_t>(
+          std::max<VkDeviceSize>(mUploadContext.GetStagingCapacity() / 2 / rowPitch, 1));
+  // bufferOffset must be a multiple of both the texel size and 4.
+  const VkDeviceSize alignment = std::max<VkDeviceSize>(
+          aTexelSize * 4, mDeviceInfo.gpuDeviceProperties.limits.optimalBufferCopyOffsetAlignment);
+
+  for (uint32_t row = 0; row < aHeight;) {
+    const uint32_t rows = std::min(rowsPerChunk, aHeight - row);
+    const VkDeviceSize size = rowPitch * rows;
+    VkDeviceSize stagingOffset = 0;
+    void* data = nullptr;
+    if (!mUploadContext.AllocateStaging(size, alignment, stagingOffset, data)) {
+      assert(false);
+      return;
+    }
+    memcpy(data, aData + rowPitch * row, size);
+
+    VkBufferImageCopy region{};
+    region.bufferOffset = stagingOffset;
+    region.bufferRowLength = 0;
+    region.bufferImageHeight = 0;
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.mipLevel = aMipLevel;
+    region.imageSubresource.baseArrayLayer = 0;
+    region.imageSubresource.layerCount = 1;
+    region.imageOffset = {0, static_cast<int32_t>(row), 0};
+    region.imageExtent = {aWidth, rows, 1};
+    vkCmdCopyBufferToImage(mUploadContext.GetCommandBuffer(), mUploadContext.GetStagingBuffer(),
+                           aImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+    row += rows;
+  }
 }
 
 void VulkanRenderer::CreateBuffer(VkDeviceSize aSize, VkBufferUsageFlags aUsage,
-                                  VkMemoryPropertyFlags aProperties, VkBuffer& aBuffer,
-                                  VkDeviceMemory& aBufferMemory) {
+                                  VkMemoryPropertyFlags aProperties, MemoryCategory aCategory,
+                                  VkBuffer& aBuffer, VulkanAllocation& aBufferMemory,
+                                  VkMemoryPropertyFlags aPreferred) {
   // Create a index buffer
   VkBufferCreateInfo createBufferInfo{
           .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
@@ -751,67 +1353,224 @@ void VulkanRenderer::CreateBuffer(VkDeviceSize aSize, VkBufferUsageFlags aUsage,
   VkMemoryRequirements memReq;
   vkGetBufferMemoryRequirements(mDeviceInfo.device, aBuffer, &memReq);
 
-  VkMemoryAllocateInfo allocInfo{
-          .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-          .pNext = nullptr,
-          .allocationSize = memReq.size,
-          .memoryTypeIndex = 0,  // Memory type assigned in the next step
-  };
-
   // Assign the proper memory type for that buffer
-  MapMemoryTypeToIndex(memReq.memoryTypeBits, aProperties, &allocInfo.memoryTypeIndex);
-  // Allocate memory for the buffer
-  CALL_VK(vkAllocateMemory(mDeviceInfo.device, &allocInfo, nullptr, &aBufferMemory));
-  CALL_VK(vkBindBufferMemory(mDeviceInfo.device, aBuffer, aBufferMemory, 0));
+  uint32_t memoryTypeIndex = 0;
+  if (!MapMemoryTypeToIndex(memReq.memoryTypeBits, aProperties, &memoryTypeIndex, aPreferred)) {
+    LOG_E(gAppName.data(), "No memory type matches the buffer properties.");
+    assert(false);
+  }
+  // Sub-allocate memory for the buffer from the shared memory blocks
+  if (!mAllocator.Allocate(memReq, memoryTypeIndex, true, aCategory, aBufferMemory)) {
+    LOG_E(gAppName.data(), "Allocate buffer memory failed.");
+    assert(false);
+  }
+  CALL_VK(vkBindBufferMemory(mDeviceInfo.device, aBuffer, aBufferMemory.memory,
+                             aBufferMemory.offset));
+}
+
+bool VulkanRenderer::WriteBufferDirect(const VulkanAllocation& aMemory, VkDeviceSize aOffset,
+                                       const void* aData, VkDeviceSize aSize) {
+  const VkMemoryPropertyFlags flags =
+          mDeviceInfo.memoryProperties.memoryTypes[aMemory.memoryTypeIndex].propertyFlags;
+  // Non-coherent memory would need a flush, leave it to the staging path.
+  if (!aMemory.mappedData || !(flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) {
+    return false;
+  }
+  // Host writes are made visible to the device by the next vkQueueSubmit.
+  memcpy(static_cast<uint8_t*>(aMemory.mappedData) + aOffset, aData, aSize);
+  return true;
+}
+
+bool VulkanRenderer::AllocateImageMemory(VkImage aImage, VkMemoryPropertyFlags aProperties,
+                                         bool aLinear, VulkanAllocation& aImageMemory,
+                                         MemoryCategory aCategory) {
+  VkMemoryRequirements memReq;
+  vkGetImageMemoryRequirements(mDeviceInfo.device, aImage, &memReq);
+
+  uint32_t memoryTypeIndex = 0;
+  if (!MapMemoryTypeToIndex(memReq.memoryTypeBits, aProperties, &memoryTypeIndex) ||
+      !mAllocator.Allocate(memReq, memoryTypeIndex, aLinear, aCategory, aImageMemory)) {
+    return false;
+  }
+  return vkBindImageMemory(mDeviceInfo.device, aImage, aImageMemory.memory,
+                           aImageMemory.offset) == VK_SUCCESS;
+}
+
+void VulkanRenderer::CreateUniformArena() {
+  // One region per frame in flight, so we never write the uniforms of a frame
+  // the GPU might still be reading.
+  const VkDeviceSize alignment =
+          mDeviceInfo.gpuDeviceProperties.limits.minUniformBufferOffsetAlignment;
+  mUniformArena.alignment = alignment ? alignment : 1;
+  mUniformArena.frameSize = AlignUp(kUniformArenaFrameSize, mUniformArena.alignment);
+  mUniformArena.slices.Init(mUniformArena.frameSize);
+  CreateBuffer(mUniformArena.frameSize * mRenderInfo.frames.size(),
+               VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+               MemoryCategory_Uniform, mUniformArena.buffer, mUniformArena.memory);
 }
 
 void VulkanRenderer::CreateUniformBuffer(VkDeviceSize aBufferSize,
                                          std::shared_ptr<RenderSurface> aSurf) {
-  const int swapchainCount = mSwapchain.displayImages.size();
-  aSurf->mUniformBuffers.resize(swapchainCount);
-  aSurf->mUniformBuffersMemory.resize(swapchainCount);
+  // Every surface gets an aligned slice at the same offset of each frame region,
+  // and is bound with a dynamic offset in the draw loop. The recorded frames
+  // still bind the old slice until they are done.
+  FreeDeferred(mUniformArena.slices, aSurf->mUBORange);
+  aSurf->mUBORange = mUniformArena.slices.Allocate(aBufferSize, mUniformArena.alignment);
+  if (aSurf->mUBORange == VulkanGeometryArena::kInvalidRange) {
+    LOG_E(gAppName.data(), "Uniform arena is out of space, %llu bytes are in use.",
+          (unsigned long long)mUniformArena.slices.GetUsedSize());
+    aSurf->mUBOOffset = 0;
+    aSurf->mUBOSize = 0;
+    assert(false);
+    return;
+  }
+
+  aSurf->mUBOOffset = mUniformArena.slices.GetOffset(aSurf->mUBORange);
   aSurf->mUBOSize = aBufferSize;
+  // The draws bind the new dynamic offset.
+  MarkSceneDirty();
+}
+
+void VulkanRenderer::CreateGeometryBuffer(VulkanGeometryBuffer& aGeometry, VkDeviceSize aCapacity,
+                                          VkBufferUsageFlags aUsage, MemoryCategory aCategory) {
+  // TRANSFER_SRC lets RelocateGeometry() copy the ranges to a new buffer.
+  aGeometry.usage = aUsage | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+  aGeometry.category = aCategory;
+  CreateBuffer(aCapacity, aGeometry.usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, aCategory,
+               aGeometry.buffer, aGeometry.memory, kUnifiedMemoryFlags);
+  aGeometry.arena.Init(aCapacity);
+}
+
+void VulkanRenderer::DeleteGeometryBuffer(VulkanGeometryBuffer& aGeometry) {
+  vkDestroyBuffer(mDeviceInfo.device, aGeometry.buffer, nullptr);
+  mAllocator.Free(aGeometry.memory);
+  aGeometry.buffer = VK_NULL_HANDLE;
+  aGeometry.arena.Terminate();
+}
+
+uint32_t VulkanRenderer::AllocateGeometry(VulkanGeometryBuffer& aGeometry, const void* aData,
+                                          VkDeviceSize aSize, VkDeviceSize aAlignment,
+                                          std::shared_ptr<RenderSurface> aSurf) {
+  uint32_t range = aGeometry.arena.Allocate(aSize, aAlignment);
+  if (range == VulkanGeometryArena::kInvalidRange) {
+    // Out of space, move the ranges into a larger buffer.
+    const VkDeviceSize capacity = aGeometry.arena.GetCapacity();
+    RelocateGeometry(aGeometry, std::max(capacity * 2, capacity + aSize + aAlignment));
+    range = aGeometry.arena.Allocate(aSize, aAlignment);
+    if (range == VulkanGeometryArena::kInvalidRange) {
+      LOG_E(gAppName.data(), "Allocate %llu bytes of geometry failed.", (unsigned long long)aSize);
+      assert(false);
+      return range;
+    }
+  }
+
+  // On unified memory, the arena is host visible and we write it directly.
+  const VkDeviceSize offset = aGeometry.arena.GetOffset(range);
+  if (!WriteBufferDirect(aGeometry.memory, offset, aData, aSize)) {
+    UploadBuffer(aGeometry.buffer, offset, aData, aSize);
+    aSurf->mUploadTicket = mUploadContext.GetRecordingTicket();
+  }
+  return range;
+}
+
+bool VulkanRenderer::RelocateGeometry(VulkanGeometryBuffer& aGeometry, VkDeviceSize aCapacity) {
+  VkBuffer buffer = VK_NULL_HANDLE;
+  VulkanAllocation memory;
+  std::vector<VkBufferCopy> copies;
+  CreateBuffer(aCapacity, aGeometry.usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+               aGeometry.category, buffer, memory, kUnifiedMemoryFlags);
+  if (!aGeometry.arena.Compact(aCapacity, copies)) {
+    vkDestroyBuffer(mDeviceInfo.device, buffer, nullptr);
+    mAllocator.Free(memory);
+    return false;
+  }
+
+  if (copies.size()) {
+    VkCommandBuffer commandBuffer = mUploadContext.GetCommandBuffer();
+    // Uploads recorded earlier in this batch might still be writing the ranges we read.
+    VkMemoryBarrier memoryBarrier{
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .pNext = nullptr,
+      .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+    };
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &memoryBarrier,
+                         0, nullptr, 0, nullptr);
+    vkCmdCopyBuffer(commandBuffer, aGeometry.buffer, buffer, copies.size(), copies.data());
+  }
+
+  // The recorded frames and the copies are still reading the old buffer.
+  mUploadContext.Flush();
+  CALL_VK(vkDeviceWaitIdle(mDeviceInfo.device));
+  mUploadContext.Update();
+
+  vkDestroyBuffer(mDeviceInfo.device, aGeometry.buffer, nullptr);
+  mAllocator.Free(aGeometry.memory);
+  aGeometry.buffer = buffer;
+  aGeometry.memory = memory;
+
+  // Draws use the new offsets.
+  MarkSceneDirty();
+  return true;
+}
+
+void VulkanRenderer::FreeDeferred(VulkanGeometryArena& aArena, uint32_t& aRange) {
+  if (aRange == VulkanGeometryArena::kInvalidRange) {
+    return;
+  }
+  // The last submitted frame is the newest one that might read the range,
+  // its fence is waited after the ones of all the older frames.
+  const size_t frameCount = mRenderInfo.frames.size();
+  VulkanFrame& frame = mRenderInfo.frames[(mRenderInfo.currentFrame + frameCount - 1) % frameCount];
+  frame.deferredFrees.push_back({&aArena, aRange});
+  aRange = VulkanGeometryArena::kInvalidRange;
+}
+
+void VulkanRenderer::ReleaseDeferredFrees(VulkanFrame& aFrame) {
+  for (const auto& deferred : aFrame.deferredFrees) {
+    deferred.arena->Free(deferred.range);
+  }
+  aFrame.deferredFrees.clear();
+  for (VkPipeline pipeline : aFrame.deferredPipelines) {
+    mPipelineLibrary.Release(pipeline);
+  }
+  aFrame.deferredPipelines.clear();
+}
 
-  // Create uniform buffers. We don't need a staging buffer.
-  // We will update the buffers every frame.
-  for (size_t i = 0; i < swapchainCount; i++) {
-    CreateBuffer(aBufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-            aSurf->mUniformBuffers[i], aSurf->mUniformBuffersMemory[i]);
+void VulkanRenderer::CompactGeometry() {
+  for (VulkanGeometryBuffer* geometry : {&mVertexGeometry, &mIndexGeometry}) {
+    // Nothing to win if the holes left are alignment padding, which the
+    // used size doesn't count but a relocation keeps anyway.
+    if (geometry->arena.IsPacked()) {
+      continue;
+    }
+    const VkDeviceSize capacity = geometry->arena.GetCapacity();
+    if (!RelocateGeometry(*geometry, capacity)) {
+      LOG_W(gAppName.data(), "Compact the geometry failed, it stays as it is.");
+      continue;
+    }
+    LOG_I(gAppName.data(), "Compacted geometry, %llu of %llu bytes in use.",
+          (unsigned long long)geometry->arena.GetUsedSize(), (unsigned long long)capacity);
   }
 }
 
 void VulkanRenderer::CreateVertexBuffer(const std::vector<float>& aVertexData,
                                         std::shared_ptr<RenderSurface> aSurf) {
   aSurf->mVertexData = aVertexData;
+  // Positions come first, in the first vertex stream.
+  if (aSurf->mBuffer.vertexRanges.empty()) {
+    aSurf->ComputeBounds(aVertexData);
+  }
   const size_t bufferSize = aVertexData.size() * sizeof(float);
-  VkBuffer stagingBuffer;
-  VkDeviceMemory stagingBufferMemory;
-
-  // Create a staging buffer as the src buffer for letting data copy on it.
-  CreateBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-               stagingBuffer, stagingBufferMemory);
 
-  void* data;
-  CALL_VK(vkMapMemory(mDeviceInfo.device, stagingBufferMemory, 0, bufferSize,
-                      0, &data));
-  memcpy(data, aVertexData.data(), bufferSize);
-  vkUnmapMemory(mDeviceInfo.device, stagingBufferMemory);
-
-  // Create a local buffer and let staging buffer copy on it for the GPU optimal usage.
-  // (It might be acceptable just copying data to the local buffer without staging buffer
-  // and it would have penalty on performance.
-  VkBuffer vertexBuf = VK_NULL_HANDLE;
-  VkDeviceMemory vertexBufMemory = VK_NULL_HANDLE;
-  CreateBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vertexBuf, vertexBufMemory);
-  CopyBuffer(stagingBuffer, vertexBuf, bufferSize);
-  aSurf->mBuffer.vertexBuf.push_back(vertexBuf);
-  aSurf->mBuffer.vertexBufMemory.push_back(vertexBufMemory);
-
-  vkDestroyBuffer(mDeviceInfo.device, stagingBuffer, nullptr);
-  vkFreeMemory(mDeviceInfo.device, stagingBufferMemory, nullptr);
+  // Vertices are stored in the shared vertex arena. Aligning the range to the
+  // vertex stride lets single stream surfaces be drawn with a vertexOffset.
+  const VkDeviceSize stride = aSurf->mItemSize * sizeof(float);
+  const uint32_t range = AllocateGeometry(mVertexGeometry, aVertexData.data(), bufferSize,
+                                          std::max<VkDeviceSize>(stride, 4), aSurf);
+  aSurf->mBuffer.vertexRanges.push_back(range);
 }
 
 void VulkanRenderer::CreateIndexBuffer(const std::vector<uint16_t>& aIndexData,
@@ -819,49 +1578,56 @@ void VulkanRenderer::CreateIndexBuffer(const std::vector<uint16_t>& aIndexData,
 
   aSurf->mIndexData = aIndexData;
   const size_t bufferSize = aIndexData.size() * sizeof(uint16_t);
-  VkBuffer stagingBuffer;
-  VkDeviceMemory stagingBufferMemory;
 
-  // Create a staging buffer as the src buffer for letting data copy on it.
-  CreateBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-          stagingBuffer, stagingBufferMemory);
-
-  void* data;
-  CALL_VK(vkMapMemory(mDeviceInfo.device, stagingBufferMemory, 0, bufferSize,
-                      0, &data));
-  memcpy(data, aIndexData.data(), bufferSize);
-  vkUnmapMemory(mDeviceInfo.device, stagingBufferMemory);
+  // Indices are stored in the shared index arena and drawn with a firstIndex.
+  // The old range isn't reused before the frames drawing it are done.
+  FreeDeferred(mIndexGeometry.arena, aSurf->mBuffer.indexRange);
+  aSurf->mBuffer.indexRange = AllocateGeometry(mIndexGeometry, aIndexData.data(), bufferSize,
+                                               sizeof(uint32_t), aSurf);
+  MarkSceneDirty();
+}
 
-  // Create a local buffer and let staging buffer copy on it for the GPU optimal usage.
-  // (It might be acceptable just copying data to the local buffer without staging buffer
-  // and it would have penalty on performance.
-  CreateBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, aSurf->mBuffer.indexBuf, aSurf->mBuffer.indexBufMemory);
-  CopyBuffer(stagingBuffer, aSurf->mBuffer.indexBuf, bufferSize);
+void VulkanRenderer::CreateInstanceBuffer(const std::vector<float>& aInstanceData,
+                                          std::shared_ptr<RenderSurface> aSurf) {
+  if (aSurf->mInstanceItemSize < 16 || aSurf->mInstanceItemSize % 4) {
+    LOG_E(gAppName.data(), "Instance data needs a model matrix and vec4s, got %d floats.",
+          aSurf->mInstanceItemSize);
+    assert(false);
+    return;
+  }
 
-  vkDestroyBuffer(mDeviceInfo.device, stagingBuffer, nullptr);
-  vkFreeMemory(mDeviceInfo.device, stagingBufferMemory, nullptr);
+  const VkDeviceSize stride = aSurf->mInstanceItemSize * sizeof(float);
+  const size_t bufferSize = aInstanceData.size() * sizeof(float);
+
+  // Instances are stored in the vertex arena too, as one more vertex stream.
+  // Updating them writes a new range, the frames in flight still read the old one.
+  FreeDeferred(mVertexGeometry.arena, aSurf->mBuffer.instanceRange);
+  aSurf->mBuffer.instanceRange = AllocateGeometry(mVertexGeometry, aInstanceData.data(),
+                                                  bufferSize, stride, aSurf);
+  aSurf->mInstanceCount = static_cast<int>(aInstanceData.size() / aSurf->mInstanceItemSize);
+  aSurf->ComputeInstanceBounds(aInstanceData);
+  MarkSceneDirty();
 }
 
 void VulkanRenderer::CreateDescriptorSetLayout(std::shared_ptr<RenderSurface> aSurf) {
   std::vector<VkDescriptorSetLayoutBinding> layoutBindings;
 
-  if (aSurf->mUniformBuffers.size()) {
+  if (aSurf->mUBOSize) {
     layoutBindings.push_back(
       // create ubo descriptor layout
       {
         .binding = 0, // the binding index of vertex shader.
         // the amount of items of this layout, ex: for the case of a bone matrix, it will not be just one.
         .descriptorCount = 1,
-        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
         .pImmutableSamplers = nullptr,
         .stageFlags = VK_SHADER_STAGE_VERTEX_BIT, // TODO: it needs to be adapted for FRAGMENT_BIT.
       }
     );
   }
 
-  if (aSurf->mTextures.size()) {
+  // The texture table replaces the texture of the surface set.
+  if (aSurf->mTextures.size() && !UsesTextureTable(*aSurf)) {
     layoutBindings.push_back(
       {
         .binding = 1, // the binding index of fragment shader.
@@ -873,47 +1639,369 @@ void VulkanRenderer::CreateDescriptorSetLayout(std::shared_ptr<RenderSurface> aS
     );
   }
 
-  VkDescriptorSetLayoutCreateInfo layoutInfo{
-    .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
-    .bindingCount = static_cast<uint32_t>(layoutBindings.size()),
-    .pBindings = layoutBindings.data(),
-  };
+  // Nothing left for a set of its own.
+  if (layoutBindings.empty()) {
+    return;
+  }
 
-  CALL_VK(vkCreateDescriptorSetLayout(mDeviceInfo.device, &layoutInfo, nullptr,
-                                      &aSurf->mDescriptorSetLayout));
+  // Surfaces with the same bindings get the same cached layout.
+  aSurf->mDescriptorSetLayout = mDescriptorAllocator.GetLayout(layoutBindings);
 }
 
-VkResult VulkanRenderer::CreateGraphicsPipeline(const char* aVSPath,
-                                                const char* aFSPath,
-                                                std::shared_ptr<RenderSurface> aSurf) {
-  memset(&aSurf->mGfxPipeline, 0, sizeof(RenderSurface::VulkanGfxPipelineInfo));
+// Bytes between the position of |aFile| and its end, or 0 if it can't tell.
+static uint64_t GetRemainingFileSize(FILE* aFile) {
+  const long position = ftell(aFile);
+  if (position < 0 || fseek(aFile, 0, SEEK_END)) {
+    return 0;
+  }
+  const long end = ftell(aFile);
+  if (fseek(aFile, position, SEEK_SET) || end < position) {
+    return 0;
+  }
+  return static_cast<uint64_t>(end - position);
+}
 
-  VkShaderModule vertexShader, fragmentShader;
-  LoadShaderFromFile(aVSPath, &vertexShader, VERTEX_SHADER);
-  LoadShaderFromFile(aFSPath, &fragmentShader, FRAGMENT_SHADER);
+std::string VulkanRenderer::GetPipelineCachePath() const {
+  return Platform::GetExternalDirPath() + kPipelineCacheFileName;
+}
+
+void VulkanRenderer::CreatePipelineCache() {
+  const auto startTime = std::chrono::steady_clock::now();
+  const VkPhysicalDeviceProperties& properties = mDeviceInfo.gpuDeviceProperties;
+  const std::string path = GetPipelineCachePath();
+  std::vector<uint8_t> data;
+  FILE* file = fopen(path.c_str(), "rb");
+  if (file) {
+    PipelineCacheFileHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        header.magic != kPipelineCacheMagic || header.headerSize != sizeof(header)) {
+      LOG_W(gAppName.data(), "Ignore the pipeline cache %s, it isn't valid.", path.c_str());
+    } else if (header.vendorID != properties.vendorID ||
+               header.deviceID != properties.deviceID ||
+               header.driverVersion != properties.driverVersion ||
+               memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE)) {
+      LOG_I(gAppName.data(), "Ignore the pipeline cache, it was saved by another device or driver.");
+    } else if (header.dataSize > GetRemainingFileSize(file)) {
+      // Don't allocate a size read from the disk before knowing the file holds it.
+      LOG_W(gAppName.data(), "Ignore the pipeline cache %s, its data is truncated.", path.c_str());
+    } else {
+      data.resize(header.dataSize);
+      if (fread(data.data(), 1, data.size(), file) != data.size() ||
+          HashBytes(data.data(), data.size()) != header.dataHash) {
+        LOG_W(gAppName.data(), "Ignore the pipeline cache %s, its data is corrupted.", path.c_str());
+        data.clear();
+      }
+    }
+    fclose(file);
+  }
 
+  VkPipelineCacheCreateInfo pipelineCacheInfo{
+    .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+    .pNext = nullptr,
+    .initialDataSize = data.size(),
+    .pInitialData = data.size() ? data.data() : nullptr,
+    .flags = 0,  // reserved, must be 0
+  };
+  VkResult result = vkCreatePipelineCache(mDeviceInfo.device, &pipelineCacheInfo, nullptr,
+                                          &mPipelineCache.cache);
+  if (result != VK_SUCCESS && data.size()) {
+    // The driver rejected the data, start from an empty cache.
+    pipelineCacheInfo.initialDataSize = 0;
+    pipelineCacheInfo.pInitialData = nullptr;
+    data.clear();
+    result = vkCreatePipelineCache(mDeviceInfo.device, &pipelineCacheInfo, nullptr,
+                                   &mPipelineCache.cache);
+  }
+  CALL_VK(result);
+  mPipelineCache.loaded = data.size() != 0;
+
+  const std::chrono::duration<double, std::milli> duration =
+          std::chrono::steady_clock::now() - startTime;
+  LOG_I(gAppName.data(), "Pipeline cache %s with %zu bytes in %.3f ms.",
+        mPipelineCache.loaded ? "loaded" : "created empty", data.size(), duration.count());
+}
+
+void VulkanRenderer::DeletePipelineCache() {
+  if (mPipelineCache.cache == VK_NULL_HANDLE) {
+    return;
+  }
+  // Compare the launches with and without the saved cache.
+  LOG_I(gAppName.data(), "Created %u pipelines in %.3f ms %s the saved pipeline cache.",
+        mPipelineCache.pipelineCount, mPipelineCache.createTime,
+        mPipelineCache.loaded ? "with" : "without");
+
+  size_t dataSize = 0;
+  std::vector<uint8_t> data;
+  if (vkGetPipelineCacheData(mDeviceInfo.device, mPipelineCache.cache, &dataSize,
+                             nullptr) == VK_SUCCESS && dataSize) {
+    data.resize(dataSize);
+    if (vkGetPipelineCacheData(mDeviceInfo.device, mPipelineCache.cache, &dataSize,
+                               data.data()) != VK_SUCCESS) {
+      data.clear();
+    }
+    data.resize(std::min(dataSize, data.size()));
+  }
+  vkDestroyPipelineCache(mDeviceInfo.device, mPipelineCache.cache, nullptr);
+  mPipelineCache = VulkanPipelineCache();
+
+  if (data.empty()) {
+    return;
+  }
+  const VkPhysicalDeviceProperties& properties = mDeviceInfo.gpuDeviceProperties;
+  PipelineCacheFileHeader header = {};
+  header.magic = kPipelineCacheMagic;
+  header.headerSize = sizeof(header);
+  header.vendorID = properties.vendorID;
+  header.deviceID = properties.deviceID;
+  header.driverVersion = properties.driverVersion;
+  memcpy(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE);
+  header.dataSize = data.size();
+  header.dataHash = HashBytes(data.data(), data.size());
+
+  // Write a temporary file first, so an interrupted write never leaves a
+  // truncated cache behind.
+  const std::string path = GetPipelineCachePath();
+  const std::string tempPath = path + ".tmp";
+  FILE* file = fopen(tempPath.c_str(), "wb");
+  if (!file) {
+    LOG_W(gAppName.data(), "Couldn't open %s to save the pipeline cache.", tempPath.c_str());
+    return;
+  }
+  const bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                       fwrite(data.data(), 1, data.size(), file) == data.size();
+  if (fclose(file) != 0 || !written || rename(tempPath.c_str(), path.c_str()) != 0) {
+    LOG_W(gAppName.data(), "Saving the pipeline cache to %s failed.", path.c_str());
+    remove(tempPath.c_str());
+    return;
+  }
+  LOG_I(gAppName.data(), "Saved %zu bytes of pipeline cache.", data.size());
+}
+
+VulkanPipelineKey VulkanRenderer::GetPipelineKey(const char* aVSPath, const char* aFSPath,
+                                                 const RenderSurface& aSurf) const {
   // TODO: The pipeline layout works for uniform buffers, we should create
   //  it in a RenderSurface and make description pool supports not only one uniform buffer.
+  // With the texture table, every layout using it starts with the table and
+  // has the same push constants, so the table stays bound across them.
+  const bool textureTable = UsesTextureTable(aSurf);
+  VulkanPipelineKey key;
+  key.vertexShader = aVSPath;
+  key.fragmentShader = aFSPath;
+  key.vertexInput = aSurf.mVertexInput;
+  key.itemSize = aSurf.mItemSize;
+  key.instanceItemSize = aSurf.mInstanceItemSize;
+  if (textureTable) {
+    key.setLayouts.push_back(mTextureTable.descriptorSetLayout);
+  }
+  if (aSurf.mDescriptorSetLayout != VK_NULL_HANDLE) {
+    key.setLayouts.push_back(aSurf.mDescriptorSetLayout);
+  }
+  // The mvp matrix of a pushed transform, then the texture slots.
+  if (textureTable || aSurf.mPushTransform) {
+    key.pushConstantStages = textureTable ? VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT :
+                                            VK_SHADER_STAGE_VERTEX_BIT;
+    key.pushConstantSize = textureTable ? kPushConstantSize : (uint32_t)sizeof(Matrix4x4f);
+  }
+  key.renderPass = mRenderInfo.renderPass;
+  key.shaderConstants = aSurf.mShaderConstants;
+  key.cullMode = aSurf.mCullMode;
+  key.frontFace = aSurf.mFrontFace;
+  key.alphaBlend = aSurf.mAlphaBlend;
+
+  return key;
+}
+
+VkResult VulkanRenderer::CreateGraphicsPipeline(const char* aVSPath,
+                                                const char* aFSPath,
+                                                std::shared_ptr<RenderSurface> aSurf) {
+  // A surface asking again gives its current pipeline back first.
+  DeleteGraphicsPipeline(aSurf, true);
+  const VulkanPipelineKey key = GetPipelineKey(aVSPath, aFSPath, *aSurf);
+
+  // The same pipeline might be compiling in the background.
+  for (const auto& pending : mPendingPipelines) {
+    if (pending->key == key) {
+      mPipelineJobs.Wait(pending->job);
+      ResolvePipelines();
+      break;
+    }
+  }
+
+  // Surfaces drawn the same way share their pipeline.
+  if (mPipelineLibrary.Acquire(key, aSurf->mGfxPipeline.pipeline, aSurf->mGfxPipeline.layout)) {
+    MarkSceneDirty();
+    return VK_SUCCESS;
+  }
+
+  double compileTime = 0.0;
+  VkResult pipelineResult = CompilePipeline(key, aSurf->mGfxPipeline.pipeline,
+                                            aSurf->mGfxPipeline.layout, compileTime);
+  mPipelineCache.createTime += compileTime;
+  mPipelineCache.pipelineCount++;
+  if (pipelineResult != VK_SUCCESS) {
+    return pipelineResult;
+  }
+  mPipelineLibrary.Add(key, aSurf->mGfxPipeline.pipeline, aSurf->mGfxPipeline.layout);
+  LOG_I(gAppName.data(), "Created pipeline %u for %s and %s.",
+        mPipelineLibrary.GetPipelineCount(), aVSPath, aFSPath);
+  MarkSceneDirty();
+
+  return pipelineResult;
+}
+
+std::vector<JobSystem::JobHandle> VulkanRenderer::CompileGraphicsPipelines(
+        const std::vector<VulkanPipelineRequest>& aRequests) {
+  std::vector<JobSystem::JobHandle> handles;
+  for (const auto& request : aRequests) {
+    const std::shared_ptr<RenderSurface>& surf = request.surface;
+    // Neither its current pipeline nor an earlier request is handed over anymore.
+    DeleteGraphicsPipeline(surf, true);
+    const VulkanPipelineKey key = GetPipelineKey(request.vertexShader, request.fragmentShader,
+                                                 *surf);
+    if (mPipelineLibrary.Acquire(key, surf->mGfxPipeline.pipeline, surf->mGfxPipeline.layout)) {
+      MarkSceneDirty();
+      handles.push_back(nullptr);
+      continue;
+    }
+
+    // Surfaces asking for a pipeline already compiling wait for the same job.
+    std::shared_ptr<VulkanPendingPipeline> pending;
+    for (const auto& other : mPendingPipelines) {
+      if (other->key == key) {
+        pending = other;
+        break;
+      }
+    }
+    if (!pending) {
+      pending = std::make_shared<VulkanPendingPipeline>();
+      pending->key = key;
+      // Only the job writes the results, they are read once it completes.
+      VulkanPendingPipeline* compiled = pending.get();
+      pending->job = mPipelineJobs.Schedule([this, compiled]() {
+        compiled->result = CompilePipeline(compiled->key, compiled->pipeline, compiled->layout,
+                                           compiled->compileTime);
+      });
+      mPendingPipelines.push_back(pending);
+    }
+    pending->surfaces.push_back(surf);
+    handles.push_back(pending->job);
+  }
+  return handles;
+}
+
+bool VulkanRenderer::IsPipelineReady(const JobSystem::JobHandle& aHandle) const {
+  return !aHandle || mPipelineJobs.IsComplete(aHandle);
+}
+
+void VulkanRenderer::WaitForPipelines() {
+  for (const auto& pending : mPendingPipelines) {
+    mPipelineJobs.Wait(pending->job);
+  }
+  ResolvePipelines();
+}
+
+void VulkanRenderer::ResolvePipelines() {
+  for (size_t i = 0; i < mPendingPipelines.size();) {
+    const std::shared_ptr<VulkanPendingPipeline> pending = mPendingPipelines[i];
+    if (!mPipelineJobs.IsComplete(pending->job)) {
+      i++;
+      continue;
+    }
+    mPendingPipelines.erase(mPendingPipelines.begin() + i);
+    mPipelineCache.createTime += pending->compileTime;
+    mPipelineCache.pipelineCount++;
+    if (pending->result != VK_SUCCESS) {
+      LOG_E(gAppName.data(), "Compile the pipeline of %s and %s failed, error %d.",
+            pending->key.vertexShader.c_str(), pending->key.fragmentShader.c_str(),
+            pending->result);
+      continue;
+    }
+    if (pending->surfaces.empty()) {
+      // Its surfaces were all removed while it compiled.
+      vkDestroyPipeline(mDeviceInfo.device, pending->pipeline, nullptr);
+      vkDestroyPipelineLayout(mDeviceInfo.device, pending->layout, nullptr);
+      continue;
+    }
+
+    // The library holds the first reference, then every other surface adds one.
+    mPipelineLibrary.Add(pending->key, pending->pipeline, pending->layout);
+    LOG_I(gAppName.data(), "Compiled pipeline %u for %s and %s in %.3f ms.",
+          mPipelineLibrary.GetPipelineCount(), pending->key.vertexShader.c_str(),
+          pending->key.fragmentShader.c_str(), pending->compileTime);
+    for (size_t s = 0; s < pending->surfaces.size(); s++) {
+      RenderSurface::VulkanGfxPipelineInfo& pipeline = pending->surfaces[s]->mGfxPipeline;
+      if (s) {
+        mPipelineLibrary.Acquire(pending->key, pipeline.pipeline, pipeline.layout);
+      } else {
+        pipeline.pipeline = pending->pipeline;
+        pipeline.layout = pending->layout;
+      }
+    }
+    // The surfaces are drawn from now on.
+    MarkSceneDirty();
+  }
+}
+
+VkResult VulkanRenderer::CompilePipeline(const VulkanPipelineKey& aKey, VkPipeline& aPipeline,
+                                         VkPipelineLayout& aLayout, double& aCompileTime) {
+  const auto startTime = std::chrono::steady_clock::now();
+  // The modules are owned by the shader cache and shared with other pipelines.
+  const VkShaderModule vertexShader = mShaderCache.Get(aKey.vertexShader).module;
+  const VkShaderModule fragmentShader = mShaderCache.Get(aKey.fragmentShader).module;
+  if (vertexShader == VK_NULL_HANDLE || fragmentShader == VK_NULL_HANDLE) {
+    return VK_ERROR_INITIALIZATION_FAILED;
+  }
+
   // Create pipeline layout
+  VkPushConstantRange pushConstantRange{
+    .stageFlags = aKey.pushConstantStages,
+    .offset = 0,
+    .size = aKey.pushConstantSize,
+  };
   VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo{
     .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
     .pNext = nullptr,
-    .setLayoutCount = aSurf->mUniformBuffers.size() == 0 ? (uint32_t)0 : 1,
-    .pSetLayouts = aSurf->mUniformBuffers.size() == 0 ? nullptr : &aSurf->mDescriptorSetLayout,
-    .pushConstantRangeCount = 0,
-    .pPushConstantRanges = nullptr,
+    .setLayoutCount = static_cast<uint32_t>(aKey.setLayouts.size()),
+    .pSetLayouts = aKey.setLayouts.data(),
+    .pushConstantRangeCount = aKey.pushConstantSize ? (uint32_t)1 : 0,
+    .pPushConstantRanges = aKey.pushConstantSize ? &pushConstantRange : nullptr,
   };
 
   CALL_VK(vkCreatePipelineLayout(mDeviceInfo.device, &pipelineLayoutCreateInfo,
-                                       nullptr, &aSurf->mGfxPipeline.layout));
+                                       nullptr, &aLayout));
 
-  // No dynamic state in that tutorial
+  // The viewport follows the swapchain, which is recreated when the display
+  // rotates, so pipelines don't need to be rebuilt.
+  const VkDynamicState dynamicStates[] = {
+    VK_DYNAMIC_STATE_VIEWPORT,
+    VK_DYNAMIC_STATE_SCISSOR,
+  };
   VkPipelineDynamicStateCreateInfo dynamicStateInfo = {
     .sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
     .pNext = nullptr,
-    .dynamicStateCount = 0,
-    .pDynamicStates = nullptr
+    .dynamicStateCount = 2,
+    .pDynamicStates = dynamicStates
+  };
+
+  // Both stages share the constants, the ids a shader doesn't declare are ignored.
+  std::vector<VkSpecializationMapEntry> constantEntries;
+  std::vector<uint32_t> constantData;
+  for (const auto& constant : aKey.shaderConstants) {
+    constantEntries.push_back({
+      .constantID = constant.first,
+      .offset = static_cast<uint32_t>(constantData.size() * sizeof(uint32_t)),
+      .size = sizeof(uint32_t),
+    });
+    constantData.push_back(constant.second);
+  }
+  VkSpecializationInfo specializationInfo{
+    .mapEntryCount = static_cast<uint32_t>(constantEntries.size()),
+    .pMapEntries = constantEntries.data(),
+    .dataSize = constantData.size() * sizeof(uint32_t),
+    .pData = constantData.data(),
   };
+  const VkSpecializationInfo* specialization =
+          constantEntries.size() ? &specializationInfo : nullptr;
 
   // Specify vertex and fragment shader stages
   VkPipelineShaderStageCreateInfo shaderStages[2]{
@@ -922,7 +2010,7 @@ VkResult VulkanRenderer::CreateGraphicsPipeline(const char* aVSPath,
       .pNext = nullptr,
       .stage = VK_SHADER_STAGE_VERTEX_BIT,
       .module = vertexShader,
-      .pSpecializationInfo = nullptr,
+      .pSpecializationInfo = specialization,
       .flags = 0,
       .pName = "main",
     },
@@ -931,34 +2019,21 @@ VkResult VulkanRenderer::CreateGraphicsPipeline(const char* aVSPath,
       .pNext = nullptr,
       .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
       .module = fragmentShader,
-      .pSpecializationInfo = nullptr,
+      .pSpecializationInfo = specialization,
       .flags = 0,
       .pName = "main",
     }
   };
 
-  VkViewport viewports{
-    .minDepth = 0.0f,
-    .maxDepth = 1.0f,
-    .x = 0,
-    .y = 0,
-    .width = (float)mSwapchain.displaySize.width,
-    .height = (float)mSwapchain.displaySize.height,
-  };
-
-  VkRect2D scissor = {
-    .extent = mSwapchain.displaySize,
-    .offset = {
-      .x = 0, .y = 0
-  }};
-  // Specify viewport info
+  // Specify viewport info, both are dynamic states so the pipelines don't
+  // depend on the swapchain, which can change while they compile.
   VkPipelineViewportStateCreateInfo viewportInfo{
     .sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
     .pNext = nullptr,
     .viewportCount = 1,
-    .pViewports = &viewports,
+    .pViewports = nullptr,
     .scissorCount = 1,
-    .pScissors = &scissor,
+    .pScissors = nullptr,
   };
 
   // Specify multisample info
@@ -974,11 +2049,17 @@ VkResult VulkanRenderer::CreateGraphicsPipeline(const char* aVSPath,
     .alphaToOneEnable = VK_FALSE,
   };
 
-  // Specify color blend state (disable it)
+  // Specify color blend state, straight alpha blending if it is enabled.
   VkPipelineColorBlendAttachmentState attachmentStates{
+    .blendEnable = aKey.alphaBlend ? VK_TRUE : VK_FALSE,
+    .srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA,
+    .dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA,
+    .colorBlendOp = VK_BLEND_OP_ADD,
+    .srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE,
+    .dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA,
+    .alphaBlendOp = VK_BLEND_OP_ADD,
     .colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
                       VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT,
-    .blendEnable = VK_FALSE,
   };
   VkPipelineColorBlendStateCreateInfo colorBlendInfo{
     .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
@@ -997,8 +2078,8 @@ VkResult VulkanRenderer::CreateGraphicsPipeline(const char* aVSPath,
     .depthClampEnable = VK_FALSE,
     .rasterizerDiscardEnable = VK_FALSE,
     .polygonMode = VK_POLYGON_MODE_FILL,
-    .cullMode = VK_CULL_MODE_BACK_BIT,
-    .frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE,
+    .cullMode = aKey.cullMode,
+    .frontFace = aKey.frontFace,
     .depthBiasEnable = VK_FALSE,
     .lineWidth = 1,
   };
@@ -1012,8 +2093,12 @@ VkResult VulkanRenderer::CreateGraphicsPipeline(const char* aVSPath,
   };
 
   // Specify vertex input state
-  const auto& vertexInputBindings = GetVertexInputBindingDescription(aSurf->mVertexInput, aSurf->mItemSize);
-  const auto& vertexInputAttr = GetVertexInputAttributeDescription(aSurf->mVertexInput);
+  const auto vertexInputType = static_cast<RenderSurface::VertexInputType>(aKey.vertexInput);
+  const auto vertexInputBindings = GetVertexInputBindingDescription(vertexInputType,
+                                                                   aKey.itemSize,
+                                                                   aKey.instanceItemSize);
+  const auto vertexInputAttr = GetVertexInputAttributeDescription(vertexInputType,
+                                                                  aKey.instanceItemSize);
 
   VkPipelineVertexInputStateCreateInfo vertexInputInfo{
     .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
@@ -1024,18 +2109,18 @@ VkResult VulkanRenderer::CreateGraphicsPipeline(const char* aVSPath,
     .pVertexAttributeDescriptions = vertexInputAttr.data()
   };
 
-  // Create the pipeline cache
-  VkPipelineCacheCreateInfo pipelineCacheInfo{
-    .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+  // Blended surfaces are tested against the depth without hiding what is
+  // behind them. Less or equal lets a sky box drawn at the far plane pass.
+  VkPipelineDepthStencilStateCreateInfo depthStencilInfo{
+    .sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
     .pNext = nullptr,
-    .initialDataSize = 0,
-    .pInitialData = nullptr,
-    .flags = 0,  // reserved, must be 0
+    .depthTestEnable = VK_TRUE,
+    .depthWriteEnable = aKey.alphaBlend ? VK_FALSE : VK_TRUE,
+    .depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL,
+    .depthBoundsTestEnable = VK_FALSE,
+    .stencilTestEnable = VK_FALSE,
   };
 
-  CALL_VK(vkCreatePipelineCache(mDeviceInfo.device, &pipelineCacheInfo, nullptr,
-                                      &aSurf->mGfxPipeline.cache));
-
   // Create the pipeline
   VkGraphicsPipelineCreateInfo pipelineCreateInfo{
     .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
@@ -1049,126 +2134,199 @@ VkResult VulkanRenderer::CreateGraphicsPipeline(const char* aVSPath,
     .pViewportState = &viewportInfo,
     .pRasterizationState = &rasterInfo,
     .pMultisampleState = &multisampleInfo,
-    .pDepthStencilState = nullptr,
+    .pDepthStencilState = &depthStencilInfo,
     .pColorBlendState = &colorBlendInfo,
     .pDynamicState = &dynamicStateInfo,
-    .layout = aSurf->mGfxPipeline.layout,
-    .renderPass = mRenderInfo.renderPass,
+    .layout = aLayout,
+    .renderPass = aKey.renderPass,
     .subpass = 0,
     .basePipelineHandle = VK_NULL_HANDLE,
     .basePipelineIndex = 0,
   };
 
   VkResult pipelineResult = vkCreateGraphicsPipelines(
-                              mDeviceInfo.device, aSurf->mGfxPipeline.cache, 1, &pipelineCreateInfo, nullptr,
-                              &aSurf->mGfxPipeline.pipeline);
-  DestroyShaderModule(vertexShader);
-  DestroyShaderModule(fragmentShader);
+                              mDeviceInfo.device, mPipelineCache.cache, 1, &pipelineCreateInfo, nullptr,
+                              &aPipeline);
+  if (pipelineResult != VK_SUCCESS) {
+    vkDestroyPipelineLayout(mDeviceInfo.device, aLayout, nullptr);
+    aLayout = VK_NULL_HANDLE;
+    aPipeline = VK_NULL_HANDLE;
+  }
+  const std::chrono::duration<double, std::milli> duration =
+          std::chrono::steady_clock::now() - startTime;
+  aCompileTime = duration.count();
 
   return pipelineResult;
 }
 
-void VulkanRenderer::CreateDescriptorPool(std::shared_ptr<RenderSurface> aSurf) {
-  const int swapchainCount = mSwapchain.displayImages.size();
-  std::vector<VkDescriptorPoolSize> poolSize;
+void VulkanRenderer::CreateDescriptorSet(VkDeviceSize aBufferSize, std::shared_ptr<RenderSurface> aSurf) {
+  if (aSurf->mDescriptorSetLayout == VK_NULL_HANDLE) {
+    return;
+  }
 
-  if (aSurf->mUniformBuffers.size()) {
-    poolSize.push_back(
-      {
-        .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-        .descriptorCount = static_cast<uint32_t>(swapchainCount),
-      }
-    );
+  std::vector<VulkanDescriptorAllocator::ResourceBinding> resources;
+  if (aSurf->mUBOSize) {
+    // The real offset of the slice is given by the dynamic offset when binding.
+    VulkanDescriptorAllocator::ResourceBinding uniform = {};
+    uniform.binding = 0;
+    uniform.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    uniform.bufferInfo.buffer = mUniformArena.buffer;
+    uniform.bufferInfo.offset = 0;
+    uniform.bufferInfo.range = aBufferSize;
+    resources.push_back(uniform);
   }
 
-  if (aSurf->mTextures.size()) {
-    poolSize.push_back(
-      {
-        .type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-        .descriptorCount = static_cast<uint32_t>(swapchainCount),
-      }
-    );
+  // TODO: support multiple textures.
+  if (aSurf->mTextures.size() && !UsesTextureTable(*aSurf)) {
+    // The image's view (images are never directly accessed by the shader,
+    // but rather through views defining subresources), the sampler and
+    // the current layout of the image.
+    VulkanDescriptorAllocator::ResourceBinding texture = {};
+    texture.binding = 1;
+    texture.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    texture.imageInfo.imageView = aSurf->mTextures[0].view;
+    texture.imageInfo.sampler = aSurf->mTextures[0].sampler;
+    texture.imageInfo.imageLayout = aSurf->mTextures[0].imageLayout;
+    resources.push_back(texture);
   }
 
-  VkDescriptorPoolCreateInfo poolInfo{};
-  poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-  poolInfo.poolSizeCount = poolSize.size();
-  poolInfo.pPoolSizes = poolSize.data();
-  poolInfo.maxSets = static_cast<uint32_t>(swapchainCount);
+  // Surfaces with the same layout and resources share the set, their
+  // uniform slices only differ by the dynamic offset.
+  ReleaseDescriptorSets(aSurf);
+  const VkDescriptorSet descriptorSet =
+          mDescriptorAllocator.GetPersistentSet(aSurf->mDescriptorSetLayout, resources);
+  if (descriptorSet == VK_NULL_HANDLE) {
+    LOG_E(gAppName.data(), "Failed to allocate the descriptor set of a surface.");
+    assert(false);
+    return;
+  }
+  aSurf->mDescriptorSets.push_back(descriptorSet);
+  MarkSceneDirty();
+}
 
-  CALL_VK(vkCreateDescriptorPool(mDeviceInfo.device, &poolInfo, nullptr, &aSurf->mDescriptorPool));
+bool VulkanRenderer::HasTextureTable() const {
+  return mTextureTable.descriptorSet != VK_NULL_HANDLE;
 }
 
-void VulkanRenderer::CreateDescriptorSet(VkDeviceSize aBufferSize, std::shared_ptr<RenderSurface> aSurf) {
-  CreateDescriptorPool(aSurf);
-
-  const int swapchainCount = mSwapchain.displayImages.size();
-  std::vector<VkDescriptorSetLayout> layouts(swapchainCount, aSurf->mDescriptorSetLayout);
-  VkDescriptorSetAllocateInfo desAllocInfo{
-          .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
-          .descriptorPool = aSurf->mDescriptorPool,
-          .descriptorSetCount = static_cast<uint32_t>(swapchainCount),
-          .pSetLayouts = layouts.data(),
-  };
-  aSurf->mDescriptorSets.resize(swapchainCount);
-  CALL_VK(vkAllocateDescriptorSets(mDeviceInfo.device, &desAllocInfo, aSurf->mDescriptorSets.data()));
-
-  for (size_t i = 0; i < swapchainCount; i++) {
-    std::vector<VkWriteDescriptorSet> descriptorWrite;
-
-    if (aSurf->mUniformBuffers.size()) {
-      VkDescriptorBufferInfo bufferInfo {
-        .buffer = aSurf->mUniformBuffers[i],
-        .offset = 0,
-        .range = aBufferSize,
-      };
+void VulkanRenderer::CreateTextureTable() {
+  if (!mDeviceInfo.textureTableSize) {
+    return;
+  }
 
-      descriptorWrite.push_back({
-        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-        .dstSet = aSurf->mDescriptorSets[i],
-        .dstBinding = 0,
-        .dstArrayElement = 0,
-        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-        .descriptorCount = 1,
-        .pBufferInfo = &bufferInfo,
-      });
-    }
+#ifdef VK_EXT_descriptor_indexing
+  // Slots are written when textures are created, while command buffers
+  // using the table are pending.
+  const VkDescriptorBindingFlagsEXT bindingFlags =
+          VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT |
+          VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT_EXT |
+          VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT_EXT;
+  VkDescriptorSetLayoutBindingFlagsCreateInfoEXT bindingFlagsInfo{
+    .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT,
+    .pNext = nullptr,
+    .bindingCount = 1,
+    .pBindingFlags = &bindingFlags,
+  };
+  VkDescriptorSetLayoutBinding layoutBinding{
+    .binding = 0,
+    .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+    .descriptorCount = mDeviceInfo.textureTableSize,
+    .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+    .pImmutableSamplers = nullptr,
+  };
+  VkDescriptorSetLayoutCreateInfo layoutInfo{
+    .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+    .pNext = &bindingFlagsInfo,
+    .flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT_EXT,
+    .bindingCount = 1,
+    .pBindings = &layoutBinding,
+  };
+  CALL_VK(vkCreateDescriptorSetLayout(mDeviceInfo.device, &layoutInfo, nullptr,
+                                      &mTextureTable.descriptorSetLayout));
 
-    if (aSurf->mTextures.size()) {
-      // TODO: support multiple textures.
-      VkDescriptorImageInfo imageInfo {
-                                                                                                                                                                                                                                                                                                                                                                                                                                     // The image's view (images are never directly accessed by the shader,
-        // but rather through views defining subresources)
-        .imageView   = aSurf->mTextures[0].view,
-        // The sampler (Telling the pipeline how to sample the texture,
-        // including repeat, border, etc.)
-        .sampler     = aSurf->mTextures[0].sampler,
-        // The current layout of the image (Note: Should always fit
-        // the actual use, e.g. shader read)
-        .imageLayout = aSurf->mTextures[0].imageLayout,
-      };
+  VkDescriptorPoolSize poolSize{
+    .type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+    .descriptorCount = mDeviceInfo.textureTableSize,
+  };
+  VkDescriptorPoolCreateInfo poolInfo{
+    .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+    .pNext = nullptr,
+    .flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT_EXT,
+    .maxSets = 1,
+    .poolSizeCount = 1,
+    .pPoolSizes = &poolSize,
+  };
+  CALL_VK(vkCreateDescriptorPool(mDeviceInfo.device, &poolInfo, nullptr,
+                                 &mTextureTable.descriptorPool));
+
+  VkDescriptorSetAllocateInfo allocInfo{
+    .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+    .descriptorPool = mTextureTable.descriptorPool,
+    .descriptorSetCount = 1,
+    .pSetLayouts = &mTextureTable.descriptorSetLayout,
+  };
+  CALL_VK(vkAllocateDescriptorSets(mDeviceInfo.device, &allocInfo,
+                                   &mTextureTable.descriptorSet));
+#endif
+}
 
-      descriptorWrite.push_back({
-        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-        .dstSet = aSurf->mDescriptorSets[i],
-        .dstBinding = 1,
-        .dstArrayElement = 0,
-        .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-        .descriptorCount = 1,
-        .pImageInfo = &imageInfo,
-      });
-    }
+void VulkanRenderer::DeleteTextureTable() {
+  // Destroying the pool frees the set.
+  vkDestroyDescriptorPool(mDeviceInfo.device, mTextureTable.descriptorPool, nullptr);
+  vkDestroyDescriptorSetLayout(mDeviceInfo.device, mTextureTable.descriptorSetLayout, nullptr);
+  mTextureTable = VulkanTextureTable();
+}
 
-    vkUpdateDescriptorSets(mDeviceInfo.device, descriptorWrite.size(), descriptorWrite.data(), 0, nullptr);
+void VulkanRenderer::AddToTextureTable(RenderSurface::VulkanTexture& aTexture) {
+  if (!HasTextureTable()) {
+    return;
   }
+
+  uint32_t slot;
+  if (mTextureTable.freeSlots.size()) {
+    slot = mTextureTable.freeSlots.back();
+    mTextureTable.freeSlots.pop_back();
+  } else if (mTextureTable.slotCount < mDeviceInfo.textureTableSize) {
+    slot = mTextureTable.slotCount++;
+  } else {
+    LOG_E(gAppName.data(), "Texture table is full, %u textures are in use.",
+          mTextureTable.slotCount);
+    assert(false);
+    return;
+  }
+
+  VkDescriptorImageInfo imageInfo{
+    .sampler = aTexture.sampler,
+    .imageView = aTexture.view,
+    .imageLayout = aTexture.imageLayout,
+  };
+  VkWriteDescriptorSet descriptorWrite{
+    .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+    .dstSet = mTextureTable.descriptorSet,
+    .dstBinding = 0,
+    .dstArrayElement = slot,
+    .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+    .descriptorCount = 1,
+    .pImageInfo = &imageInfo,
+  };
+  vkUpdateDescriptorSets(mDeviceInfo.device, 1, &descriptorWrite, 0, nullptr);
+  aTexture.tableSlot = slot;
+  // The slots are pushed with the draws.
+  MarkSceneDirty();
+}
+
+bool VulkanRenderer::HasPushConstants(const RenderSurface& aSurf) const {
+  return aSurf.mPushTransform || (UsesTextureTable(aSurf) && aSurf.mTextures.size());
+}
+
+bool VulkanRenderer::UsesTextureTable(const RenderSurface& aSurf) const {
+  return aSurf.mUseTextureTable && HasTextureTable();
 }
 
 void VulkanRenderer::CreateCommandBuffer() {
-  // Record a command buffer that just clear the screen
-  // 1 command buffer draw in 1 framebuffer
-  // In our case we need 2 command as we have 2 framebuffer
-  mRenderInfo.cmdBufferLen = mSwapchain.swapchainLength;
-  mRenderInfo.cmdBuffer = new VkCommandBuffer[mSwapchain.swapchainLength];
+  // 1 command buffer draw in 1 framebuffer with the uniforms of 1 frame in
+  // flight, the one of frame f and image i is at f * swapchainLength + i.
+  mRenderInfo.cmdBufferLen = mSwapchain.swapchainLength * mRenderInfo.frames.size();
+  mRenderInfo.cmdBuffer = new VkCommandBuffer[mRenderInfo.cmdBufferLen];
   VkCommandBufferAllocateInfo cmdBufferCreateInfo{
           .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
           .pNext = nullptr,
@@ -1178,104 +2336,832 @@ void VulkanRenderer::CreateCommandBuffer() {
   };
   CALL_VK(vkAllocateCommandBuffers(mDeviceInfo.device, &cmdBufferCreateInfo,
                                    mRenderInfo.cmdBuffer));
+  // Nothing is recorded yet.
+  mRenderInfo.recordedVersions.assign(mRenderInfo.cmdBufferLen, 0);
+  CreateRecordWorkers();
+}
+
+void VulkanRenderer::DeleteCommandBuffers() {
+  if (!mRenderInfo.cmdBuffer) {
+    return;
+  }
+  DeleteRecordWorkers();
+  vkFreeCommandBuffers(mDeviceInfo.device, mRenderInfo.cmdPool, mRenderInfo.cmdBufferLen,
+                       mRenderInfo.cmdBuffer);
+  delete[] mRenderInfo.cmdBuffer;
+  mRenderInfo.cmdBuffer = nullptr;
+  mRenderInfo.cmdBufferLen = 0;
 }
 
 void VulkanRenderer::ConstructRenderPass() {
   CreateCommandBuffer();
+  UpdateDrawList();
+  RecordCommandBuffers();
+  CreateSyncObjects();
+}
 
-  const int size = mSwapchain.swapchainLength;
-  for (int bufferIndex = 0; bufferIndex < size; bufferIndex++) {
-    // We start by creating and declare the "beginning" our command buffer
-    VkCommandBufferBeginInfo cmdBufferBeginInfo{
-            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-            .pNext = nullptr,
-            .flags = 0,
-            .pInheritanceInfo = nullptr
+void VulkanRenderer::MarkSceneDirty() {
+  // Command buffers recorded with an older version are re-recorded before
+  // their next submission, the ones still in flight are left untouched.
+  ++mSceneVersion;
+}
+
+void VulkanRenderer::UpdateDrawList() {
+  const Matrix4x4f viewProj = mProjMatrix * mViewMatrix;
+  float planes[6][4];
+  ExtractFrustumPlanes(viewProj, planes);
+
+  const bool gpuCulling = mGpuCulling.pipeline != VK_NULL_HANDLE;
+  // State ids in the order the surfaces use them, keys only need them to group.
+  std::unordered_map<VkPipeline, uint32_t> pipelineIds;
+  std::unordered_map<VkDescriptorSet, uint32_t> descriptorIds;
+  std::vector<uint32_t> drawList;
+  drawList.reserve(mSurfaces.size());
+  mDrawKeys.clear();
+  mDrawsPushTransforms = false;
+  for (uint32_t i = 0; i < mSurfaces.size(); i++) {
+    const RenderSurface& surf = *mSurfaces[i];
+    // The compute pass culls the indexed surfaces, so their visibility
+    // changes don't need a new recording.
+    const bool indexed = surf.mBuffer.indexRange != VulkanGeometryArena::kInvalidRange;
+    if (!(gpuCulling && indexed) && !IsSurfaceInFrustum(surf, planes)) {
+      continue;
+    }
+
+    const uint32_t pipelineId = pipelineIds.insert(
+            std::make_pair(surf.mGfxPipeline.pipeline, static_cast<uint32_t>(pipelineIds.size()))).first->second;
+    uint32_t descriptorId = 0;
+    if (surf.mDescriptorSets.size()) {
+      descriptorId = descriptorIds.insert(
+              std::make_pair(surf.mDescriptorSets[0],
+                             static_cast<uint32_t>(descriptorIds.size() + 1))).first->second;
+    }
+    // A single vertex stream is drawn with a vertexOffset and shares the
+    // bound offsets, the others bind their own.
+    const bool ownStreams = surf.mBuffer.vertexRanges.size() > 1 ||
+            surf.mBuffer.instanceRange != VulkanGeometryArena::kInvalidRange;
+
+    uint64_t key = PackDrawKey(0, static_cast<uint32_t>(surf.mDrawLayer), kDrawKeyLayerBits);
+    key = PackDrawKey(key, pipelineId, kDrawKeyPipelineBits);
+    key = PackDrawKey(key, descriptorId, kDrawKeyDescriptorBits);
+    key = PackDrawKey(key, ownStreams ? i + 1 : 0, kDrawKeyStreamBits);
+    key = PackDrawKey(key, GetDrawDepth(surf, viewProj), kDrawKeyDepthBits);
+    mDrawKeys.push_back(key);
+    drawList.push_back(i);
+    mDrawsPushTransforms |= surf.mPushTransform;
+  }
+  mDrawSorter.Sort(mDrawKeys, drawList);
+
+  // A moving camera changes the depth order all the time. It only decides
+  // how many fragments the depth test rejects early, so a new depth order of
+  // the same draws is recorded after a while rather than every frame.
+  if (drawList != mDrawList &&
+      (!IsDepthReorder(drawList) || ++mDepthReorderDelay >= kDepthReorderInterval)) {
+    mDepthReorderDelay = 0;
+    mDrawList.swap(drawList);
+    mDrawStateKeys.resize(mDrawKeys.size());
+    for (size_t i = 0; i < mDrawKeys.size(); i++) {
+      mDrawStateKeys[i] = mDrawKeys[i] >> kDrawKeyDepthBits;
+    }
+    MarkSceneDirty();
+  }
+  if (gpuCulling && mGpuCulling.objectVersion != mSceneVersion) {
+    BuildCullObjects();
+  }
+}
+
+bool VulkanRenderer::IsDepthReorder(const std::vector<uint32_t>& aDrawList) const {
+  if (aDrawList.size() != mDrawList.size()) {
+    return false;
+  }
+  // The same surfaces are drawn, each with the state it was recorded with.
+  std::vector<uint64_t> stateKeys(mSurfaces.size(), UINT64_MAX);
+  for (size_t i = 0; i < mDrawList.size(); i++) {
+    stateKeys[mDrawList[i]] = mDrawStateKeys[i];
+  }
+  for (size_t i = 0; i < aDrawList.size(); i++) {
+    if (stateKeys[aDrawList[i]] != mDrawKeys[i] >> kDrawKeyDepthBits) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool VulkanRenderer::EnableGpuCulling(const char* aCSPath) {
+  if (mGpuCulling.pipeline != VK_NULL_HANDLE) {
+    return true;
+  }
+
+  // Objects, commands and counts.
+  VkDescriptorSetLayoutBinding layoutBindings[3];
+  for (uint32_t i = 0; i < 3; i++) {
+    layoutBindings[i] = {
+      .binding = i,
+      .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+      .descriptorCount = 1,
+      .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+      .pImmutableSamplers = nullptr,
+    };
+  }
+  VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo{
+    .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+    .pNext = nullptr,
+    .bindingCount = 3,
+    .pBindings = layoutBindings,
+  };
+  CALL_VK(vkCreateDescriptorSetLayout(mDeviceInfo.device, &descriptorSetLayoutCreateInfo,
+                                      nullptr, &mGpuCulling.descriptorSetLayout));
+
+  VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo{
+    .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+    .pNext = nullptr,
+    .setLayoutCount = 1,
+    .pSetLayouts = &mGpuCulling.descriptorSetLayout,
+    .pushConstantRangeCount = 0,
+    .pPushConstantRanges = nullptr,
+  };
+  CALL_VK(vkCreatePipelineLayout(mDeviceInfo.device, &pipelineLayoutCreateInfo, nullptr,
+                                 &mGpuCulling.layout));
+
+  const VkShaderModule computeShader = mShaderCache.Get(aCSPath).module;
+  if (computeShader == VK_NULL_HANDLE) {
+    DeleteGpuCulling();
+    return false;
+  }
+  VkComputePipelineCreateInfo pipelineCreateInfo{
+    .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+    .pNext = nullptr,
+    .flags = 0,
+    .stage = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+      .module = computeShader,
+      .pName = "main",
+      .pSpecializationInfo = nullptr,
+    },
+    .layout = mGpuCulling.layout,
+    .basePipelineHandle = VK_NULL_HANDLE,
+    .basePipelineIndex = 0,
+  };
+  const auto startTime = std::chrono::steady_clock::now();
+  VkResult pipelineResult = vkCreateComputePipelines(mDeviceInfo.device, mPipelineCache.cache, 1,
+                                                     &pipelineCreateInfo, nullptr,
+                                                     &mGpuCulling.pipeline);
+  const std::chrono::duration<double, std::milli> duration =
+          std::chrono::steady_clock::now() - startTime;
+  mPipelineCache.createTime += duration.count();
+  mPipelineCache.pipelineCount++;
+  if (pipelineResult != VK_SUCCESS) {
+    LOG_E(gAppName.data(), "Create the culling pipeline failed, error %d.", pipelineResult);
+    DeleteGpuCulling();
+    return false;
+  }
+
+  const uint32_t frameCount = static_cast<uint32_t>(mRenderInfo.frames.size());
+  VkDescriptorPoolSize poolSize{
+    .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+    .descriptorCount = 3 * frameCount,
+  };
+  VkDescriptorPoolCreateInfo descriptorPoolCreateInfo{
+    .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+    .pNext = nullptr,
+    .maxSets = frameCount,
+    .poolSizeCount = 1,
+    .pPoolSizes = &poolSize,
+  };
+  CALL_VK(vkCreateDescriptorPool(mDeviceInfo.device, &descriptorPoolCreateInfo, nullptr,
+                                 &mGpuCulling.descriptorPool));
+
+  const std::vector<VkDescriptorSetLayout> setLayouts(frameCount,
+                                                      mGpuCulling.descriptorSetLayout);
+  VkDescriptorSetAllocateInfo descriptorSetAllocateInfo{
+    .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+    .pNext = nullptr,
+    .descriptorPool = mGpuCulling.descriptorPool,
+    .descriptorSetCount = frameCount,
+    .pSetLayouts = setLayouts.data(),
+  };
+  mGpuCulling.descriptorSets.resize(frameCount);
+  CALL_VK(vkAllocateDescriptorSets(mDeviceInfo.device, &descriptorSetAllocateInfo,
+                                   mGpuCulling.descriptorSets.data()));
+
+  // The indexed surfaces move to the indirect draws.
+  MarkSceneDirty();
+  return true;
+}
+
+void VulkanRenderer::BuildCullObjects() {
+  mGpuCulling.objectDraws.clear();
+  mGpuCulling.drawObjects.assign(mDrawList.size(), kNoCullObject);
+
+  // Every indexed surface gets an indirect draw of its own. The shaders read
+  // their transforms from the uniforms or push constants of the surface,
+  // which can't be shared by the commands of a multi-draw.
+  for (uint32_t drawIndex = 0; drawIndex < mDrawList.size(); drawIndex++) {
+    const RenderSurface& surf = *mSurfaces[mDrawList[drawIndex]];
+    if (surf.mGfxPipeline.pipeline == VK_NULL_HANDLE ||
+        surf.mBuffer.indexRange == VulkanGeometryArena::kInvalidRange) {
+      continue;
+    }
+    mGpuCulling.drawObjects[drawIndex] = static_cast<uint32_t>(mGpuCulling.objectDraws.size());
+    mGpuCulling.objectDraws.push_back(drawIndex);
+  }
+
+  if (mGpuCulling.objectDraws.size() > mGpuCulling.capacity) {
+    uint32_t capacity = std::max(mGpuCulling.capacity * 2, kCullInitialCapacity);
+    while (capacity < mGpuCulling.objectDraws.size()) {
+      capacity *= 2;
+    }
+    // The frames in flight might still use the old buffers.
+    CALL_VK(vkDeviceWaitIdle(mDeviceInfo.device));
+    DeleteCullingBuffers();
+    CreateCullingBuffers(capacity);
+    MarkSceneDirty();
+  }
+  mGpuCulling.objectVersion = mSceneVersion;
+}
+
+void VulkanRenderer::CreateCullingBuffers(uint32_t aCapacity) {
+  // Every frame region is bound at its own offset.
+  const VkDeviceSize alignment = std::max<VkDeviceSize>(
+          mDeviceInfo.gpuDeviceProperties.limits.minStorageBufferOffsetAlignment, 4);
+  const VkDeviceSize countSize = AlignUp(aCapacity * sizeof(uint32_t), alignment);
+  mGpuCulling.objectFrameSize = AlignUp(sizeof(CullHeader) + aCapacity * sizeof(CullObject),
+                                        alignment);
+  mGpuCulling.commandSize = AlignUp(aCapacity * sizeof(VkDrawIndexedIndirectCommand),
+                                    alignment);
+  mGpuCulling.drawFrameSize = mGpuCulling.commandSize + countSize;
+  mGpuCulling.capacity = aCapacity;
+
+  const uint32_t frameCount = static_cast<uint32_t>(mRenderInfo.frames.size());
+  CreateBuffer(mGpuCulling.objectFrameSize * frameCount, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+               MemoryCategory_Indirect, mGpuCulling.objectBuffer, mGpuCulling.objectMemory);
+  CreateBuffer(mGpuCulling.drawFrameSize * frameCount,
+               VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, MemoryCategory_Indirect,
+               mGpuCulling.drawBuffer, mGpuCulling.drawMemory);
+
+  for (uint32_t frameIndex = 0; frameIndex < frameCount; frameIndex++) {
+    const VkDeviceSize drawOffset = frameIndex * mGpuCulling.drawFrameSize;
+    const VkDescriptorBufferInfo bufferInfos[3] = {
+      {mGpuCulling.objectBuffer, frameIndex * mGpuCulling.objectFrameSize,
+       mGpuCulling.objectFrameSize},
+      {mGpuCulling.drawBuffer, drawOffset, mGpuCulling.commandSize},
+      {mGpuCulling.drawBuffer, drawOffset + mGpuCulling.commandSize, countSize},
     };
-    CALL_VK(vkBeginCommandBuffer(mRenderInfo.cmdBuffer[bufferIndex],
-                                 &cmdBufferBeginInfo));
-    // transition the display image to color attachment layout
-    SetImageLayout(mRenderInfo.cmdBuffer[bufferIndex],
-                   mSwapchain.displayImages[bufferIndex],
-                   VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
-                   VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-                   VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
-                   VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
-
-    // Now we start a renderpass. Any draw command has to be recorded in a
-    // renderpass
-    VkClearValue clearVals{
+    VkWriteDescriptorSet descriptorWrites[3];
+    for (uint32_t i = 0; i < 3; i++) {
+      descriptorWrites[i] = {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .pNext = nullptr,
+        .dstSet = mGpuCulling.descriptorSets[frameIndex],
+        .dstBinding = i,
+        .dstArrayElement = 0,
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .pImageInfo = nullptr,
+        .pBufferInfo = &bufferInfos[i],
+        .pTexelBufferView = nullptr,
+      };
+    }
+    vkUpdateDescriptorSets(mDeviceInfo.device, 3, descriptorWrites, 0, nullptr);
+  }
+}
+
+void VulkanRenderer::DeleteCullingBuffers() {
+  if (!mGpuCulling.capacity) {
+    return;
+  }
+  vkDestroyBuffer(mDeviceInfo.device, mGpuCulling.objectBuffer, nullptr);
+  mAllocator.Free(mGpuCulling.objectMemory);
+  vkDestroyBuffer(mDeviceInfo.device, mGpuCulling.drawBuffer, nullptr);
+  mAllocator.Free(mGpuCulling.drawMemory);
+  mGpuCulling.objectBuffer = mGpuCulling.drawBuffer = VK_NULL_HANDLE;
+  mGpuCulling.capacity = 0;
+}
+
+void VulkanRenderer::DeleteGpuCulling() {
+  DeleteCullingBuffers();
+  // Destroying the pool frees its descriptor sets.
+  vkDestroyDescriptorPool(mDeviceInfo.device, mGpuCulling.descriptorPool, nullptr);
+  vkDestroyPipeline(mDeviceInfo.device, mGpuCulling.pipeline, nullptr);
+  vkDestroyPipelineLayout(mDeviceInfo.device, mGpuCulling.layout, nullptr);
+  vkDestroyDescriptorSetLayout(mDeviceInfo.device, mGpuCulling.descriptorSetLayout, nullptr);
+  mGpuCulling = VulkanGpuCulling();
+}
+
+void VulkanRenderer::UpdateCullObjects(uint32_t aFrameIndex) {
+  if (!mGpuCulling.capacity) {
+    return;
+  }
+
+  uint8_t* frameData = static_cast<uint8_t*>(mGpuCulling.objectMemory.mappedData) +
+                       aFrameIndex * mGpuCulling.objectFrameSize;
+  CullHeader* header = reinterpret_cast<CullHeader*>(frameData);
+  ExtractFrustumPlanes(mProjMatrix * mViewMatrix, header->planes);
+  header->objectCount = static_cast<uint32_t>(mGpuCulling.objectDraws.size());
+
+  // The transforms change every frame, the draw parameters when the
+  // geometry is relocated.
+  CullObject* objects = reinterpret_cast<CullObject*>(frameData + sizeof(CullHeader));
+  for (uint32_t i = 0; i < mGpuCulling.objectDraws.size(); i++) {
+    const uint32_t drawIndex = mGpuCulling.objectDraws[i];
+    const RenderSurface& surf = *mSurfaces[mDrawList[drawIndex]];
+    CullObject& object = objects[i];
+    object.boundsMin[3] = surf.GetCullingBounds(object.boundsMin, object.boundsMax) ? 1.0f : 0.0f;
+    object.boundsMax[3] = 0.0f;
+    memcpy(object.transform, &surf.mTransformMatrix, sizeof(object.transform));
+
+    object.indexCount = static_cast<uint32_t>(surf.mIndexData.size());
+    object.firstIndex = static_cast<uint32_t>(
+            mIndexGeometry.arena.GetOffset(surf.mBuffer.indexRange) / sizeof(uint16_t));
+    // Multiple streams are bound at their own offsets instead.
+    object.vertexOffset = 0;
+    if (surf.mBuffer.vertexRanges.size() == 1) {
+      object.vertexOffset = static_cast<int32_t>(
+              mVertexGeometry.arena.GetOffset(surf.mBuffer.vertexRanges[0]) /
+              (surf.mItemSize * sizeof(float)));
+    }
+    // Indirect draws need drawIndirectFirstInstance for anything else.
+    object.firstInstance = 0;
+    object.instanceCount = static_cast<uint32_t>(surf.mInstanceCount);
+  }
+}
+
+void VulkanRenderer::RecordCullPass(VkCommandBuffer aCmdBuffer, uint32_t aFrameIndex) {
+  const uint32_t objectCount = static_cast<uint32_t>(mGpuCulling.objectDraws.size());
+  if (!objectCount) {
+    return;
+  }
+
+  // Every object writes its command and its count, nothing needs clearing.
+  vkCmdBindPipeline(aCmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, mGpuCulling.pipeline);
+  vkCmdBindDescriptorSets(aCmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, mGpuCulling.layout,
+                          0, 1, &mGpuCulling.descriptorSets[aFrameIndex], 0, nullptr);
+  vkCmdDispatch(aCmdBuffer, (objectCount + kCullGroupSize - 1) / kCullGroupSize, 1, 1);
+
+  // The draws of the render pass read the commands and counts.
+  VkMemoryBarrier cullBarrier{
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+    .pNext = nullptr,
+    .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT,
+  };
+  vkCmdPipelineBarrier(aCmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, 0, 1, &cullBarrier,
+                       0, nullptr, 0, nullptr);
+}
+
+void VulkanRenderer::RecordCommandBuffers() {
+  for (uint32_t bufferIndex = 0; bufferIndex < mRenderInfo.cmdBufferLen; bufferIndex++) {
+    RecordCommandBuffer(bufferIndex);
+  }
+}
+
+void VulkanRenderer::RecordCommandBuffer(uint32_t aBufferIndex) {
+  const auto startTime = std::chrono::steady_clock::now();
+  const uint32_t frameIndex = aBufferIndex / mSwapchain.swapchainLength;
+  const uint32_t imageIndex = aBufferIndex % mSwapchain.swapchainLength;
+  VkCommandBuffer cmdBuffer = mRenderInfo.cmdBuffer[aBufferIndex];
+  const size_t drawCount = mDrawList.size();
+  std::vector<VulkanDrawRun>& runs = mRenderInfo.drawRuns[aBufferIndex];
+  size_t recordedDraws = 0;
+  uint32_t threadCount = 1;
+  // The static runs are kept until the scene changes, inline draws are
+  // recorded with the primary command buffer.
+  if (mRenderInfo.recordedVersions[aBufferIndex] != mSceneVersion || runs.empty()) {
+    BuildDrawRuns(runs);
+    threadCount = RecordStaticRuns(aBufferIndex);
+    recordedDraws = runs.empty() ? drawCount : 0;
+    for (const auto& run : runs) {
+      recordedDraws += run.pushed ? 0 : run.end - run.begin;
+    }
+  }
+  // The pushed transforms change every frame.
+  size_t pushedCount = 0;
+  for (auto& run : runs) {
+    if (run.pushed) {
+      run.cmdBuffer = GetSecondaryCommandBuffer(mRenderInfo.pushWorker, aBufferIndex,
+                                                pushedCount++);
+      RecordSecondaryCommandBuffer(run.cmdBuffer, frameIndex, imageIndex, run.begin, run.end);
+      recordedDraws += run.end - run.begin;
+    }
+  }
+
+  // We start by creating and declare the "beginning" our command buffer
+  VkCommandBufferBeginInfo cmdBufferBeginInfo{
+          .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+          .pNext = nullptr,
+          .flags = 0,
+          .pInheritanceInfo = nullptr
+  };
+  CALL_VK(vkBeginCommandBuffer(cmdBuffer, &cmdBufferBeginInfo));
+  // The culling pass writes the indirect draws, outside of the render pass.
+  if (mGpuCulling.pipeline != VK_NULL_HANDLE) {
+    RecordCullPass(cmdBuffer, frameIndex);
+  }
+  // transition the display image to color attachment layout, after the
+  // image available semaphore waited at the color attachment output stage.
+  SetImageLayout(cmdBuffer,
+                 mSwapchain.displayImages[imageIndex],
+                 VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+                 VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                 VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                 VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
+
+  // Now we start a renderpass. Any draw command has to be recorded in a
+  // renderpass
+  VkClearValue clearVals[2] = {
+    {
       .color.float32[0] = 0.1f,
       .color.float32[1] = 0.1f,
       .color.float32[2] = 0.2f,
       .color.float32[3] = 1.0f,
-    };
+    },
+    {
+      .depthStencil.depth = 1.0f,
+      .depthStencil.stencil = 0,
+    },
+  };
 
-    VkRenderPassBeginInfo renderPassBeginInfo{
-      .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
-      .pNext = nullptr,
-      .renderPass = mRenderInfo.renderPass,
-      .framebuffer = mSwapchain.framebuffers[bufferIndex],
-      .renderArea = {
-              .offset = {
-                .x = 0, .y = 0,
-              },
-              .extent = mSwapchain.displaySize
-      },
-      .clearValueCount = 1,
-      .pClearValues = &clearVals
+  VkRenderPassBeginInfo renderPassBeginInfo{
+    .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+    .pNext = nullptr,
+    .renderPass = mRenderInfo.renderPass,
+    .framebuffer = mSwapchain.framebuffers[imageIndex],
+    .renderArea = {
+            .offset = {
+              .x = 0, .y = 0,
+            },
+            .extent = mSwapchain.displaySize
+    },
+    .clearValueCount = 2,
+    .pClearValues = clearVals
+  };
+
+  if (runs.empty()) {
+    vkCmdBeginRenderPass(cmdBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+    RecordSurfaces(cmdBuffer, frameIndex, 0, drawCount);
+  } else {
+    vkCmdBeginRenderPass(cmdBuffer, &renderPassBeginInfo,
+                         VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+    std::vector<VkCommandBuffer> secondaryCmdBuffers;
+    secondaryCmdBuffers.reserve(runs.size());
+    for (const auto& run : runs) {
+      secondaryCmdBuffers.push_back(run.cmdBuffer);
+    }
+    vkCmdExecuteCommands(cmdBuffer, static_cast<uint32_t>(secondaryCmdBuffers.size()),
+                         secondaryCmdBuffers.data());
+  }
+
+  vkCmdEndRenderPass(cmdBuffer);
+  // transition back to swapchain image to PRESENT_SRC_KHR
+  SetImageLayout(cmdBuffer,
+                 mSwapchain.displayImages[imageIndex],
+                 VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                 VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+                 VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                 VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+  CALL_VK(vkEndCommandBuffer(cmdBuffer));
+  mRenderInfo.recordedVersions[aBufferIndex] = mSceneVersion;
+
+  const std::chrono::duration<double, std::milli> duration =
+          std::chrono::steady_clock::now() - startTime;
+  ++mRecordStats.recordCount;
+  mRecordStats.drawCount += recordedDraws;
+  mRecordStats.maxThreadCount = std::max(mRecordStats.maxThreadCount, threadCount);
+  mRecordStats.recordTime += duration.count();
+}
+
+void VulkanRenderer::BuildDrawRuns(std::vector<VulkanDrawRun>& aRuns) const {
+  aRuns.clear();
+  const size_t drawCount = mDrawList.size();
+  const size_t workerCount = mRenderInfo.recordWorkers.size();
+  bool pushed = false;
+  for (size_t begin = 0; begin < drawCount; ) {
+    const bool pushedRun = mSurfaces[mDrawList[begin]]->mPushTransform;
+    size_t end = begin + 1;
+    while (end < drawCount && mSurfaces[mDrawList[end]]->mPushTransform == pushedRun) {
+      ++end;
+    }
+    if (pushedRun) {
+      const VulkanDrawRun run = { begin, end, true, VK_NULL_HANDLE };
+      aRuns.push_back(run);
+      pushed = true;
+    } else {
+      // Only split the surfaces when every thread gets enough of them to pay
+      // for the secondary command buffer.
+      const size_t pieceCount = std::max<size_t>(1, std::min(workerCount,
+              (end - begin + kMinSurfacesPerRecordThread - 1) / kMinSurfacesPerRecordThread));
+      const size_t pieceSize = (end - begin + pieceCount - 1) / pieceCount;
+      for (size_t pieceBegin = begin; pieceBegin < end; pieceBegin += pieceSize) {
+        const VulkanDrawRun run = {
+          pieceBegin, std::min(pieceBegin + pieceSize, end), false, VK_NULL_HANDLE
+        };
+        aRuns.push_back(run);
+      }
+    }
+    begin = end;
+  }
+
+  // A single thread recording static draws doesn't need secondary command buffers.
+  if (!pushed && aRuns.size() <= 1) {
+    aRuns.clear();
+  }
+}
+
+uint32_t VulkanRenderer::RecordStaticRuns(uint32_t aBufferIndex) {
+  const uint32_t frameIndex = aBufferIndex / mSwapchain.swapchainLength;
+  const uint32_t imageIndex = aBufferIndex % mSwapchain.swapchainLength;
+  std::vector<VulkanDrawRun>& runs = mRenderInfo.drawRuns[aBufferIndex];
+  std::vector<size_t> staticRuns;
+  for (size_t i = 0; i < runs.size(); i++) {
+    if (!runs[i].pushed) {
+      staticRuns.push_back(i);
+    }
+  }
+
+  // Every job records its share of the runs into secondary command buffers
+  // of its own pool, they are executed in draw order.
+  const uint32_t threadCount = static_cast<uint32_t>(std::min(
+          mRenderInfo.recordWorkers.size(), staticRuns.size()));
+  mJobSystem.ParallelFor(threadCount, 1, [&](uint32_t aBegin, uint32_t aEnd) {
+    for (uint32_t workerIndex = aBegin; workerIndex < aEnd; workerIndex++) {
+      VulkanRecordWorker& worker = mRenderInfo.recordWorkers[workerIndex];
+      size_t cmdBufferIndex = 0;
+      for (size_t i = workerIndex; i < staticRuns.size(); i += threadCount) {
+        VulkanDrawRun& run = runs[staticRuns[i]];
+        run.cmdBuffer = GetSecondaryCommandBuffer(worker, aBufferIndex, cmdBufferIndex++);
+        RecordSecondaryCommandBuffer(run.cmdBuffer, frameIndex, imageIndex, run.begin, run.end);
+      }
+    }
+  });
+  return std::max(threadCount, 1u);
+}
+
+VkCommandBuffer VulkanRenderer::GetSecondaryCommandBuffer(VulkanRecordWorker& aWorker,
+                                                          uint32_t aBufferIndex, size_t aIndex) {
+  // Allocated the first time a recording needs that many, then reused.
+  std::vector<VkCommandBuffer>& cmdBuffers = aWorker.cmdBuffers[aBufferIndex];
+  while (cmdBuffers.size() <= aIndex) {
+    VkCommandBufferAllocateInfo cmdBufferCreateInfo{
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .pNext = nullptr,
+            .commandPool = aWorker.cmdPool,
+            .level = VK_COMMAND_BUFFER_LEVEL_SECONDARY,
+            .commandBufferCount = 1
     };
-    vkCmdBeginRenderPass(mRenderInfo.cmdBuffer[bufferIndex], &renderPassBeginInfo,
-                         VK_SUBPASS_CONTENTS_INLINE);
+    VkCommandBuffer cmdBuffer;
+    CALL_VK(vkAllocateCommandBuffers(mDeviceInfo.device, &cmdBufferCreateInfo, &cmdBuffer));
+    cmdBuffers.push_back(cmdBuffer);
+  }
+  return cmdBuffers[aIndex];
+}
+
+void VulkanRenderer::RecordSecondaryCommandBuffer(VkCommandBuffer aCmdBuffer,
+                                                  uint32_t aFrameIndex, uint32_t aImageIndex,
+                                                  size_t aBegin, size_t aEnd) {
+  VkCommandBufferInheritanceInfo inheritanceInfo{
+          .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+          .pNext = nullptr,
+          .renderPass = mRenderInfo.renderPass,
+          .subpass = 0,
+          .framebuffer = mSwapchain.framebuffers[aImageIndex],
+          .occlusionQueryEnable = VK_FALSE,
+          .queryFlags = 0,
+          .pipelineStatistics = 0,
+  };
+  VkCommandBufferBeginInfo cmdBufferBeginInfo{
+          .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+          .pNext = nullptr,
+          .flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT,
+          .pInheritanceInfo = &inheritanceInfo
+  };
+  CALL_VK(vkBeginCommandBuffer(aCmdBuffer, &cmdBufferBeginInfo));
+  RecordSurfaces(aCmdBuffer, aFrameIndex, aBegin, aEnd);
+  CALL_VK(vkEndCommandBuffer(aCmdBuffer));
+}
 
-    for (const auto& surf : mSurfaces) {
-      // Bind what is necessary to the command buffer
-      vkCmdBindPipeline(mRenderInfo.cmdBuffer[bufferIndex],
+void VulkanRenderer::RecordSurfaces(VkCommandBuffer aCmdBuffer, uint32_t aFrameIndex,
+                                    size_t aBegin, size_t aEnd) {
+  // Dynamic states aren't inherited by secondary command buffers, set them
+  // in each of them.
+  VkViewport viewport{
+    .x = 0,
+    .y = 0,
+    .width = (float)mSwapchain.displaySize.width,
+    .height = (float)mSwapchain.displaySize.height,
+    .minDepth = 0.0f,
+    .maxDepth = 1.0f,
+  };
+  VkRect2D scissor = {
+    .offset = {
+      .x = 0, .y = 0,
+    },
+    .extent = mSwapchain.displaySize,
+  };
+  vkCmdSetViewport(aCmdBuffer, 0, 1, &viewport);
+  vkCmdSetScissor(aCmdBuffer, 0, 1, &scissor);
+
+  // Geometry of all surfaces lives in the shared arenas, so the buffers are
+  // bound once and surfaces are drawn with their offsets.
+  // The draws are sorted by state, skip binding what is already bound.
+  std::vector<VkDeviceSize> boundOffsets;
+  bool indexBound = false;
+  VkPipeline boundPipeline = VK_NULL_HANDLE;
+  bool textureTableBound = false;
+  VkPipelineLayout boundLayout = VK_NULL_HANDLE;
+  VkDescriptorSet boundDescriptorSet = VK_NULL_HANDLE;
+  uint32_t boundDynamicOffset = 0;
+  for (size_t drawIndex = aBegin; drawIndex < aEnd; drawIndex++) {
+    const auto& surf = mSurfaces[mDrawList[drawIndex]];
+    // Added before its pipeline is created, draw it from the next recording.
+    if (surf->mGfxPipeline.pipeline == VK_NULL_HANDLE) {
+      continue;
+    }
+    // The culled surfaces are drawn by their indirect draw.
+    const uint32_t objectIndex = mGpuCulling.drawObjects.size() ?
+            mGpuCulling.drawObjects[drawIndex] : kNoCullObject;
+    // Bind what is necessary to the command buffer
+    if (surf->mGfxPipeline.pipeline != boundPipeline) {
+      vkCmdBindPipeline(aCmdBuffer,
                         VK_PIPELINE_BIND_POINT_GRAPHICS, surf->mGfxPipeline.pipeline);
+      boundPipeline = surf->mGfxPipeline.pipeline;
+    }
+    // The layouts using the table are compatible for it at set 0, until a
+    // surface without it binds its own set there.
+    const bool textureTable = UsesTextureTable(*surf);
+    if (textureTable && !textureTableBound) {
+      vkCmdBindDescriptorSets(aCmdBuffer,
+                              VK_PIPELINE_BIND_POINT_GRAPHICS, surf->mGfxPipeline.layout,
+                              0, 1, &mTextureTable.descriptorSet, 0, nullptr);
+      textureTableBound = true;
+    }
 
-      const VkDeviceSize offset = 0;
-      for (int i = 0; i < surf->mBuffer.vertexBuf.size(); i++) {
-        vkCmdBindVertexBuffers(mRenderInfo.cmdBuffer[bufferIndex], i, 1,
-                               &surf->mBuffer.vertexBuf[i], &offset);
+    // A single stream is addressed by vertexOffset, multiple streams
+    // (ex: glTF attributes) have to be bound at their own offsets.
+    const auto& vertexRanges = surf->mBuffer.vertexRanges;
+    std::vector<VkDeviceSize> offsets(vertexRanges.size(), 0);
+    int32_t vertexOffset = 0;
+    if (vertexRanges.size() == 1) {
+      vertexOffset = static_cast<int32_t>(mVertexGeometry.arena.GetOffset(vertexRanges[0]) /
+                                          (surf->mItemSize * sizeof(float)));
+    } else {
+      for (size_t i = 0; i < vertexRanges.size(); i++) {
+        offsets[i] = mVertexGeometry.arena.GetOffset(vertexRanges[i]);
       }
+    }
+    // The instance stream is bound after the vertex streams.
+    if (surf->mBuffer.instanceRange != VulkanGeometryArena::kInvalidRange) {
+      offsets.push_back(mVertexGeometry.arena.GetOffset(surf->mBuffer.instanceRange));
+    }
+    if (offsets.size() && offsets != boundOffsets) {
+      const std::vector<VkBuffer> buffers(offsets.size(), mVertexGeometry.buffer);
+      vkCmdBindVertexBuffers(aCmdBuffer, 0, offsets.size(),
+                             buffers.data(), offsets.data());
+      boundOffsets = offsets;
+    }
 
-      if (surf->mBuffer.indexBuf) {
-        vkCmdBindIndexBuffer(mRenderInfo.cmdBuffer[bufferIndex],
-                             surf->mBuffer.indexBuf, 0, VK_INDEX_TYPE_UINT16);
-      }
+    const bool indexed = surf->mBuffer.indexRange != VulkanGeometryArena::kInvalidRange;
+    if (indexed && !indexBound) {
+      vkCmdBindIndexBuffer(aCmdBuffer,
+                           mIndexGeometry.buffer, 0, VK_INDEX_TYPE_UINT16);
+      indexBound = true;
+    }
 
-      if (surf->mDescriptorSets.size()) {
-        vkCmdBindDescriptorSets(mRenderInfo.cmdBuffer[bufferIndex],
+    if (surf->mDescriptorSets.size()) {
+      // Select the uniform slice of this surface in the region of this frame.
+      const uint32_t dynamicOffset = static_cast<uint32_t>(
+              aFrameIndex * mUniformArena.frameSize + surf->mUBOOffset);
+      // A set bound with another layout isn't necessarily compatible.
+      if (surf->mGfxPipeline.layout != boundLayout ||
+          surf->mDescriptorSets[0] != boundDescriptorSet ||
+          (surf->mUBOSize && dynamicOffset != boundDynamicOffset)) {
+        vkCmdBindDescriptorSets(aCmdBuffer,
                                 VK_PIPELINE_BIND_POINT_GRAPHICS, surf->mGfxPipeline.layout,
-                                0, 1, &surf->mDescriptorSets[bufferIndex], 0, nullptr);
+                                textureTable ? 1 : 0, 1, &surf->mDescriptorSets[0],
+                                surf->mUBOSize ? 1 : 0, &dynamicOffset);
+        textureTableBound = textureTableBound && textureTable;
+        boundLayout = surf->mGfxPipeline.layout;
+        boundDescriptorSet = surf->mDescriptorSets[0];
+        boundDynamicOffset = dynamicOffset;
       }
+    }
 
-      // TOOD: Check index buffer data.
-      if (surf->mBuffer.indexBuf) {
-        // Draw Triangle with indexed
-        // commandBuffer, indexCount, instanceCount, firstVertex, vertexOffset, firstInstance
-        vkCmdDrawIndexed(mRenderInfo.cmdBuffer[bufferIndex],
-                         static_cast<uint32_t>(surf->mIndexData.size()), 1, 0, 0, 0);
+    const VkShaderStageFlags pushStages = textureTable ?
+            VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT : VK_SHADER_STAGE_VERTEX_BIT;
+    if (surf->mPushTransform) {
+      const Matrix4x4f mvpMtx = mProjMatrix * mViewMatrix * surf->mTransformMatrix;
+      vkCmdPushConstants(aCmdBuffer, surf->mGfxPipeline.layout, pushStages,
+                         0, sizeof(mvpMtx), &mvpMtx);
+    }
+    if (textureTable && surf->mTextures.size()) {
+      uint32_t textureSlots[kMaxSurfaceTextures] = {};
+      for (size_t i = 0; i < std::min<size_t>(surf->mTextures.size(), kMaxSurfaceTextures); i++) {
+        textureSlots[i] = surf->mTextures[i].tableSlot;
+      }
+      vkCmdPushConstants(aCmdBuffer, surf->mGfxPipeline.layout, pushStages,
+                         kPushTextureSlotsOffset, sizeof(textureSlots), textureSlots);
+    }
+
+    if (objectIndex != kNoCullObject) {
+      const VkDeviceSize drawOffset = aFrameIndex * mGpuCulling.drawFrameSize;
+      const VkDeviceSize commandOffset =
+              drawOffset + objectIndex * sizeof(VkDrawIndexedIndirectCommand);
+      if (mDeviceInfo.drawIndirectCount) {
+#ifdef VK_KHR_draw_indirect_count
+        // A culled draw is counted as 0 and skipped.
+        vkCmdDrawIndexedIndirectCountKHR(aCmdBuffer, mGpuCulling.drawBuffer, commandOffset,
+                                         mGpuCulling.drawBuffer,
+                                         drawOffset + mGpuCulling.commandSize +
+                                         objectIndex * sizeof(uint32_t),
+                                         1, sizeof(VkDrawIndexedIndirectCommand));
+#endif
       } else {
-        // Draw Triangle
-        // commandBuffer, vertexCount, instanceCount, firstVertex, firstInstance
-        vkCmdDraw(mRenderInfo.cmdBuffer[bufferIndex],
-                  surf->mVertexCount, surf->mInstanceCount, surf->mFirstVertex, surf->mFirstInstance);
+        // The culled draws have no instance.
+        vkCmdDrawIndexedIndirect(aCmdBuffer, mGpuCulling.drawBuffer, commandOffset,
+                                 1, sizeof(VkDrawIndexedIndirectCommand));
       }
+    } else if (indexed) {
+      // TOOD: Check index buffer data.
+      const uint32_t firstIndex = static_cast<uint32_t>(
+              mIndexGeometry.arena.GetOffset(surf->mBuffer.indexRange) / sizeof(uint16_t));
+      // Draw Triangle with indexed
+      // commandBuffer, indexCount, instanceCount, firstIndex, vertexOffset, firstInstance
+      vkCmdDrawIndexed(aCmdBuffer,
+                       static_cast<uint32_t>(surf->mIndexData.size()), surf->mInstanceCount,
+                       firstIndex, vertexOffset, 0);
+    } else {
+      // Draw Triangle
+      // commandBuffer, vertexCount, instanceCount, firstVertex, firstInstance
+      vkCmdDraw(aCmdBuffer,
+                surf->mVertexCount, surf->mInstanceCount, surf->mFirstVertex + vertexOffset,
+                surf->mFirstInstance);
     }
+  }
+}
 
-    vkCmdEndRenderPass(mRenderInfo.cmdBuffer[bufferIndex]);
-    // transition back to swapchain image to PRESENT_SRC_KHR
-    SetImageLayout(mRenderInfo.cmdBuffer[bufferIndex],
-                   mSwapchain.displayImages[bufferIndex],
-                   VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-                   VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
-                   VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-                   VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
-    CALL_VK(vkEndCommandBuffer(mRenderInfo.cmdBuffer[bufferIndex]));
+void VulkanRenderer::SetRecordThreadCount(uint32_t aCount) {
+  aCount = std::max(aCount, 1u);
+  if (aCount == mRecordThreadCount) {
+    return;
+  }
+  mRecordThreadCount = aCount;
+  mJobSystem.Init(mRecordThreadCount - 1);
+  if (!mRenderInfo.cmdBuffer) {
+    return;
   }
 
-  CreateSyncObjects();
+  // The frames in flight might execute secondary command buffers of the old workers.
+  CALL_VK(vkDeviceWaitIdle(mDeviceInfo.device));
+  DeleteRecordWorkers();
+  CreateRecordWorkers();
+  MarkSceneDirty();
+}
+
+void VulkanRenderer::CreateRecordWorkers() {
+  mRenderInfo.recordWorkers.resize(mRecordThreadCount);
+  for (auto& worker : mRenderInfo.recordWorkers) {
+    CreateRecordWorker(worker);
+  }
+  CreateRecordWorker(mRenderInfo.pushWorker);
+  mRenderInfo.drawRuns.assign(mRenderInfo.cmdBufferLen, std::vector<VulkanDrawRun>());
+}
+
+void VulkanRenderer::CreateRecordWorker(VulkanRecordWorker& aWorker) {
+  VkCommandPoolCreateInfo cmdPoolCreateInfo{
+          .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+          .pNext = nullptr,
+          .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+          .queueFamilyIndex = mDeviceInfo.queueFamilyIndex,
+  };
+  CALL_VK(vkCreateCommandPool(mDeviceInfo.device, &cmdPoolCreateInfo, nullptr,
+                              &aWorker.cmdPool));
+  aWorker.cmdBuffers.assign(mRenderInfo.cmdBufferLen, std::vector<VkCommandBuffer>());
+}
+
+void VulkanRenderer::DeleteRecordWorkers() {
+  // Destroying the pool frees its command buffers.
+  for (const auto& worker : mRenderInfo.recordWorkers) {
+    vkDestroyCommandPool(mDeviceInfo.device, worker.cmdPool, nullptr);
+  }
+  mRenderInfo.recordWorkers.clear();
+  vkDestroyCommandPool(mDeviceInfo.device, mRenderInfo.pushWorker.cmdPool, nullptr);
+  mRenderInfo.pushWorker = VulkanRecordWorker();
+  mRenderInfo.drawRuns.clear();
+}
+
+void VulkanRenderer::LogRecordStats() {
+  if (mRecordStats.recordCount) {
+    LOG_I(gAppName.data(), "Recorded %u command buffers in %u frames, %zu draws on up to %u "
+          "thread(s) in %.3f ms on average.", mRecordStats.recordCount, kMemoryStatsLogInterval,
+          mRecordStats.drawCount / mRecordStats.recordCount, mRecordStats.maxThreadCount,
+          mRecordStats.recordTime / mRecordStats.recordCount);
+  }
+  mRecordStats = VulkanRecordStats();
 }
 
 //VkCommandBuffer VulkanRenderer::CreateCommandBuffer(VkCommandBufferLevel level, bool begin) {
@@ -1381,39 +3267,10 @@ bool VulkanRenderer::CreateImage(const char* aFilePath, RenderSurface::VulkanTex
     useStaging = !(formatProperties.linearTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT);
   }
 
-  VkMemoryAllocateInfo memoryAllocateInfo {
-          .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-  };
-  VkMemoryRequirements memReq  = {};
   ktx_uint8_t* ktxImageData   = ktxTexture_GetData(ktxTexture);
-  ktx_size_t   ktxTextureSize = ktxTexture_GetSize(ktxTexture);
   aUseStaging = useStaging;
 
   if (useStaging) {
-    VkBuffer       stagingBuffer;
-    VkDeviceMemory stagingMemory;
-    VkBufferCreateInfo bufferCreateInfo {
-            .size = ktxTextureSize,
-            // This buffer is used as a transfer source for the buffer copy
-            .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-            .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
-    };
-
-    CALL_VK(vkCreateBuffer(mDeviceInfo.device, &bufferCreateInfo, nullptr, &stagingBuffer));
-    vkGetBufferMemoryRequirements(mDeviceInfo.device, stagingBuffer, &memReq);
-    memoryAllocateInfo.allocationSize = memReq.size;
-    MapMemoryTypeToIndex(memReq.memoryTypeBits,
-                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                         VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                         &memoryAllocateInfo.memoryTypeIndex);
-    CALL_VK(vkAllocateMemory(mDeviceInfo.device, &memoryAllocateInfo, nullptr, &stagingMemory));
-    CALL_VK(vkBindBufferMemory(mDeviceInfo.device, stagingBuffer, stagingMemory, 0));
-
-    uint8_t* data;
-    CALL_VK(vkMapMemory(mDeviceInfo.device, stagingMemory, 0, memReq.size, 0, (void **)&data));
-    memcpy(data, ktxImageData, ktxTextureSize);
-    vkUnmapMemory(mDeviceInfo.device, stagingMemory);
-
     // Create optimal tiled target image on the device
     VkImageCreateInfo imageCreateInfo {
             .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
@@ -1430,15 +3287,11 @@ bool VulkanRenderer::CreateImage(const char* aFilePath, RenderSurface::VulkanTex
     };
     CALL_VK(vkCreateImage(mDeviceInfo.device, &imageCreateInfo, nullptr, &aTexture.image));
 
-    vkGetImageMemoryRequirements(mDeviceInfo.device, aTexture.image, &memReq);
-    memoryAllocateInfo.allocationSize = memReq.size;
-    MapMemoryTypeToIndex(memReq.memoryTypeBits,
-                         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                         &memoryAllocateInfo.memoryTypeIndex);
-    CALL_VK(vkAllocateMemory(mDeviceInfo.device, &memoryAllocateInfo, nullptr, &aTexture.deviceMemory));
-    CALL_VK(vkBindImageMemory(mDeviceInfo.device, aTexture.image, aTexture.deviceMemory, 0));
-
-    VkCommandBuffer copyCommand = BeginSingleTimeCommands();//CreateCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+    if (!AllocateImageMemory(aTexture.image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                             false, aTexture.deviceMemory)) {
+      LOG_E(gAppName.data(), "%s: Allocate image memory failed.", aFilePath);
+      assert(false);
+    }
 
     // Image memory barriers for the texture image
     // The sub resource range describes the regions of the image that will be transitioned using the memory barriers below
@@ -1466,7 +3319,7 @@ bool VulkanRenderer::CreateImage(const char* aFilePath, RenderSurface::VulkanTex
     // Source pipeline stage is host write/read exection (VK_PIPELINE_STAGE_HOST_BIT)
     // Destination pipeline stage is copy command exection (VK_PIPELINE_STAGE_TRANSFER_BIT)
     vkCmdPipelineBarrier(
-            copyCommand,
+            mUploadContext.GetCommandBuffer(),
             VK_PIPELINE_STAGE_HOST_BIT,
             VK_PIPELINE_STAGE_TRANSFER_BIT,
             0,
@@ -1474,36 +3327,19 @@ bool VulkanRenderer::CreateImage(const char* aFilePath, RenderSurface::VulkanTex
             0, nullptr,
             1, &imageMemoryBarrier);
 
-    // Setup buffer copy regions for each mip level
-    std::vector<VkBufferImageCopy> bufferCopyRegions;
-
+    // Copy mip levels through the staging ring
+    const uint32_t texelSize = 4;
     for (int i = 0; i < aTexture.mipLevels; i++) {
       ktx_size_t        offset;
       if (ktxTexture_GetImageOffset(ktxTexture, i, 0, 0, &offset) != KTX_SUCCESS) {
         LOG_E(gAppName.data(), "%s: Create mipmap level failed,", aFilePath);
         continue;
       }
-      VkBufferImageCopy bufferCopyRegion               = {};
-      bufferCopyRegion.imageSubresource.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT;
-      bufferCopyRegion.imageSubresource.mipLevel       = i;
-      bufferCopyRegion.imageSubresource.baseArrayLayer = 0;
-      bufferCopyRegion.imageSubresource.layerCount     = 1;
-      bufferCopyRegion.imageExtent.width               = ktxTexture->baseWidth >> i;
-      bufferCopyRegion.imageExtent.height              = ktxTexture->baseHeight >> i;
-      bufferCopyRegion.imageExtent.depth               = 1;
-      bufferCopyRegion.bufferOffset                    = offset;
-      bufferCopyRegions.push_back(bufferCopyRegion);
+      UploadImage(aTexture.image, i, std::max(ktxTexture->baseWidth >> i, 1u),
+                  std::max(ktxTexture->baseHeight >> i, 1u), texelSize,
+                  ktxImageData + offset);
     }
 
-    // Copy mip levels from staging buffer
-    vkCmdCopyBufferToImage(
-            copyCommand,
-            stagingBuffer,
-            aTexture.image,
-            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-            static_cast<uint32_t>(bufferCopyRegions.size()),
-            bufferCopyRegions.data());
-
     // Once the data has been uploaded we transfer to the texture image to the shader read layout, so it can be sampled from
     imageMemoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
     imageMemoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
@@ -1514,7 +3350,7 @@ bool VulkanRenderer::CreateImage(const char* aFilePath, RenderSurface::VulkanTex
     // Source pipeline stage stage is copy command exection (VK_PIPELINE_STAGE_TRANSFER_BIT)
     // Destination pipeline stage fragment shader access (VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT)
     vkCmdPipelineBarrier(
-            copyCommand,
+            mUploadContext.GetCommandBuffer(),
             VK_PIPELINE_STAGE_TRANSFER_BIT,
             VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
             0,
@@ -1524,17 +3360,10 @@ bool VulkanRenderer::CreateImage(const char* aFilePath, RenderSurface::VulkanTex
 
     // Store current layout for later reuse
     aTexture.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-
-    //FlushCommandBuffer(copyCommand, mDeviceInfo.graphicsQueue, true);
-    EndSingleTimeCommands(copyCommand);
-
-    // Clean up staging resources
-    vkFreeMemory(mDeviceInfo.device, stagingMemory, nullptr);
-    vkDestroyBuffer(mDeviceInfo.device, stagingBuffer, nullptr);
   } else {
     // Copy data to a linear tiled image
-    VkImage        mappableImage;
-    VkDeviceMemory mappableMemory;
+    VkImage          mappableImage;
+    VulkanAllocation mappableMemory;
 
     // Load mip map level 0 to linear tiling image
     VkImageCreateInfo imageCreateInfo {
@@ -1553,24 +3382,18 @@ bool VulkanRenderer::CreateImage(const char* aFilePath, RenderSurface::VulkanTex
 
     CALL_VK(vkCreateImage(mDeviceInfo.device, &imageCreateInfo, nullptr, &mappableImage));
 
-    // Get memory requirements for this image like size and alignment
-    vkGetImageMemoryRequirements(mDeviceInfo.device, mappableImage, &memReq);
-    // Set memory allocation size to required memory size
-    memoryAllocateInfo.allocationSize = memReq.size;
-    // Get memory type that can be mapped to host memory
-    MapMemoryTypeToIndex(memReq.memoryTypeBits,
-                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                         &memoryAllocateInfo.memoryTypeIndex);
-    CALL_VK(vkAllocateMemory(mDeviceInfo.device, &memoryAllocateInfo, nullptr, &mappableMemory));
-    CALL_VK(vkBindImageMemory(mDeviceInfo.device, mappableImage, mappableMemory, 0));
-
-    // Map image memory
-    void* data;
+    // Get memory type that can be mapped to host memory, linear tiled images
+    // share the pools of buffers.
+    if (!AllocateImageMemory(mappableImage,
+                             VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                             true, mappableMemory)) {
+      LOG_E(gAppName.data(), "%s: Allocate image memory failed.", aFilePath);
+      assert(false);
+    }
+
     ktx_size_t ktxImageSize = ktxTexture_GetImageSize(ktxTexture, 0);
-    CALL_VK(vkMapMemory(mDeviceInfo.device, mappableMemory, 0, memReq.size, 0, &data));
-    // Copy image data of the first mip level into memory
-    memcpy(data, ktxImageData, ktxImageSize);
-    vkUnmapMemory(mDeviceInfo.device, mappableMemory);
+    // Copy image data of the first mip level into the persistently mapped memory
+    memcpy(mappableMemory.mappedData, ktxImageData, ktxImageSize);
 
     // Linear tiled images don't need to be staged and can be directly used as textures
     aTexture.image = mappableImage;
@@ -1578,8 +3401,6 @@ bool VulkanRenderer::CreateImage(const char* aFilePath, RenderSurface::VulkanTex
     aTexture.imageLayout  = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 
     // Setup image memory barrier transfer image to shader read layout
-    VkCommandBuffer copyCommand = BeginSingleTimeCommands(); //CreateCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
-
     // The sub resource range describes the regions of the image we will be transition
     VkImageSubresourceRange subresourceRange {
             .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
@@ -1605,16 +3426,13 @@ bool VulkanRenderer::CreateImage(const char* aFilePath, RenderSurface::VulkanTex
     // Source pipeline stage is host write/read execution (VK_PIPELINE_STAGE_HOST_BIT)
     // Destination pipeline stage fragment shader access (VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT)
     vkCmdPipelineBarrier(
-            copyCommand,
+            mUploadContext.GetCommandBuffer(),
             VK_PIPELINE_STAGE_HOST_BIT,
             VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
             0,
             0, nullptr,
             0, nullptr,
             1, &imageMemoryBarrier);
-
-    //FlushCommandBuffer(copyCommand, mDeviceInfo.graphicsQueue, true);
-    EndSingleTimeCommands(copyCommand);
   }
 
   return true;
@@ -1624,6 +3442,7 @@ bool VulkanRenderer::CreateTextureFromFile(const char* aFilePath, std::shared_pt
   bool useStaging = true;
   RenderSurface::VulkanTexture texture;
   CreateImage(aFilePath, texture, useStaging);
+  aSurf->mUploadTicket = mUploadContext.GetRecordingTicket();
 
   // Create a texture sampler
   VkSamplerCreateInfo samplerInfo {
@@ -1669,6 +3488,9 @@ bool VulkanRenderer::CreateTextureFromFile(const char* aFilePath, std::shared_pt
     .image = texture.image,
   };
   CALL_VK(vkCreateImageView(mDeviceInfo.device, &view, nullptr, &texture.view));
+  if (aSurf->mUseTextureTable) {
+    AddToTextureTable(texture);
+  }
   aSurf->mTextures.push_back(texture);
 
   return true;
@@ -1677,7 +3499,6 @@ bool VulkanRenderer::CreateTextureFromFile(const char* aFilePath, std::shared_pt
 bool VulkanRenderer::CreateTextureFromBuffer(const char* aBuffer, int aTexWidth, int aTexHeight,
                                              int aComponent, std::shared_ptr<RenderSurface> aSurf) {
   RenderSurface::VulkanTexture texture;
-  const VkDeviceSize imageSize = aTexWidth * aTexHeight * aComponent;
 
   if (!aBuffer) {
     LOG_E(gAppName.data(), "buffer is a nullptr from CreateTextureFromBuffer.");
@@ -1690,17 +3511,8 @@ bool VulkanRenderer::CreateTextureFromBuffer(const char* aBuffer, int aTexWidth,
   texture.mipLevels = 0;
   texture.format = format;
 
-  VkBuffer stagingBuffer;
-  VkDeviceMemory stagingBufferMemory;
-  CreateBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
-  void* data;
-  vkMapMemory(mDeviceInfo.device, stagingBufferMemory, 0, imageSize, 0, &data);
-  memcpy(data, aBuffer, static_cast<size_t>(imageSize));
-  vkUnmapMemory(mDeviceInfo.device, stagingBufferMemory);
-
   VkImage textureImage;
-  VkDeviceMemory textureImageMemory;
+  VulkanAllocation textureImageMemory;
 
   // createImage
   VkImageCreateInfo imageInfo{};
@@ -1723,57 +3535,23 @@ bool VulkanRenderer::CreateTextureFromBuffer(const char* aBuffer, int aTexWidth,
     return false;
   }
 
-  VkMemoryRequirements memRequirements;
-  vkGetImageMemoryRequirements(mDeviceInfo.device, textureImage, &memRequirements);
-
-  VkMemoryAllocateInfo allocInfo{};
-  allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  allocInfo.allocationSize = memRequirements.size;
-  MapMemoryTypeToIndex(memRequirements.memoryTypeBits,
-          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &allocInfo.memoryTypeIndex);
-
-  if (vkAllocateMemory(mDeviceInfo.device, &allocInfo, nullptr, &textureImageMemory) != VK_SUCCESS) {
+  if (!AllocateImageMemory(textureImage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                           false, textureImageMemory)) {
     LOG_E(gAppName.data(), "failed to allocate image memory!");
     return false;
   }
 
-  vkBindImageMemory(mDeviceInfo.device, textureImage, textureImageMemory, 0);
-  VkCommandBuffer commandBuffer = BeginSingleTimeCommands();
-  SetImageLayout(commandBuffer, textureImage, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-          VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
-  EndSingleTimeCommands(commandBuffer);
-
-  commandBuffer = BeginSingleTimeCommands();
-
-  VkBufferImageCopy region{};
-  region.bufferOffset = 0;
-  region.bufferRowLength = 0;
-  region.bufferImageHeight = 0;
-  region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-  region.imageSubresource.mipLevel = 0;
-  region.imageSubresource.baseArrayLayer = 0;
-  region.imageSubresource.layerCount = 1;
-  region.imageOffset = {0, 0, 0};
-  region.imageExtent = {
-          (uint32_t)aTexWidth,
-          (uint32_t)aTexHeight,
-          1
-  };
-
-  vkCmdCopyBufferToImage(commandBuffer, stagingBuffer, textureImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+  SetImageLayout(mUploadContext.GetCommandBuffer(), textureImage, VK_IMAGE_LAYOUT_UNDEFINED,
+                 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                 VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
 
-  // EndSingleTimeCommands(commandBuffer);
-  // commandBuffer = BeginSingleTimeCommands();
-  //  SetImageLayout(commandBuffer, textureImage, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-  //                 VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
-  EndSingleTimeCommands(commandBuffer);
+  UploadImage(textureImage, 0, aTexWidth, aTexHeight, aComponent,
+              reinterpret_cast<const uint8_t*>(aBuffer));
 
-  // transitionImageLayout(textureImage, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-  // copyBufferToImage(stagingBuffer, textureImage, static_cast<uint32_t>(texWidth), static_cast<uint32_t>(texHeight));
-  //transitionImageLayout(textureImage, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-
-  vkDestroyBuffer(mDeviceInfo.device, stagingBuffer, nullptr);
-  vkFreeMemory(mDeviceInfo.device, stagingBufferMemory, nullptr);
+  SetImageLayout(mUploadContext.GetCommandBuffer(), textureImage,
+                 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                 VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+  aSurf->mUploadTicket = mUploadContext.GetRecordingTicket();
 
   texture.deviceMemory = textureImageMemory;
   texture.image = textureImage;
@@ -1823,6 +3601,9 @@ bool VulkanRenderer::CreateTextureFromBuffer(const char* aBuffer, int aTexWidth,
 
   samplerInfo.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE;
   CALL_VK(vkCreateSampler(mDeviceInfo.device, &samplerInfo, nullptr, &texture.sampler));
+  if (aSurf->mUseTextureTable) {
+    AddToTextureTable(texture);
+  }
   aSurf->mTextures.push_back(texture);
 
   return true;
@@ -1832,91 +3613,129 @@ bool VulkanRenderer::IsReady() {
   return mInitialized;
 }
 
-void VulkanRenderer::DestroyShaderModule(VkShaderModule aShader) {
-  vkDestroyShaderModule(mDeviceInfo.device, aShader, nullptr);
-}
-
-void VulkanRenderer::DeleteSwapChain() {
-  for (int i = 0; i < mSwapchain.displayImages.size(); i++) {
+void VulkanRenderer::DeleteFrameBuffers() {
+  // The images belong to the swapchain, it destroys them.
+  for (size_t i = 0; i < mSwapchain.displayImages.size(); i++) {
     vkDestroyFramebuffer(mDeviceInfo.device, mSwapchain.framebuffers[i], nullptr);
     vkDestroyImageView(mDeviceInfo.device, mSwapchain.displayViews[i], nullptr);
-    vkDestroyImage(mDeviceInfo.device, mSwapchain.displayImages[i], nullptr);
-
-    for (const auto& surf : mSurfaces) {
-      vkDestroyBuffer(mDeviceInfo.device, surf->mUniformBuffers[i], nullptr);
-      vkFreeMemory(mDeviceInfo.device, surf->mUniformBuffersMemory[i], nullptr);
-    }
   }
+  mSwapchain.framebuffers.clear();
+  mSwapchain.displayViews.clear();
+  mSwapchain.displayImages.clear();
+}
+
+void VulkanRenderer::DeleteSwapChain() {
+  DeleteFrameBuffers();
+  DeleteDepthBuffer();
   vkDestroySwapchainKHR(mDeviceInfo.device, mSwapchain.swapchain, nullptr);
+  mSwapchain.swapchain = VK_NULL_HANDLE;
 }
 
-void VulkanRenderer::DeleteGraphicsPipeline() {
-  for (auto& surf : mSurfaces) {
-    if (surf->mGfxPipeline.pipeline == VK_NULL_HANDLE) {
-      continue;
-    }
-    vkDestroyPipeline(mDeviceInfo.device, surf->mGfxPipeline.pipeline, nullptr);
-    vkDestroyPipelineCache(mDeviceInfo.device, surf->mGfxPipeline.cache, nullptr);
-    vkDestroyPipelineLayout(mDeviceInfo.device, surf->mGfxPipeline.layout, nullptr);
+void VulkanRenderer::DeleteGraphicsPipeline(const std::shared_ptr<RenderSurface>& aSurf,
+                                            bool aInFlight) {
+  // A pipeline it asked for might still be compiling, don't hand it over later.
+  for (const auto& pending : mPendingPipelines) {
+    auto& surfaces = pending->surfaces;
+    surfaces.erase(std::remove(surfaces.begin(), surfaces.end(), aSurf), surfaces.end());
+  }
+  if (aSurf->mGfxPipeline.pipeline == VK_NULL_HANDLE) {
+    return;
+  }
+  // The pipeline and its layout are destroyed with their last surface.
+  if (aInFlight) {
+    const size_t frameCount = mRenderInfo.frames.size();
+    VulkanFrame& frame =
+            mRenderInfo.frames[(mRenderInfo.currentFrame + frameCount - 1) % frameCount];
+    frame.deferredPipelines.push_back(aSurf->mGfxPipeline.pipeline);
+  } else {
+    mPipelineLibrary.Release(aSurf->mGfxPipeline.pipeline);
   }
+  aSurf->mGfxPipeline = RenderSurface::VulkanGfxPipelineInfo();
 }
 
-void VulkanRenderer::DeleteTextures() {
+void VulkanRenderer::DeleteTextures(const std::shared_ptr<RenderSurface>& aSurf) {
   // delete from surface
-  for (const auto& surf : mSurfaces) {
-    for (const auto& tex : surf->mTextures) {
-      vkDestroyImage(mDeviceInfo.device, tex.image, nullptr);
-      vkDestroyImageView(mDeviceInfo.device, tex.view, nullptr);
-      vkDestroySampler(mDeviceInfo.device, tex.sampler, nullptr);
-      vkFreeMemory(mDeviceInfo.device, tex.deviceMemory, nullptr);
+  for (auto& tex : aSurf->mTextures) {
+    vkDestroyImage(mDeviceInfo.device, tex.image, nullptr);
+    vkDestroyImageView(mDeviceInfo.device, tex.view, nullptr);
+    vkDestroySampler(mDeviceInfo.device, tex.sampler, nullptr);
+    mAllocator.Free(tex.deviceMemory);
+    if (tex.tableSlot != kNoTextureSlot) {
+      mTextureTable.freeSlots.push_back(tex.tableSlot);
     }
-    surf->mTextures.clear();
   }
+  aSurf->mTextures.clear();
 }
 
-void VulkanRenderer::DeleteBuffers() {
-  for (const auto& surf : mSurfaces) {
-    for (const auto& vtxBuf : surf->mBuffer.vertexBuf) {
-      vkDestroyBuffer(mDeviceInfo.device, vtxBuf, nullptr);
-    }
+void VulkanRenderer::DeleteBuffers(const std::shared_ptr<RenderSurface>& aSurf) {
+  // Give the ranges back to the arenas, CompactGeometry() merges the holes.
+  // The callers wait for the device to be idle first.
+  for (const auto& range : aSurf->mBuffer.vertexRanges) {
+    mVertexGeometry.arena.Free(range);
+  }
+  aSurf->mBuffer.vertexRanges.clear();
+  mVertexGeometry.arena.Free(aSurf->mBuffer.instanceRange);
+  aSurf->mBuffer.instanceRange = VulkanGeometryArena::kInvalidRange;
 
-    for (const auto& vtxBufMem : surf->mBuffer.vertexBufMemory) {
-      vkFreeMemory(mDeviceInfo.device, vtxBufMem, nullptr);
-    }
+  mIndexGeometry.arena.Free(aSurf->mBuffer.indexRange);
+  aSurf->mBuffer.indexRange = VulkanGeometryArena::kInvalidRange;
 
-    surf->mBuffer.vertexBuf.clear();
-    surf->mBuffer.vertexBufMemory.clear();
+  mUniformArena.slices.Free(aSurf->mUBORange);
+  aSurf->mUBORange = VulkanGeometryArena::kInvalidRange;
+  aSurf->mUBOOffset = 0;
+  aSurf->mUBOSize = 0;
+}
 
-    if (surf->mBuffer.indexBuf) {
-      vkDestroyBuffer(mDeviceInfo.device, surf->mBuffer.indexBuf, nullptr);
-      vkFreeMemory(mDeviceInfo.device, surf->mBuffer.indexBufMemory, nullptr);
-    }
+void VulkanRenderer::ReleaseDescriptorSets(const std::shared_ptr<RenderSurface>& aSurf) {
+  for (const auto& descriptorSet : aSurf->mDescriptorSets) {
+    mDescriptorAllocator.ReleasePersistentSet(descriptorSet);
   }
+  aSurf->mDescriptorSets.clear();
 }
 
-void VulkanRenderer::DeleteDescriptors() {
-  for (const auto& surf : mSurfaces) {
-    if (surf->mDescriptorSetLayout != VK_NULL_HANDLE) {
-      vkDestroyDescriptorSetLayout(mDeviceInfo.device, surf->mDescriptorSetLayout, nullptr);
-    }
-    if (surf->mDescriptorPool != VK_NULL_HANDLE) {
-      vkDestroyDescriptorPool(mDeviceInfo.device, surf->mDescriptorPool, nullptr);
-    }
-  }
+void VulkanRenderer::DeleteDescriptors(const std::shared_ptr<RenderSurface>& aSurf) {
+  ReleaseDescriptorSets(aSurf);
+  // The layout is owned by the descriptor allocator.
+  aSurf->mDescriptorSetLayout = VK_NULL_HANDLE;
 }
 
 void VulkanRenderer::Terminate() {
-  vkFreeCommandBuffers(mDeviceInfo.device, mRenderInfo.cmdPool, mRenderInfo.cmdBufferLen,
-                       mRenderInfo.cmdBuffer);
-  delete[] mRenderInfo.cmdBuffer;
+  // Wait for the frames in flight and the pending uploads before releasing
+  // their resources.
+  CALL_VK(vkDeviceWaitIdle(mDeviceInfo.device));
+  mJobSystem.Terminate();
+  // Compiles which haven't started are dropped, the finished ones are handed
+  // to their surfaces and released with them below.
+  mPipelineJobs.Terminate();
+  ResolvePipelines();
+  mPendingPipelines.clear();
+  DeleteGpuCulling();
+  mUploadContext.Terminate();
+  DeleteSyncObjects();
+  DeleteCommandBuffers();
 
   vkDestroyCommandPool(mDeviceInfo.device, mRenderInfo.cmdPool, nullptr);
   vkDestroyRenderPass(mDeviceInfo.device, mRenderInfo.renderPass, nullptr);
   DeleteSwapChain();
-  DeleteGraphicsPipeline();
-  DeleteBuffers();
-  DeleteTextures();
-  DeleteDescriptors();
+  for (const auto& surf : mSurfaces) {
+    DeleteGraphicsPipeline(surf);
+    DeleteBuffers(surf);
+    DeleteTextures(surf);
+    DeleteDescriptors(surf);
+  }
+  DeleteTextureTable();
+  mDescriptorAllocator.Terminate();
+  mPipelineLibrary.Terminate();
+  mShaderCache.Terminate();
+  DeletePipelineCache();
+  DeleteGeometryBuffer(mVertexGeometry);
+  DeleteGeometryBuffer(mIndexGeometry);
+  vkDestroyBuffer(mDeviceInfo.device, mStagingBuffer, nullptr);
+  mAllocator.Free(mStagingMemory);
+  vkDestroyBuffer(mDeviceInfo.device, mUniformArena.buffer, nullptr);
+  mAllocator.Free(mUniformArena.memory);
+  mUniformArena.slices.Terminate();
+  mAllocator.Terminate();
 
   if (enableValidationLayers && mDeviceInfo.debugReportCallback != VK_NULL_HANDLE) {
     vkDestroyDebugReportCallbackEXT(mDeviceInfo.instance, mDeviceInfo.debugReportCallback, nullptr);
@@ -1930,46 +3749,185 @@ void VulkanRenderer::Terminate() {
 }
 
 void VulkanRenderer::RenderFrame() {
+  const uint32_t frameIndex = mRenderInfo.currentFrame;
+  VulkanFrame& frame = mRenderInfo.frames[frameIndex];
+  // Only wait for the last frame using this slot, the newer ones keep the GPU busy.
+  CALL_VK(vkWaitForFences(mDeviceInfo.device, 1, &frame.fence, VK_TRUE, UINT64_MAX));
+  ReleaseDeferredFrees(frame);
+
   uint32_t nextIndex;
   // Get the framebuffer index we should draw in
-  CALL_VK(vkAcquireNextImageKHR(mDeviceInfo.device, mSwapchain.swapchain,
-                                UINT64_MAX,  mRenderInfo.semaphore, VK_NULL_HANDLE,
-                                &nextIndex));
-  UpdateUniformBuffer(nextIndex);
+  VkResult result = vkAcquireNextImageKHR(mDeviceInfo.device, mSwapchain.swapchain,
+                                          UINT64_MAX, frame.imageAvailable, VK_NULL_HANDLE,
+                                          &nextIndex);
+  if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+    // The surface was resized or rotated, no image was acquired.
+    RecreateSwapChain(mSwapchainConfig);
+    return;
+  }
+  // A suboptimal image can still be presented, we recreate after presenting it.
+  if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
+    LOG_E(gAppName.data(), "vkAcquireNextImageKHR failed, error %d.", result);
+    assert(false);
+    return;
+  }
+  bool outdated = result == VK_SUBOPTIMAL_KHR;
+
+  // Surfaces whose pipeline finished compiling are drawn from this frame.
+  ResolvePipelines();
+  // The camera or the surfaces moved since the last frame.
+  UpdateDrawList();
+
+  // The slot's fence was waited above, so its command buffer isn't pending
+  // and can be re-recorded if the scene changed since it was recorded. The
+  // pushed transforms of this frame only re-record their own runs.
+  const uint32_t bufferIndex = frameIndex * mSwapchain.swapchainLength + nextIndex;
+  if (mRenderInfo.recordedVersions[bufferIndex] != mSceneVersion || mDrawsPushTransforms) {
+    RecordCommandBuffer(bufferIndex);
+  }
+  UpdateUniformBuffer(frameIndex);
+  UpdateCullObjects(frameIndex);
+  // Submit the uploads recorded since the last frame ahead of the frame itself.
+  FlushUploads();
 
-  // TODO: add VkSemaphore when vulkan is running in multi-thread.
-  CALL_VK(vkResetFences(mDeviceInfo.device, 1, &mRenderInfo.fence));
+  CALL_VK(vkResetFences(mDeviceInfo.device, 1, &frame.fence));
 
   VkPipelineStageFlags waitStageMask =
           VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
   VkSubmitInfo submit_info = {.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
           .pNext = nullptr,
           .waitSemaphoreCount = 1,
-          .pWaitSemaphores = &mRenderInfo.semaphore,
+          .pWaitSemaphores = &frame.imageAvailable,
           .pWaitDstStageMask = &waitStageMask,
           .commandBufferCount = 1,
-          .pCommandBuffers = &mRenderInfo.cmdBuffer[nextIndex],
-          .signalSemaphoreCount = 0,
-          .pSignalSemaphores = nullptr};
-  CALL_VK(vkQueueSubmit(mDeviceInfo.presentqueue, 1, &submit_info, mRenderInfo.fence));
-  CALL_VK(vkWaitForFences(mDeviceInfo.device, 1, &mRenderInfo.fence, VK_TRUE, 100000000));
+          .pCommandBuffers = &mRenderInfo.cmdBuffer[bufferIndex],
+          .signalSemaphoreCount = 1,
+          .pSignalSemaphores = &frame.renderFinished};
+  CALL_VK(vkQueueSubmit(mDeviceInfo.presentqueue, 1, &submit_info, frame.fence));
 
-  VkResult result;
   VkPresentInfoKHR presentInfo{
           .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
           .pNext = nullptr,
           .swapchainCount = 1,
           .pSwapchains = &mSwapchain.swapchain,
           .pImageIndices = &nextIndex,
-          .waitSemaphoreCount = 0,
-          .pWaitSemaphores = nullptr,
-          .pResults = &result,
+          .waitSemaphoreCount = 1,
+          .pWaitSemaphores = &frame.renderFinished,
+          .pResults = nullptr,
   };
-  vkQueuePresentKHR(mDeviceInfo.presentqueue, &presentInfo);
+  result = vkQueuePresentKHR(mDeviceInfo.presentqueue, &presentInfo);
+  mRenderInfo.currentFrame = (frameIndex + 1) % mRenderInfo.frames.size();
+  if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR) {
+    outdated = true;
+  }
+  // On Android, rotating the device makes the swapchain suboptimal until it
+  // is recreated with the new pre-transform.
+  if (outdated) {
+    RecreateSwapChain(mSwapchainConfig);
+  }
+
+  if (++mFrameCount % kMemoryStatsLogInterval == 0) {
+    LogMemoryStats();
+    LogRecordStats();
+  }
+}
+
+void VulkanRenderer::GetMemoryStats(VulkanMemoryStats& aStats) {
+  aStats = VulkanMemoryStats();
+  for (uint32_t i = 0; i < MemoryCategory_Count; i++) {
+    aStats.categoryUsage[i] = mAllocator.GetCategoryUsage(static_cast<MemoryCategory>(i));
+  }
+  // Swapchain images are allocated by the driver, estimate them from the
+  // R8G8B8A8 format we pick in CreateSwapChain().
+  aStats.categoryUsage[MemoryCategory_Swapchain] += (VkDeviceSize)mSwapchain.displaySize.width *
+          mSwapchain.displaySize.height * 4 * mSwapchain.swapchainLength;
+  aStats.deviceMemoryCount = mAllocator.GetDeviceMemoryCount();
+
+  const VkPhysicalDeviceMemoryProperties& memoryProperties = mDeviceInfo.memoryProperties;
+  aStats.heapCount = memoryProperties.memoryHeapCount;
+  for (uint32_t i = 0; i < aStats.heapCount; i++) {
+    aStats.heapSize[i] = memoryProperties.memoryHeaps[i].size;
+    aStats.heapAllocated[i] = mAllocator.GetHeapAllocatedSize(i);
+  }
+
+#if defined(VK_KHR_get_physical_device_properties2) && defined(VK_EXT_memory_budget)
+  if (mDeviceInfo.memoryBudget && vkGetPhysicalDeviceMemoryProperties2KHR) {
+    VkPhysicalDeviceMemoryBudgetPropertiesEXT budgetProperties{
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT,
+      .pNext = nullptr,
+    };
+    VkPhysicalDeviceMemoryProperties2KHR memoryProperties2{
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2_KHR,
+      .pNext = &budgetProperties,
+    };
+    vkGetPhysicalDeviceMemoryProperties2KHR(mDeviceInfo.gpuDevice, &memoryProperties2);
+    // Usage includes the memory of other processes on the device.
+    for (uint32_t i = 0; i < aStats.heapCount; i++) {
+      aStats.heapBudget[i] = budgetProperties.heapBudget[i];
+      aStats.heapUsage[i] = budgetProperties.heapUsage[i];
+    }
+  }
+#endif
+}
+
+void VulkanRenderer::LogMemoryStats() {
+  VulkanMemoryStats stats;
+  GetMemoryStats(stats);
+
+  const double kMB = 1024.0 * 1024.0;
+  LOG_I(gAppName.data(), "GPU memory: %u device memory allocations",
+        stats.deviceMemoryCount);
+  for (uint32_t i = 0; i < MemoryCategory_Count; i++) {
+    LOG_I(gAppName.data(), "  %s: %.2f MB", kMemoryCategoryNames[i],
+          stats.categoryUsage[i] / kMB);
+  }
+  for (uint32_t i = 0; i < stats.heapCount; i++) {
+    if (mDeviceInfo.memoryBudget) {
+      LOG_I(gAppName.data(), "  heap %u: allocated %.2f MB, usage %.2f MB, budget %.2f MB, size %.2f MB",
+            i, stats.heapAllocated[i] / kMB, stats.heapUsage[i] / kMB,
+            stats.heapBudget[i] / kMB, stats.heapSize[i] / kMB);
+    } else {
+      LOG_I(gAppName.data(), "  heap %u: allocated %.2f MB, size %.2f MB",
+            i, stats.heapAllocated[i] / kMB, stats.heapSize[i] / kMB);
+    }
+  }
+}
+
+void VulkanRenderer::FlushUploads() {
+  mUploadContext.Flush();
+  mUploadContext.Update();
+}
+
+bool VulkanRenderer::IsSurfaceReady(std::shared_ptr<RenderSurface> aSurf) {
+  return mUploadContext.IsComplete(aSurf->mUploadTicket);
 }
 
 bool VulkanRenderer::AddSurface(std::shared_ptr<RenderSurface> aSurf) {
   mSurfaces.push_back(aSurf);
+  MarkSceneDirty();
+  return true;
+}
+
+bool VulkanRenderer::RemoveSurface(std::shared_ptr<RenderSurface> aSurf) {
+  auto it = std::find(mSurfaces.begin(), mSurfaces.end(), aSurf);
+  if (it == mSurfaces.end()) {
+    return false;
+  }
+
+  // The recorded frames might still be drawing this surface. Once they are
+  // done, its ranges and uniform slice can be reused by the next surfaces.
+  CALL_VK(vkDeviceWaitIdle(mDeviceInfo.device));
+  mSurfaces.erase(it);
+  // The indices after the removed surface moved, rebuilt on the next frame.
+  mDrawList.clear();
+  mDrawStateKeys.clear();
+  mGpuCulling.objectDraws.clear();
+  mGpuCulling.drawObjects.clear();
+  DeleteGraphicsPipeline(aSurf);
+  DeleteBuffers(aSurf);
+  DeleteTextures(aSurf);
+  DeleteDescriptors(aSurf);
+  MarkSceneDirty();
   return true;
 }
 
@@ -10,6 +10,14 @@
 #include <memory>
 #include "vulkan_wrapper.h"
 #include "RenderSurface.h"
+#include "VulkanMemoryAllocator.h"
+#include "VulkanUploadContext.h"
+#include "VulkanGeometryArena.h"
+#include "VulkanDescriptorAllocator.h"
+#include "VulkanPipelineLibrary.h"
+#include "VulkanShaderCache.h"
+#include "JobSystem.h"
+#include "RadixSort.h"
 #include "Matrix4x4.h"
 
 struct android_app;
@@ -18,16 +26,72 @@ class VkApplicationInfo;
 
 using namespace gfx_math;
 
+// GPU memory usage of the renderer. The heap budget and usage come from
+// VK_EXT_memory_budget, they stay zero if the extension is unavailable.
+struct VulkanMemoryStats {
+  VkDeviceSize categoryUsage[MemoryCategory_Count] = {};
+  uint32_t deviceMemoryCount = 0;
+  uint32_t heapCount = 0;
+  VkDeviceSize heapSize[VK_MAX_MEMORY_HEAPS] = {};
+  // Bytes of VkDeviceMemory the renderer allocated from the heap.
+  VkDeviceSize heapAllocated[VK_MAX_MEMORY_HEAPS] = {};
+  VkDeviceSize heapBudget[VK_MAX_MEMORY_HEAPS] = {};
+  VkDeviceSize heapUsage[VK_MAX_MEMORY_HEAPS] = {};
+};
+
+// Trades latency for throughput, unsupported values fall back to what the
+// surface supports when the swapchain is created.
+struct VulkanSwapchainConfig {
+  // MAILBOX, IMMEDIATE or FIFO_RELAXED, FIFO is always available.
+  VkPresentModeKHR presentMode = VK_PRESENT_MODE_FIFO_KHR;
+  // 2 for double buffering, 3 for triple buffering, 0 for the surface minimum.
+  uint32_t imageCount = 0;
+  VkCompositeAlphaFlagBitsKHR compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
+};
+
+// A pipeline compiled in the background for |surface|, its descriptor set
+// layout has to be created beforehand.
+struct VulkanPipelineRequest {
+  const char* vertexShader;
+  const char* fragmentShader;
+  std::shared_ptr<RenderSurface> surface;
+};
+
 class VulkanRenderer {
 public:
-  VulkanRenderer() : mAppContext(nullptr), mInitialized(false) {}
-  bool Init(android_app* app, const std::string& aAppName);
+  VulkanRenderer() : mAppContext(nullptr), mStagingBuffer(VK_NULL_HANDLE),
+                     mDrawsPushTransforms(false), mDepthReorderDelay(0),
+                     mSceneVersion(1), mRecordThreadCount(1),
+                     mFrameCount(0), mInitialized(false) {}
+  // Up to |aFramesInFlight| frames are recorded by the CPU while the GPU is
+  // still rendering the previous ones.
+  bool Init(android_app* app, const std::string& aAppName, uint32_t aFramesInFlight = 2,
+            const VulkanSwapchainConfig& aSwapchainConfig = VulkanSwapchainConfig());
   bool IsReady();
   void Terminate();
   void RenderFrame();
+  // Rebuilds the swapchain and the framebuffers with |aConfig|, waits for the
+  // frames in flight.
+  void RecreateSwapChain(const VulkanSwapchainConfig& aConfig);
+  // The surface is drawn from the next frame, even after ConstructRenderPass().
   bool AddSurface(std::shared_ptr<RenderSurface> aSurf);
+  // Stops drawing |aSurf| and releases its GPU resources.
+  bool RemoveSurface(std::shared_ptr<RenderSurface> aSurf);
+  // Packs the vertex and index arenas, for long sessions streaming meshes in and out.
+  void CompactGeometry();
+  // Submits the uploads recorded so far, RenderFrame() also does it every frame.
+  void FlushUploads();
+  // Whether the buffers and textures of |aSurf| have been uploaded to the GPU.
+  bool IsSurfaceReady(std::shared_ptr<RenderSurface> aSurf);
+  void GetMemoryStats(VulkanMemoryStats& aStats);
+  // RenderFrame() also logs them periodically.
+  void LogMemoryStats();
   void CreateVertexBuffer(const std::vector<float>& aVertexData, std::shared_ptr<RenderSurface> aSurf);
   void CreateIndexBuffer(const std::vector<uint16_t>& aIndexData, std::shared_ptr<RenderSurface> aSurf);
+  // Per-instance data of mInstanceItemSize floats each, read by the vertex
+  // shader from location 4 on: the model matrix, then vec4s. Draws all the
+  // instances in one call, call it after CreateVertexBuffer().
+  void CreateInstanceBuffer(const std::vector<float>& aInstanceData, std::shared_ptr<RenderSurface> aSurf);
   void CreateUniformBuffer(VkDeviceSize aBufferSize, std::shared_ptr<RenderSurface> aSurf);
   bool CreateTextureFromFile(const char* aFilePath, std::shared_ptr<RenderSurface> aSurf);
   bool CreateTextureFromBuffer(const char* aBuffer, int aTexWidth, int aTexHeight,
@@ -35,7 +99,27 @@ public:
   void CreateDescriptorSetLayout(std::shared_ptr<RenderSurface> aSurf);
   void CreateDescriptorSet(VkDeviceSize aBufferSize, std::shared_ptr<RenderSurface> aSurf);
   void ConstructRenderPass();
+  // Number of threads recording the draws of large scenes, 1 by default.
+  // The calling thread is one of them, the others are workers of the job system.
+  void SetRecordThreadCount(uint32_t aCount);
   VkResult CreateGraphicsPipeline(const char* aVSPath, const char* aFSPath, std::shared_ptr<RenderSurface> aSurf);
+  // Compiles the pipelines of |aRequests| on worker threads and returns one
+  // handle per request, null if the pipeline already existed. Surfaces are
+  // skipped by the draws until their pipeline is ready.
+  std::vector<JobSystem::JobHandle> CompileGraphicsPipelines(
+          const std::vector<VulkanPipelineRequest>& aRequests);
+  bool IsPipelineReady(const JobSystem::JobHandle& aHandle) const;
+  // Blocks until all the requested pipelines are compiled and given to their surfaces.
+  void WaitForPipelines();
+  // Culls the indexed surfaces in a compute pass running |aCSPath|, which
+  // writes their indirect draws, one per surface.
+  bool EnableGpuCulling(const char* aCSPath);
+  // Textures of the surfaces with mUseTextureTable are slots of one global
+  // array bound at set 0, their shaders index it with the slots pushed at
+  // offset 64 (up to 4 uints), and their own descriptor set moves to set 1.
+  // Other surfaces, or all without VK_EXT_descriptor_indexing, bind their
+  // first texture themselves.
+  bool HasTextureTable() const;
 
 private:
 
@@ -51,6 +135,16 @@ private:
     // just the attributes we need to save the memory of the struct.
     VulkanPhysicalDeviceFeature gpuDeviceFeatures;
     VkPhysicalDeviceProperties gpuDeviceProperties;
+    VkPhysicalDeviceMemoryProperties memoryProperties;
+    // There is a memory type being both device local and host visible/coherent,
+    // it is the case of most mobile GPUs.
+    bool unifiedMemory;
+    // VK_EXT_memory_budget is enabled.
+    bool memoryBudget = false;
+    // VK_KHR_draw_indirect_count is enabled.
+    bool drawIndirectCount = false;
+    // Slots of the texture table, 0 if VK_EXT_descriptor_indexing isn't enabled.
+    uint32_t textureTableSize = 0;
     VkDevice device;
     uint32_t queueFamilyIndex;
 
@@ -63,8 +157,19 @@ private:
     VkSwapchainKHR swapchain;
     uint32_t swapchainLength;
 
+    // Size of the swapchain images, in the native orientation of the display.
     VkExtent2D displaySize;
     VkFormat displayFormat;
+    // Rotation from the native orientation to the current one, we apply it
+    // ourselves so the compositor doesn't need to.
+    VkSurfaceTransformFlagBitsKHR preTransform;
+
+    // The depth buffer of every framebuffer. The frames are rendered in
+    // submission order, so one image is enough.
+    VkFormat depthFormat;
+    VkImage depthImage = VK_NULL_HANDLE;
+    VkImageView depthView = VK_NULL_HANDLE;
+    VulkanAllocation depthMemory;
 
     // array of frame buffers and views
     std::vector<VkImage> displayImages;
@@ -72,13 +177,145 @@ private:
     std::vector<VkFramebuffer> framebuffers;
   };
 
+  // A persistently mapped uniform buffer holding the uniforms of every
+  // surface, one |frameSize| region per frame in flight. |slices| hands out
+  // the same range of every region, and takes it back with the surface.
+  struct VulkanUniformArena {
+    VkBuffer buffer = VK_NULL_HANDLE;
+    VulkanAllocation memory;
+    VkDeviceSize alignment = 1;
+    VkDeviceSize frameSize = 0;
+    VulkanGeometryArena slices;
+  };
+
+  // Vertex or index data of all surfaces, sub-allocated by |arena|.
+  struct VulkanGeometryBuffer {
+    VkBuffer buffer = VK_NULL_HANDLE;
+    VulkanAllocation memory;
+    VkBufferUsageFlags usage = 0;
+    MemoryCategory category = MemoryCategory_Vertex;
+    VulkanGeometryArena arena;
+  };
+
+  // Records a part of the surfaces into secondary command buffers. Command
+  // pools can't be used by several threads.
+  struct VulkanRecordWorker {
+    VkCommandPool cmdPool = VK_NULL_HANDLE;
+    // Secondary command buffers of every primary one, allocated when needed.
+    std::vector<std::vector<VkCommandBuffer>> cmdBuffers;
+  };
+
+  // Draws of mDrawList [begin, end) recorded in a secondary command buffer.
+  struct VulkanDrawRun {
+    size_t begin;
+    size_t end;
+    // The draws push their transforms, so they are recorded every frame.
+    bool pushed;
+    VkCommandBuffer cmdBuffer;
+  };
+
+  // Sync objects of a frame in flight. |fence| is signaled once the GPU is
+  // done with the frame, so its uniforms and command buffers can be reused.
+  // A range of an arena replaced while the recorded frames might still read it.
+  struct VulkanDeferredFree {
+    VulkanGeometryArena* arena;
+    uint32_t range;
+  };
+
+  struct VulkanFrame {
+    VkSemaphore imageAvailable = VK_NULL_HANDLE;
+    VkSemaphore renderFinished = VK_NULL_HANDLE;
+    VkFence fence = VK_NULL_HANDLE;
+    // Freed once the fence of this frame is waited again.
+    std::vector<VulkanDeferredFree> deferredFrees;
+    std::vector<VkPipeline> deferredPipelines;
+  };
+
+  // Resources of the culling compute pass, every frame in flight has its own
+  // region of the object and draw buffers.
+  struct VulkanGpuCulling {
+    VkDescriptorSetLayout descriptorSetLayout = VK_NULL_HANDLE;
+    VkPipelineLayout layout = VK_NULL_HANDLE;
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    VkDescriptorPool descriptorPool = VK_NULL_HANDLE;
+    std::vector<VkDescriptorSet> descriptorSets;
+    // Frustum, bounds, transforms and draw parameters, written every frame.
+    VkBuffer objectBuffer = VK_NULL_HANDLE;
+    VulkanAllocation objectMemory;
+    // Indirect commands, followed by the draw count of every object.
+    VkBuffer drawBuffer = VK_NULL_HANDLE;
+    VulkanAllocation drawMemory;
+    VkDeviceSize objectFrameSize = 0;
+    VkDeviceSize commandSize = 0;
+    VkDeviceSize drawFrameSize = 0;
+    uint32_t capacity = 0;
+    // mDrawList index of every object, their commands are in the same order.
+    std::vector<uint32_t> objectDraws;
+    // Object of every draw of mDrawList, kNoCullObject if it is drawn directly.
+    std::vector<uint32_t> drawObjects;
+    // Scene version the objects were built with.
+    uint64_t objectVersion = 0;
+  };
+
+  // Update-after-bind and partially bound array of all the textures, bound
+  // once per command buffer.
+  struct VulkanTextureTable {
+    VkDescriptorSetLayout descriptorSetLayout = VK_NULL_HANDLE;
+    VkDescriptorPool descriptorPool = VK_NULL_HANDLE;
+    VkDescriptorSet descriptorSet = VK_NULL_HANDLE;
+    // Slots handed out so far, the freed ones are reused first.
+    uint32_t slotCount = 0;
+    std::vector<uint32_t> freeSlots;
+  };
+
+  // Command buffer recordings since they were last logged.
+  struct VulkanRecordStats {
+    uint32_t recordCount = 0;
+    size_t drawCount = 0;
+    uint32_t maxThreadCount = 0;
+    double recordTime = 0.0;
+  };
+
+  // Shared by all the pipelines, it is loaded from and saved to the external
+  // storage so the next launches skip compiling them again.
+  struct VulkanPipelineCache {
+    VkPipelineCache cache = VK_NULL_HANDLE;
+    // The saved data matched the device and was given to the driver.
+    bool loaded = false;
+    uint32_t pipelineCount = 0;
+    double createTime = 0.0;
+  };
+
+  // A pipeline compiling on a worker, and the surfaces waiting for it.
+  struct VulkanPendingPipeline {
+    VulkanPipelineKey key;
+    JobSystem::JobHandle job;
+    std::vector<std::shared_ptr<RenderSurface>> surfaces;
+    // Written by the job, read once it completes.
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    VkPipelineLayout layout = VK_NULL_HANDLE;
+    VkResult result = VK_NOT_READY;
+    double compileTime = 0.0;
+  };
+
   struct VulkanRenderInfo {
     VkRenderPass renderPass;
     VkCommandPool cmdPool;
-    VkCommandBuffer* cmdBuffer;
-    uint32_t cmdBufferLen;
-    VkSemaphore semaphore;
-    VkFence fence;
+    // One command buffer per frame in flight and swapchain image, as they
+    // bind the uniforms of their frame.
+    VkCommandBuffer* cmdBuffer = nullptr;
+    uint32_t cmdBufferLen = 0;
+    // Scene version each command buffer was recorded with.
+    std::vector<uint64_t> recordedVersions;
+    // One per record thread.
+    std::vector<VulkanRecordWorker> recordWorkers;
+    // Records the pushed transforms on the calling thread.
+    VulkanRecordWorker pushWorker;
+    // Runs executed by each command buffer in draw order, none if its draws
+    // are recorded inline.
+    std::vector<std::vector<VulkanDrawRun>> drawRuns;
+    std::vector<VulkanFrame> frames;
+    uint32_t currentFrame = 0;
   };
 
 //  struct VulkanGfxPipelineInfo {
@@ -88,24 +325,103 @@ private:
 //  };
 
   bool MapMemoryTypeToIndex(uint32_t typeBits, VkFlags requirements_mask,
-                            uint32_t* typeIndex);
+                            uint32_t* typeIndex, VkFlags preferred_mask = 0);
   void CreateVulkanDevice(ANativeWindow* platformWindow,
                           VkApplicationInfo* appInfo);
-  void CreateSwapChain();
-  VkCommandBuffer BeginSingleTimeCommands();
-  void EndSingleTimeCommands(VkCommandBuffer commandBuffer);
-  void CopyBuffer(VkBuffer aSrcBuffer, VkBuffer aDstBuffer, VkDeviceSize aSize);
+  void CreateSwapChain(VkSwapchainKHR aOldSwapchain = VK_NULL_HANDLE);
+  void UpdateProjectionMatrix();
+  void CreateUploadContext();
+  void CreateUniformArena();
+  void UploadBuffer(VkBuffer aDstBuffer, VkDeviceSize aDstOffset,
+                    const void* aData, VkDeviceSize aSize);
+  void UploadImage(VkImage aImage, uint32_t aMipLevel, uint32_t aWidth, uint32_t aHeight,
+                   uint32_t aTexelSize, const uint8_t* aData);
   void CreateBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
-                    VkMemoryPropertyFlags properties, VkBuffer& buffer,
-                    VkDeviceMemory& bufferMemory);
+                    VkMemoryPropertyFlags properties, MemoryCategory category,
+                    VkBuffer& buffer, VulkanAllocation& bufferMemory,
+                    VkMemoryPropertyFlags preferred = 0);
+  bool WriteBufferDirect(const VulkanAllocation& aMemory, VkDeviceSize aOffset,
+                         const void* aData, VkDeviceSize aSize);
+  void CreateGeometryBuffer(VulkanGeometryBuffer& aGeometry, VkDeviceSize aCapacity,
+                            VkBufferUsageFlags aUsage, MemoryCategory aCategory);
+  void DeleteGeometryBuffer(VulkanGeometryBuffer& aGeometry);
+  uint32_t AllocateGeometry(VulkanGeometryBuffer& aGeometry, const void* aData,
+                            VkDeviceSize aSize, VkDeviceSize aAlignment,
+                            std::shared_ptr<RenderSurface> aSurf);
+  bool RelocateGeometry(VulkanGeometryBuffer& aGeometry, VkDeviceSize aCapacity);
+  // Frees |aRange| of |aArena| when the frames in flight are done with it,
+  // and resets it.
+  void FreeDeferred(VulkanGeometryArena& aArena, uint32_t& aRange);
+  void ReleaseDeferredFrees(VulkanFrame& aFrame);
+  bool AllocateImageMemory(VkImage aImage, VkMemoryPropertyFlags aProperties,
+                           bool aLinear, VulkanAllocation& aImageMemory,
+                           MemoryCategory aCategory = MemoryCategory_Texture);
+  VkFormat GetDepthFormat() const;
+  void CreateDepthBuffer();
+  void DeleteDepthBuffer();
   void CreateFrameBuffers(VkRenderPass& renderPass,
                           VkImageView depthView = VK_NULL_HANDLE);
   void CreateCommandPool();
-  void CreateDescriptorPool(std::shared_ptr<RenderSurface> aSurf);
   void CreateSyncObjects();
+  void DeleteSyncObjects();
   void CreateCommandBuffer();
-  VkResult LoadShaderFromFile(const char* filePath, VkShaderModule* shaderOut,
-                              ShaderType type);
+  void DeleteCommandBuffers();
+  void RecordCommandBuffers();
+  // Records the command buffer again, its static runs only if the scene has
+  // changed since they were recorded.
+  void RecordCommandBuffer(uint32_t aBufferIndex);
+  // Splits mDrawList into runs of static draws and of pushed transforms,
+  // and the static ones between the record threads. |aRuns| is left empty
+  // if the draws can be recorded inline.
+  void BuildDrawRuns(std::vector<VulkanDrawRun>& aRuns) const;
+  // Returns the number of threads which recorded the static runs.
+  uint32_t RecordStaticRuns(uint32_t aBufferIndex);
+  VkCommandBuffer GetSecondaryCommandBuffer(VulkanRecordWorker& aWorker,
+                                            uint32_t aBufferIndex, size_t aIndex);
+  void RecordSecondaryCommandBuffer(VkCommandBuffer aCmdBuffer, uint32_t aFrameIndex,
+                                    uint32_t aImageIndex, size_t aBegin, size_t aEnd);
+  // Records the draws of the surfaces in mDrawList[aBegin, aEnd).
+  void RecordSurfaces(VkCommandBuffer aCmdBuffer, uint32_t aFrameIndex,
+                      size_t aBegin, size_t aEnd);
+  void CreateRecordWorkers();
+  void CreateRecordWorker(VulkanRecordWorker& aWorker);
+  void DeleteRecordWorkers();
+  // RenderFrame() logs them with the memory stats, then clears them.
+  void LogRecordStats();
+  // Something the command buffers refer to has changed (surfaces, pipelines,
+  // descriptor sets or geometry buffers).
+  void MarkSceneDirty();
+  // Culls the surfaces against the view frustum and sorts the visible ones
+  // by state then depth, the command buffers are re-recorded when the
+  // visible ones or their state order change, and now and then for a new
+  // depth order.
+  void UpdateDrawList();
+  // |aDrawList|, sorted with mDrawKeys, has the draws of mDrawList in
+  // another depth order only.
+  bool IsDepthReorder(const std::vector<uint32_t>& aDrawList) const;
+  void BuildCullObjects();
+  void CreateCullingBuffers(uint32_t aCapacity);
+  void DeleteCullingBuffers();
+  void DeleteGpuCulling();
+  void CreateTextureTable();
+  void DeleteTextureTable();
+  void AddToTextureTable(RenderSurface::VulkanTexture& aTexture);
+  void CreatePipelineCache();
+  void DeletePipelineCache();
+  std::string GetPipelineCachePath() const;
+  VulkanPipelineKey GetPipelineKey(const char* aVSPath, const char* aFSPath,
+                                   const RenderSurface& aSurf) const;
+  // Creates the layout and the pipeline of |aKey|, it can run on any thread.
+  VkResult CompilePipeline(const VulkanPipelineKey& aKey, VkPipeline& aPipeline,
+                           VkPipelineLayout& aLayout, double& aCompileTime);
+  // Hands the compiled pipelines over to their surfaces.
+  void ResolvePipelines();
+  // The mvp matrix or texture slots of |aSurf| are pushed with its draw.
+  bool HasPushConstants(const RenderSurface& aSurf) const;
+  // The pipeline layout of |aSurf| starts with the texture table.
+  bool UsesTextureTable(const RenderSurface& aSurf) const;
+  void UpdateCullObjects(uint32_t aFrameIndex);
+  void RecordCullPass(VkCommandBuffer aCmdBuffer, uint32_t aFrameIndex);
   bool CreateImage(const char* aFilePath, RenderSurface::VulkanTexture& aTexture,
                    bool& aUseStaging);
   void SetImageLayout(VkCommandBuffer cmdBuffer, VkImage image,
@@ -113,23 +429,61 @@ private:
                       VkPipelineStageFlags srcStages,
                       VkPipelineStageFlags destStages);
   void SetupPhysicalDeviceFeatures(const VkPhysicalDeviceFeatures& aFeatures);
-  void UpdateUniformBuffer(int aImageIndex);
+  void UpdateUniformBuffer(uint32_t aFrameIndex);
+  void DeleteFrameBuffers();
   void DeleteSwapChain();
-  void DeleteGraphicsPipeline();
-  void DeleteTextures();
-  void DeleteBuffers();
-  void DeleteDescriptors();
-  void DestroyShaderModule(VkShaderModule aShader);
+  // Gives the pipeline reference of |aSurf| back to the library, after the
+  // frames in flight if they might still draw with it.
+  void DeleteGraphicsPipeline(const std::shared_ptr<RenderSurface>& aSurf,
+                              bool aInFlight = false);
+  void DeleteTextures(const std::shared_ptr<RenderSurface>& aSurf);
+  void DeleteBuffers(const std::shared_ptr<RenderSurface>& aSurf);
+  void ReleaseDescriptorSets(const std::shared_ptr<RenderSurface>& aSurf);
+  void DeleteDescriptors(const std::shared_ptr<RenderSurface>& aSurf);
 
   android_app* mAppContext;
   VulkanDeviceInfo mDeviceInfo;
+  VulkanSwapchainConfig mSwapchainConfig;
   VulkanSwapchainInfo mSwapchain;
   VulkanRenderInfo mRenderInfo;
+  VulkanMemoryAllocator mAllocator;
+  VulkanUploadContext mUploadContext;
+  VulkanDescriptorAllocator mDescriptorAllocator;
+  VkBuffer mStagingBuffer;
+  VulkanAllocation mStagingMemory;
+  VulkanUniformArena mUniformArena;
+  VulkanGeometryBuffer mVertexGeometry;
+  VulkanGeometryBuffer mIndexGeometry;
+  VulkanGpuCulling mGpuCulling;
+  VulkanTextureTable mTextureTable;
+  VulkanPipelineCache mPipelineCache;
+  VulkanRecordStats mRecordStats;
+  VulkanPipelineLibrary mPipelineLibrary;
+  VulkanShaderCache mShaderCache;
+  // Compiles the pipelines on its own workers, the record ones can be none.
+  JobSystem mPipelineJobs;
+  std::vector<std::shared_ptr<VulkanPendingPipeline>> mPendingPipelines;
 
   std::vector<std::shared_ptr<RenderSurface>> mSurfaces;
+  // Indices in mSurfaces of the surfaces inside the view frustum, sorted by
+  // their draw keys.
+  std::vector<uint32_t> mDrawList;
+  std::vector<uint64_t> mDrawKeys;
+  // Draw keys of mDrawList without their depth.
+  std::vector<uint64_t> mDrawStateKeys;
+  // Updates a new depth order of the same draws has been waiting for.
+  uint32_t mDepthReorderDelay;
+  // Pushed transforms are recorded in secondary command buffers of their
+  // own, which are re-recorded every frame with their primary ones.
+  bool mDrawsPushTransforms;
+  RadixSort mDrawSorter;
   Matrix4x4f mViewMatrix;
   Matrix4x4f mProjMatrix;
 
+  JobSystem mJobSystem;
+  uint64_t mSceneVersion;
+  uint32_t mRecordThreadCount;
+  uint32_t mFrameCount;
   bool mInitialized;
 };
 
@@ -0,0 +1,126 @@
+#include "VulkanShaderCache.h"
+
+#include <android/asset_manager.h>
+#include <cstring>
+#include <vector>
+#include "Logger.h"
+
+static const char* kTAG = "VulkanShaderCache";
+
+static uint64_t HashCode(const uint8_t* aCode, size_t aSize) {
+  // FNV-1a.
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < aSize; i++) {
+    hash ^= aCode[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+void VulkanShaderCache::Init(VkDevice aDevice, AAssetManager* aAssetManager) {
+  mDevice = aDevice;
+  mAssetManager = aAssetManager;
+  mHitCount = 0;
+  mMissCount = 0;
+}
+
+void VulkanShaderCache::Terminate() {
+  std::lock_guard<std::mutex> guard(mLock);
+  LOG_I(kTAG, "%zu shader modules for %zu files, %u hits and %u misses.",
+        mModules.size(), mPaths.size(), GetHitCount(), GetMissCount());
+  for (const auto& module : mModules) {
+    vkDestroyShaderModule(mDevice, module.second, nullptr);
+  }
+  mModules.clear();
+  mPaths.clear();
+}
+
+VulkanShaderCache::Module VulkanShaderCache::Get(const std::string& aPath) {
+  {
+    std::lock_guard<std::mutex> guard(mLock);
+    auto path = mPaths.find(aPath);
+    if (path != mPaths.end()) {
+      ++mHitCount;
+      return path->second;
+    }
+  }
+
+  // Other threads keep using the cache while the file is read.
+  ++mMissCount;
+  Module module;
+  size_t codeSize = 0;
+  if (!Load(aPath, module, codeSize)) {
+    return Module();
+  }
+
+  std::lock_guard<std::mutex> guard(mLock);
+  // Another thread might have loaded the same code meanwhile.
+  auto shared = mModules.insert(std::make_pair(std::make_pair(module.hash, codeSize),
+                                               module.module));
+  if (!shared.second) {
+    vkDestroyShaderModule(mDevice, module.module, nullptr);
+    module.module = shared.first->second;
+  }
+  mPaths[aPath] = module;
+  return module;
+}
+
+uint32_t VulkanShaderCache::GetHitCount() const {
+  return mHitCount;
+}
+
+uint32_t VulkanShaderCache::GetMissCount() const {
+  return mMissCount;
+}
+
+uint32_t VulkanShaderCache::GetModuleCount() {
+  std::lock_guard<std::mutex> guard(mLock);
+  return static_cast<uint32_t>(mModules.size());
+}
+
+bool VulkanShaderCache::Load(const std::string& aPath, Module& aModule, size_t& aCodeSize) {
+  AAsset* file = AAssetManager_open(mAssetManager, aPath.c_str(), AASSET_MODE_BUFFER);
+  if (!file) {
+    LOG_E(kTAG, "Couldn't open the shader %s.", aPath.c_str());
+    return false;
+  }
+
+  // Uncompressed assets are mapped from the APK, so the code is read in place.
+  const size_t codeSize = AAsset_getLength(file);
+  const uint8_t* code = static_cast<const uint8_t*>(AAsset_getBuffer(file));
+  if (!code || !codeSize || codeSize % sizeof(uint32_t)) {
+    LOG_E(kTAG, "The shader %s isn't valid SPIR-V.", aPath.c_str());
+    AAsset_close(file);
+    return false;
+  }
+  // The gradle files keep .spv uncompressed, or it was inflated into a copy.
+  if (AAsset_isAllocated(file)) {
+    LOG_W(kTAG, "The shader %s is compressed in the APK, add noCompress 'spv'.",
+          aPath.c_str());
+  }
+  // SPIR-V words have to be aligned, which zipalign doesn't promise.
+  std::vector<uint32_t> alignedCode;
+  if (reinterpret_cast<uintptr_t>(code) % alignof(uint32_t)) {
+    alignedCode.assign(codeSize / sizeof(uint32_t), 0);
+    memcpy(alignedCode.data(), code, codeSize);
+    code = reinterpret_cast<const uint8_t*>(alignedCode.data());
+  }
+
+  VkShaderModuleCreateInfo shaderModuleCreateInfo{
+    .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+    .pNext = nullptr,
+    .flags = 0,
+    .codeSize = codeSize,
+    .pCode = reinterpret_cast<const uint32_t*>(code),
+  };
+  aModule.hash = HashCode(code, codeSize);
+  aCodeSize = codeSize;
+  const VkResult result = vkCreateShaderModule(mDevice, &shaderModuleCreateInfo, nullptr,
+                                               &aModule.module);
+  AAsset_close(file);
+  if (result != VK_SUCCESS) {
+    LOG_E(kTAG, "vkCreateShaderModule of %s failed, error %d.", aPath.c_str(), result);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,50 @@
+#ifndef VULKANANDROID_VULKANSHADERCACHE_H
+#define VULKANANDROID_VULKANSHADERCACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include "vulkan_wrapper.h"
+
+struct AAssetManager;
+
+// Creates one VkShaderModule per SPIR-V asset and keeps it until Terminate(),
+// so the pipelines using a shader don't read it again. Files with the same
+// content share their module. It can be used from any thread.
+class VulkanShaderCache {
+public:
+  struct Module {
+    VkShaderModule module = VK_NULL_HANDLE;
+    // Hash of the SPIR-V code.
+    uint64_t hash = 0;
+  };
+
+  VulkanShaderCache() : mDevice(VK_NULL_HANDLE), mAssetManager(nullptr),
+                        mHitCount(0), mMissCount(0) {}
+  void Init(VkDevice aDevice, AAssetManager* aAssetManager);
+  void Terminate();
+  // Returns a null module if the asset can't be read or isn't valid SPIR-V.
+  Module Get(const std::string& aPath);
+  uint32_t GetHitCount() const;
+  uint32_t GetMissCount() const;
+  uint32_t GetModuleCount();
+
+private:
+  // Reads the asset in place and creates its module, without taking the lock.
+  bool Load(const std::string& aPath, Module& aModule, size_t& aCodeSize);
+
+  VkDevice mDevice;
+  AAssetManager* mAssetManager;
+  std::mutex mLock;
+  std::unordered_map<std::string, Module> mPaths;
+  // Modules by content hash and code size.
+  std::map<std::pair<uint64_t, size_t>, VkShaderModule> mModules;
+  std::atomic<uint32_t> mHitCount;
+  std::atomic<uint32_t> mMissCount;
+};
+
+#endif //VULKANANDROID_VULKANSHADERCACHE_H
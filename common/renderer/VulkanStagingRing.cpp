@@ -0,0 +1,91 @@
+#include "VulkanStagingRing.h"
+
+#include <cassert>
+
+static VkDeviceSize AlignUp(VkDeviceSize aValue, VkDeviceSize aAlignment) {
+  return aAlignment ? (aValue + aAlignment - 1) / aAlignment * aAlignment : aValue;
+}
+
+VulkanStagingRing::VulkanStagingRing()
+  : mBuffer(VK_NULL_HANDLE), mMappedData(nullptr),
+    mCapacity(0), mHead(0), mTail(0), mUsedSize(0), mPendingSize(0) {}
+
+void VulkanStagingRing::Init(VkBuffer aBuffer, void* aMappedData, VkDeviceSize aCapacity) {
+  mBuffer = aBuffer;
+  mMappedData = static_cast<uint8_t*>(aMappedData);
+  mCapacity = aCapacity;
+  mHead = mTail = mUsedSize = mPendingSize = 0;
+}
+
+void VulkanStagingRing::Terminate() {
+  mInFlight.clear();
+  mHead = mTail = mUsedSize = mPendingSize = 0;
+  mBuffer = VK_NULL_HANDLE;
+  mMappedData = nullptr;
+}
+
+bool VulkanStagingRing::Allocate(VkDeviceSize aSize, VkDeviceSize aAlignment,
+                                 VkDeviceSize& aOffset, void*& aData) {
+  if (aSize > mCapacity) {
+    return false;
+  }
+
+  if (!mUsedSize) {
+    // Nothing is in use, restart from the beginning to keep ranges contiguous.
+    mHead = mTail = 0;
+  }
+
+  VkDeviceSize start = AlignUp(mHead, aAlignment);
+  VkDeviceSize wasted = start - mHead;
+  if (mHead >= mTail && mUsedSize < mCapacity) {
+    // Free space is [mHead, mCapacity) and [0, mTail).
+    if (start + aSize > mCapacity) {
+      if (aSize > mTail) {
+        return false;
+      }
+      wasted = mCapacity - mHead;
+      start = 0;
+    }
+  } else if (start + aSize > mTail || mUsedSize == mCapacity) {
+    // Free space is [mHead, mTail).
+    return false;
+  }
+
+  mHead = start + aSize;
+  mUsedSize += wasted + aSize;
+  mPendingSize += wasted + aSize;
+  assert(mUsedSize <= mCapacity);
+
+  aOffset = start;
+  aData = mMappedData + start;
+  return true;
+}
+
+void VulkanStagingRing::Retire(uint64_t aTicket) {
+  mInFlight.push_back({aTicket, mHead, mPendingSize});
+  mPendingSize = 0;
+}
+
+bool VulkanStagingRing::Reclaim(uint64_t aCompletedTicket) {
+  bool reclaimed = false;
+  while (mInFlight.size() && mInFlight.front().ticket <= aCompletedTicket) {
+    const InFlightRange& range = mInFlight.front();
+    mTail = range.end;
+    mUsedSize -= range.size;
+    mInFlight.pop_front();
+    reclaimed = true;
+  }
+  return reclaimed;
+}
+
+bool VulkanStagingRing::HasPending() const {
+  return mPendingSize != 0;
+}
+
+VkBuffer VulkanStagingRing::GetBuffer() const {
+  return mBuffer;
+}
+
+VkDeviceSize VulkanStagingRing::GetCapacity() const {
+  return mCapacity;
+}
@@ -0,0 +1,48 @@
+#ifndef VULKANANDROID_VULKANSTAGINGRING_H
+#define VULKANANDROID_VULKANSTAGINGRING_H
+
+#include <cstdint>
+#include <deque>
+#include "vulkan_wrapper.h"
+
+// A persistently mapped host visible buffer that upload paths write into
+// instead of creating a staging buffer per upload. Space is handed out
+// front to back and wraps around. Ranges are tagged with the ticket of the
+// submission reading from them, and reclaimed once that ticket has completed.
+class VulkanStagingRing {
+public:
+  VulkanStagingRing();
+  void Init(VkBuffer aBuffer, void* aMappedData, VkDeviceSize aCapacity);
+  void Terminate();
+  // Returns false if there is no room until in-flight ranges are reclaimed.
+  bool Allocate(VkDeviceSize aSize, VkDeviceSize aAlignment,
+                VkDeviceSize& aOffset, void*& aData);
+  // Closes the ranges allocated since the last call, they are read by the
+  // submission of |aTicket|.
+  void Retire(uint64_t aTicket);
+  // Gives back the ranges of the submissions up to |aCompletedTicket|.
+  bool Reclaim(uint64_t aCompletedTicket);
+  bool HasPending() const;
+  VkBuffer GetBuffer() const;
+  VkDeviceSize GetCapacity() const;
+
+private:
+  struct InFlightRange {
+    uint64_t ticket;
+    VkDeviceSize end;
+    VkDeviceSize size;
+  };
+
+  VkBuffer mBuffer;
+  uint8_t* mMappedData;
+  VkDeviceSize mCapacity;
+  // Next free byte and the start of the oldest range in use.
+  VkDeviceSize mHead;
+  VkDeviceSize mTail;
+  // Bytes in use, including alignment padding and wrap-around waste.
+  VkDeviceSize mUsedSize;
+  VkDeviceSize mPendingSize;
+  std::deque<InFlightRange> mInFlight;
+};
+
+#endif //VULKANANDROID_VULKANSTAGINGRING_H
@@ -0,0 +1,210 @@
+#include "VulkanUploadContext.h"
+
+#include <cassert>
+#include "Logger.h"
+
+static const char* kTAG = "VulkanUploadContext";
+
+VulkanUploadContext::VulkanUploadContext()
+  : mDevice(VK_NULL_HANDLE), mQueue(VK_NULL_HANDLE), mCmdPool(VK_NULL_HANDLE),
+    mRecording(VK_NULL_HANDLE), mNextTicket(1), mCompletedTicket(0) {}
+
+void VulkanUploadContext::Init(VkDevice aDevice, VkQueue aQueue, uint32_t aQueueFamilyIndex,
+                               VkBuffer aStagingBuffer, void* aStagingData,
+                               VkDeviceSize aStagingSize) {
+  mDevice = aDevice;
+  mQueue = aQueue;
+  mNextTicket = 1;
+  mCompletedTicket = 0;
+  mStagingRing.Init(aStagingBuffer, aStagingData, aStagingSize);
+
+  // Upload command buffers are short-lived and reset once their batch is done.
+  VkCommandPoolCreateInfo cmdPoolCreateInfo{
+    .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+    .pNext = nullptr,
+    .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT |
+             VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+    .queueFamilyIndex = aQueueFamilyIndex,
+  };
+  if (vkCreateCommandPool(mDevice, &cmdPoolCreateInfo, nullptr, &mCmdPool) != VK_SUCCESS) {
+    LOG_E(kTAG, "vkCreateCommandPool failed.");
+    assert(false);
+  }
+}
+
+void VulkanUploadContext::Terminate() {
+  Wait(GetRecordingTicket());
+
+  for (const auto& fence : mFreeFences) {
+    vkDestroyFence(mDevice, fence, nullptr);
+  }
+  mFreeFences.clear();
+  // Destroying the pool frees all of its command buffers.
+  mFreeCmdBuffers.clear();
+  vkDestroyCommandPool(mDevice, mCmdPool, nullptr);
+  mCmdPool = VK_NULL_HANDLE;
+  mStagingRing.Terminate();
+}
+
+bool VulkanUploadContext::AllocateStaging(VkDeviceSize aSize, VkDeviceSize aAlignment,
+                                          VkDeviceSize& aOffset, void*& aData) {
+  Update();
+  while (!mStagingRing.Allocate(aSize, aAlignment, aOffset, aData)) {
+    // The ring is full of ranges used by our own batch, submit it so
+    // they can be given back.
+    if (mStagingRing.HasPending()) {
+      Flush();
+    }
+    if (mInFlight.empty()) {
+      LOG_E(kTAG, "Staging upload of %llu bytes doesn't fit the staging ring.",
+            (unsigned long long)aSize);
+      return false;
+    }
+    RetireOldest(true);
+    mStagingRing.Reclaim(mCompletedTicket);
+  }
+  return true;
+}
+
+VkCommandBuffer VulkanUploadContext::GetCommandBuffer() {
+  if (mRecording != VK_NULL_HANDLE) {
+    return mRecording;
+  }
+
+  if (mFreeCmdBuffers.size()) {
+    mRecording = mFreeCmdBuffers.back();
+    mFreeCmdBuffers.pop_back();
+  } else {
+    VkCommandBufferAllocateInfo allocInfo{
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+      .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+      .commandPool = mCmdPool,
+      .commandBufferCount = 1,
+    };
+    if (vkAllocateCommandBuffers(mDevice, &allocInfo, &mRecording) != VK_SUCCESS) {
+      LOG_E(kTAG, "vkAllocateCommandBuffers failed.");
+      assert(false);
+    }
+  }
+
+  VkCommandBufferBeginInfo beginInfo{
+    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+    .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+  };
+  vkBeginCommandBuffer(mRecording, &beginInfo);
+  return mRecording;
+}
+
+uint64_t VulkanUploadContext::GetRecordingTicket() const {
+  return mNextTicket;
+}
+
+uint64_t VulkanUploadContext::Flush() {
+  if (mRecording == VK_NULL_HANDLE) {
+    return mNextTicket - 1;
+  }
+
+  // Make the transfer writes visible to every later submission on this
+  // queue, so draws don't need to know which batch uploaded their data.
+  VkMemoryBarrier memoryBarrier{
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+    .pNext = nullptr,
+    .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT |
+                     VK_ACCESS_UNIFORM_READ_BIT | VK_ACCESS_SHADER_READ_BIT,
+  };
+  vkCmdPipelineBarrier(mRecording, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+                       VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                       0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+  vkEndCommandBuffer(mRecording);
+
+  VkFence fence;
+  if (mFreeFences.size()) {
+    fence = mFreeFences.back();
+    mFreeFences.pop_back();
+  } else {
+    VkFenceCreateInfo fenceCreateInfo{
+      .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+    };
+    if (vkCreateFence(mDevice, &fenceCreateInfo, nullptr, &fence) != VK_SUCCESS) {
+      LOG_E(kTAG, "vkCreateFence failed.");
+      assert(false);
+    }
+  }
+
+  VkSubmitInfo submitInfo{
+    .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+    .pNext = nullptr,
+    .waitSemaphoreCount = 0,
+    .pWaitSemaphores = nullptr,
+    .pWaitDstStageMask = nullptr,
+    .commandBufferCount = 1,
+    .pCommandBuffers = &mRecording,
+    .signalSemaphoreCount = 0,
+    .pSignalSemaphores = nullptr,
+  };
+  if (vkQueueSubmit(mQueue, 1, &submitInfo, fence) != VK_SUCCESS) {
+    LOG_E(kTAG, "vkQueueSubmit of upload batch %llu failed.", (unsigned long long)mNextTicket);
+    assert(false);
+  }
+
+  mInFlight.push_back({mRecording, fence, mNextTicket});
+  mStagingRing.Retire(mNextTicket);
+  mRecording = VK_NULL_HANDLE;
+  return mNextTicket++;
+}
+
+bool VulkanUploadContext::RetireOldest(bool aWait) {
+  if (mInFlight.empty()) {
+    return false;
+  }
+
+  const UploadBatch& batch = mInFlight.front();
+  if (aWait) {
+    vkWaitForFences(mDevice, 1, &batch.fence, VK_TRUE, UINT64_MAX);
+  } else if (vkGetFenceStatus(mDevice, batch.fence) != VK_SUCCESS) {
+    return false;
+  }
+
+  // Batches are submitted to one queue, so they complete in order.
+  mCompletedTicket = batch.ticket;
+  vkResetFences(mDevice, 1, &batch.fence);
+  vkResetCommandBuffer(batch.cmdBuffer, 0);
+  mFreeFences.push_back(batch.fence);
+  mFreeCmdBuffers.push_back(batch.cmdBuffer);
+  mInFlight.pop_front();
+  return true;
+}
+
+void VulkanUploadContext::Update() {
+  while (RetireOldest(false)) {
+  }
+  mStagingRing.Reclaim(mCompletedTicket);
+}
+
+bool VulkanUploadContext::IsComplete(uint64_t aTicket) {
+  if (aTicket > mCompletedTicket) {
+    Update();
+  }
+  return aTicket <= mCompletedTicket;
+}
+
+void VulkanUploadContext::Wait(uint64_t aTicket) {
+  if (aTicket >= mNextTicket) {
+    Flush();
+  }
+  while (mCompletedTicket < aTicket && RetireOldest(true)) {
+  }
+  mStagingRing.Reclaim(mCompletedTicket);
+}
+
+VkBuffer VulkanUploadContext::GetStagingBuffer() const {
+  return mStagingRing.GetBuffer();
+}
+
+VkDeviceSize VulkanUploadContext::GetStagingCapacity() const {
+  return mStagingRing.GetCapacity();
+}
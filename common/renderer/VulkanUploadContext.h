@@ -0,0 +1,62 @@
+#ifndef VULKANANDROID_VULKANUPLOADCONTEXT_H
+#define VULKANANDROID_VULKANUPLOADCONTEXT_H
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+#include "vulkan_wrapper.h"
+#include "VulkanStagingRing.h"
+
+// Records buffer/image copies and layout transitions from many uploads into one
+// command buffer, and submits them together without waiting for the queue.
+// Every batch gets a ticket, a resource is ready to be used by the GPU once
+// the ticket of the batch that uploaded it has completed.
+class VulkanUploadContext {
+public:
+  VulkanUploadContext();
+  void Init(VkDevice aDevice, VkQueue aQueue, uint32_t aQueueFamilyIndex,
+            VkBuffer aStagingBuffer, void* aStagingData, VkDeviceSize aStagingSize);
+  void Terminate();
+
+  // Reserves staging memory for the batch being recorded. It submits the
+  // batch and waits for older ones when the staging ring is full.
+  bool AllocateStaging(VkDeviceSize aSize, VkDeviceSize aAlignment,
+                       VkDeviceSize& aOffset, void*& aData);
+  // The command buffer of the batch being recorded, call it after
+  // AllocateStaging() as that might submit the current batch.
+  VkCommandBuffer GetCommandBuffer();
+  // Ticket of the batch being recorded.
+  uint64_t GetRecordingTicket() const;
+  // Submits the recorded batch, returns the ticket of the last submitted batch.
+  uint64_t Flush();
+  // Polls the fences of submitted batches and recycles the finished ones.
+  void Update();
+  bool IsComplete(uint64_t aTicket);
+  void Wait(uint64_t aTicket);
+  VkBuffer GetStagingBuffer() const;
+  VkDeviceSize GetStagingCapacity() const;
+
+private:
+  struct UploadBatch {
+    VkCommandBuffer cmdBuffer;
+    VkFence fence;
+    uint64_t ticket;
+  };
+
+  bool RetireOldest(bool aWait);
+
+  VkDevice mDevice;
+  VkQueue mQueue;
+  VkCommandPool mCmdPool;
+  VulkanStagingRing mStagingRing;
+  VkCommandBuffer mRecording;
+  // The batch being recorded gets |mNextTicket|, tickets up to
+  // |mCompletedTicket| have been executed by the GPU.
+  uint64_t mNextTicket;
+  uint64_t mCompletedTicket;
+  std::deque<UploadBatch> mInFlight;
+  std::vector<VkCommandBuffer> mFreeCmdBuffers;
+  std::vector<VkFence> mFreeFences;
+};
+
+#endif //VULKANANDROID_VULKANUPLOADCONTEXT_H
@@ -0,0 +1,205 @@
+#include "JobSystem.h"
+
+#include <algorithm>
+
+struct JobSystem::Job {
+  std::function<void()> task;
+  // Dependencies left, plus one until Schedule() is done registering them.
+  std::atomic<uint32_t> pendingCount;
+  std::atomic<bool> finished;
+  // Protects |dependents| against the job finishing while they register.
+  std::mutex lock;
+  std::vector<JobHandle> dependents;
+};
+
+// Which queue the current thread owns, the workers of another JobSystem
+// count as outside threads.
+static thread_local const JobSystem* tJobSystem = nullptr;
+static thread_local uint32_t tQueueIndex = 0;
+
+JobSystem::JobSystem() : mQueuedCount(0), mRunning(false) {
+  // Jobs can be scheduled before Init(), they run in Wait().
+  mQueues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue()));
+}
+
+JobSystem::~JobSystem() {
+  Terminate();
+}
+
+void JobSystem::Init(uint32_t aWorkerCount) {
+  Terminate();
+
+  mQueues.clear();
+  for (uint32_t i = 0; i <= aWorkerCount; i++) {
+    mQueues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue()));
+  }
+  mQueuedCount = 0;
+  mRunning = true;
+  for (uint32_t i = 0; i < aWorkerCount; i++) {
+    mWorkers.push_back(std::thread(&JobSystem::WorkerLoop, this, i));
+  }
+}
+
+void JobSystem::Terminate() {
+  {
+    std::lock_guard<std::mutex> guard(mSleepLock);
+    mRunning = false;
+  }
+  mWakeUp.notify_all();
+  for (auto& worker : mWorkers) {
+    worker.join();
+  }
+  mWorkers.clear();
+  for (auto& queue : mQueues) {
+    queue->jobs.clear();
+  }
+  mQueuedCount = 0;
+}
+
+uint32_t JobSystem::GetWorkerCount() const {
+  return static_cast<uint32_t>(mWorkers.size());
+}
+
+uint32_t JobSystem::GetDefaultWorkerCount() {
+  // hardware_concurrency() returns 0 when it can't tell.
+  const uint32_t coreCount = std::thread::hardware_concurrency();
+  return coreCount > 1 ? coreCount - 1 : 0;
+}
+
+JobSystem::JobHandle JobSystem::Schedule(const std::function<void()>& aTask,
+                                         const std::vector<JobHandle>& aDependencies) {
+  JobHandle job = std::make_shared<Job>();
+  job->task = aTask;
+  job->pendingCount = 1;
+  job->finished = false;
+
+  for (const auto& dependency : aDependencies) {
+    std::lock_guard<std::mutex> guard(dependency->lock);
+    if (!dependency->finished) {
+      ++job->pendingCount;
+      dependency->dependents.push_back(job);
+    }
+  }
+
+  // The dependencies might all have completed while we registered.
+  if (--job->pendingCount == 0) {
+    Enqueue(job);
+  }
+  return job;
+}
+
+bool JobSystem::IsComplete(const JobHandle& aJob) const {
+  return aJob->finished;
+}
+
+void JobSystem::Wait(const JobHandle& aJob) {
+  const uint32_t queueIndex = GetQueueIndex();
+  while (!IsComplete(aJob)) {
+    JobHandle job = Dequeue(queueIndex);
+    if (job) {
+      Execute(job);
+    } else {
+      std::this_thread::yield();
+    }
+  }
+}
+
+void JobSystem::ParallelFor(uint32_t aCount, uint32_t aBatchSize,
+                            const std::function<void(uint32_t aBegin, uint32_t aEnd)>& aTask) {
+  aBatchSize = std::max(aBatchSize, 1u);
+  std::vector<JobHandle> jobs;
+  jobs.reserve((aCount + aBatchSize - 1) / aBatchSize);
+  for (uint32_t begin = 0; begin < aCount; begin += aBatchSize) {
+    const uint32_t end = std::min(aCount, begin + aBatchSize);
+    // |aTask| outlives the jobs as we wait for them below.
+    jobs.push_back(Schedule([&aTask, begin, end]() {
+      aTask(begin, end);
+    }));
+  }
+  for (const auto& job : jobs) {
+    Wait(job);
+  }
+}
+
+void JobSystem::WorkerLoop(uint32_t aQueueIndex) {
+  tJobSystem = this;
+  tQueueIndex = aQueueIndex;
+
+  while (mRunning) {
+    JobHandle job = Dequeue(aQueueIndex);
+    if (job) {
+      Execute(job);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(mSleepLock);
+    mWakeUp.wait(lock, [this]() {
+      return mQueuedCount > 0 || !mRunning;
+    });
+  }
+}
+
+uint32_t JobSystem::GetQueueIndex() const {
+  return tJobSystem == this ? tQueueIndex : static_cast<uint32_t>(mWorkers.size());
+}
+
+void JobSystem::Enqueue(const JobHandle& aJob) {
+  WorkQueue& queue = *mQueues[GetQueueIndex()];
+  {
+    std::lock_guard<std::mutex> guard(queue.lock);
+    queue.jobs.push_back(aJob);
+  }
+
+  // Count it before taking the sleep lock, so a worker can't miss it between
+  // checking the count and going to sleep.
+  ++mQueuedCount;
+  {
+    std::lock_guard<std::mutex> guard(mSleepLock);
+  }
+  mWakeUp.notify_one();
+}
+
+JobSystem::JobHandle JobSystem::Dequeue(uint32_t aQueueIndex) {
+  JobHandle job;
+  // The newest job of our own queue first, its data is likely still in cache.
+  {
+    WorkQueue& queue = *mQueues[aQueueIndex];
+    std::lock_guard<std::mutex> guard(queue.lock);
+    if (queue.jobs.size()) {
+      job = queue.jobs.back();
+      queue.jobs.pop_back();
+    }
+  }
+
+  // Then steal the oldest job of the others.
+  const uint32_t queueCount = static_cast<uint32_t>(mQueues.size());
+  for (uint32_t i = 1; !job && i < queueCount; i++) {
+    WorkQueue& queue = *mQueues[(aQueueIndex + i) % queueCount];
+    std::lock_guard<std::mutex> guard(queue.lock);
+    if (queue.jobs.size()) {
+      job = queue.jobs.front();
+      queue.jobs.pop_front();
+    }
+  }
+
+  if (job) {
+    --mQueuedCount;
+  }
+  return job;
+}
+
+void JobSystem::Execute(const JobHandle& aJob) {
+  aJob->task();
+
+  std::vector<JobHandle> dependents;
+  {
+    std::lock_guard<std::mutex> guard(aJob->lock);
+    aJob->finished = true;
+    dependents.swap(aJob->dependents);
+  }
+  for (const auto& dependent : dependents) {
+    if (--dependent->pendingCount == 0) {
+      Enqueue(dependent);
+    }
+  }
+}
@@ -0,0 +1,66 @@
+#ifndef VULKANANDROID_COMMONUTILS_JOBSYSTEM_H
+#define VULKANANDROID_COMMONUTILS_JOBSYSTEM_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A work-stealing task scheduler. Every worker pushes and pops the jobs it
+// schedules at the back of its own deque, and steals from the front of the
+// others' when it runs out, so big and little cores balance themselves.
+// Threads outside of the scheduler share one more deque, and help running
+// jobs while they Wait().
+class JobSystem {
+public:
+  struct Job;
+  typedef std::shared_ptr<Job> JobHandle;
+
+  JobSystem();
+  ~JobSystem();
+  // With 0 workers, jobs run on the threads calling Wait().
+  void Init(uint32_t aWorkerCount = GetDefaultWorkerCount());
+  // Stops the workers, jobs which haven't started are dropped.
+  void Terminate();
+  uint32_t GetWorkerCount() const;
+  // One worker per core, the calling thread being the last one.
+  static uint32_t GetDefaultWorkerCount();
+
+  // Runs |aTask| once all of |aDependencies| have completed.
+  JobHandle Schedule(const std::function<void()>& aTask,
+                     const std::vector<JobHandle>& aDependencies = std::vector<JobHandle>());
+  bool IsComplete(const JobHandle& aJob) const;
+  // Runs other jobs until |aJob| completes, so jobs can wait on jobs too.
+  void Wait(const JobHandle& aJob);
+  // Calls |aTask| on the batches of |aBatchSize| indices of [0, aCount) in
+  // parallel, and returns once all of them are done.
+  void ParallelFor(uint32_t aCount, uint32_t aBatchSize,
+                   const std::function<void(uint32_t aBegin, uint32_t aEnd)>& aTask);
+
+private:
+  struct WorkQueue {
+    std::mutex lock;
+    std::deque<JobHandle> jobs;
+  };
+
+  void WorkerLoop(uint32_t aQueueIndex);
+  uint32_t GetQueueIndex() const;
+  void Enqueue(const JobHandle& aJob);
+  JobHandle Dequeue(uint32_t aQueueIndex);
+  void Execute(const JobHandle& aJob);
+
+  // One queue per worker, followed by the one of the other threads.
+  std::vector<std::unique_ptr<WorkQueue>> mQueues;
+  std::vector<std::thread> mWorkers;
+  std::mutex mSleepLock;
+  std::condition_variable mWakeUp;
+  std::atomic<int32_t> mQueuedCount;
+  std::atomic<bool> mRunning;
+};
+
+#endif //VULKANANDROID_COMMONUTILS_JOBSYSTEM_H
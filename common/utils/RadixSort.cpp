@@ -0,0 +1,45 @@
+#include "RadixSort.h"
+
+#include <cassert>
+#include <cstddef>
+
+void RadixSort::Sort(std::vector<uint64_t>& aKeys, std::vector<uint32_t>& aValues) {
+  assert(aKeys.size() == aValues.size());
+  const size_t count = aKeys.size();
+  if (count < 2) {
+    return;
+  }
+
+  // Count all the passes at once.
+  uint32_t histograms[8][256] = {};
+  for (size_t i = 0; i < count; i++) {
+    const uint64_t key = aKeys[i];
+    for (int pass = 0; pass < 8; pass++) {
+      ++histograms[pass][(key >> (pass * 8)) & 0xFF];
+    }
+  }
+
+  mKeys.resize(count);
+  mValues.resize(count);
+  for (int pass = 0; pass < 8; pass++) {
+    uint32_t* histogram = histograms[pass];
+    const int shift = pass * 8;
+    if (histogram[(aKeys[0] >> shift) & 0xFF] == count) {
+      continue;
+    }
+
+    uint32_t offset = 0;
+    for (int digit = 0; digit < 256; digit++) {
+      const uint32_t digitCount = histogram[digit];
+      histogram[digit] = offset;
+      offset += digitCount;
+    }
+    for (size_t i = 0; i < count; i++) {
+      const uint32_t index = histogram[(aKeys[i] >> shift) & 0xFF]++;
+      mKeys[index] = aKeys[i];
+      mValues[index] = aValues[i];
+    }
+    aKeys.swap(mKeys);
+    aValues.swap(mValues);
+  }
+}
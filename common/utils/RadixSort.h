@@ -0,0 +1,20 @@
+#ifndef VULKANANDROID_COMMONUTILS_RADIXSORT_H
+#define VULKANANDROID_COMMONUTILS_RADIXSORT_H
+
+#include <cstdint>
+#include <vector>
+
+// Sorts 64-bit keys along with a value each, one byte per pass from the
+// least significant one. It is stable, and skips the bytes all the keys
+// share, so sparse keys take fewer passes. The scratch buffers are kept
+// between sorts, as the render queue is sorted every frame.
+class RadixSort {
+public:
+  void Sort(std::vector<uint64_t>& aKeys, std::vector<uint32_t>& aValues);
+
+private:
+  std::vector<uint64_t> mKeys;
+  std::vector<uint32_t> mValues;
+};
+
+#endif //VULKANANDROID_COMMONUTILS_RADIXSORT_H
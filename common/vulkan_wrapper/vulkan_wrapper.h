@@ -235,4 +235,16 @@ void VulkanLoadInstance(VkInstance aInstance);
 
 #endif
 
+#ifdef VK_KHR_get_physical_device_properties2
+// VK_KHR_get_physical_device_properties2, loaded by VulkanLoadInstance
+extern PFN_vkGetPhysicalDeviceMemoryProperties2KHR vkGetPhysicalDeviceMemoryProperties2KHR;
+extern PFN_vkGetPhysicalDeviceFeatures2KHR vkGetPhysicalDeviceFeatures2KHR;
+extern PFN_vkGetPhysicalDeviceProperties2KHR vkGetPhysicalDeviceProperties2KHR;
+#endif
+
+#ifdef VK_KHR_draw_indirect_count
+// VK_KHR_draw_indirect_count, loaded by VulkanLoadInstance
+extern PFN_vkCmdDrawIndexedIndirectCountKHR vkCmdDrawIndexedIndirectCountKHR;
+#endif
+
 #endif // VULKAN_WRAPPER_H
@@ -3,8 +3,15 @@
 //
 
 #include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <random>
 #include "Vector3d.h"
 #include "Matrix4x4.h"
+#include "JobSystem.h"
+#include "RadixSort.h"
 
 using namespace gfx_math;
 
@@ -100,3 +107,224 @@ TEST(TestMatrix4x4, basic) {
           Quaternionf(1,1,0,1), Vector3Df(1.0, 0.5, 0.5));
   ASSERT_NE(matE, matF); // TODO: We haven't known how to test it.
 }
+
+TEST(TestJobSystem, parallelFor) {
+  JobSystem jobs;
+  jobs.Init(3);
+
+  const uint32_t count = 10000;
+  std::vector<std::atomic<uint32_t>> visits(count);
+  for (auto& visit : visits) {
+    visit = 0;
+  }
+  jobs.ParallelFor(count, 64, [&visits](uint32_t aBegin, uint32_t aEnd) {
+    for (uint32_t i = aBegin; i < aEnd; i++) {
+      ++visits[i];
+    }
+  });
+  for (uint32_t i = 0; i < count; i++) {
+    ASSERT_EQ(visits[i], 1u);
+  }
+  jobs.Terminate();
+}
+
+TEST(TestJobSystem, dependencies) {
+  JobSystem jobs;
+  jobs.Init(4);
+
+  // A diamond: b and c run after a, d after both of them.
+  std::atomic<uint32_t> step(0);
+  uint32_t a = 0, b = 0, c = 0, d = 0;
+  JobSystem::JobHandle jobA = jobs.Schedule([&]() { a = ++step; });
+  JobSystem::JobHandle jobB = jobs.Schedule([&]() { b = ++step; }, {jobA});
+  JobSystem::JobHandle jobC = jobs.Schedule([&]() { c = ++step; }, {jobA});
+  JobSystem::JobHandle jobD = jobs.Schedule([&]() { d = ++step; }, {jobB, jobC});
+  jobs.Wait(jobD);
+
+  ASSERT_TRUE(jobs.IsComplete(jobA) && jobs.IsComplete(jobB) && jobs.IsComplete(jobC));
+  ASSERT_EQ(a, 1u);
+  ASSERT_GT(b, a);
+  ASSERT_GT(c, a);
+  ASSERT_EQ(d, 4u);
+  jobs.Terminate();
+}
+
+TEST(TestJobSystem, nestedJobs) {
+  JobSystem jobs;
+  jobs.Init(2);
+
+  // Jobs waiting on jobs mustn't deadlock with all the workers waiting.
+  std::atomic<uint32_t> sum(0);
+  jobs.ParallelFor(8, 1, [&jobs, &sum](uint32_t aBegin, uint32_t aEnd) {
+    jobs.ParallelFor(100, 10, [&sum](uint32_t aBegin, uint32_t aEnd) {
+      sum += aEnd - aBegin;
+    });
+  });
+  ASSERT_EQ(sum, 800u);
+  jobs.Terminate();
+}
+
+TEST(TestJobSystem, noWorkers) {
+  JobSystem jobs;
+  jobs.Init(0);
+  ASSERT_EQ(jobs.GetWorkerCount(), 0u);
+
+  bool done = false;
+  JobSystem::JobHandle job = jobs.Schedule([&done]() { done = true; });
+  ASSERT_FALSE(jobs.IsComplete(job));
+  jobs.Wait(job);
+  ASSERT_TRUE(done);
+}
+
+// Not a pass or fail test, it prints how ParallelFor scales with the workers.
+TEST(TestJobSystem, scalingBenchmark) {
+  const uint32_t count = 1 << 16;
+  std::vector<float> results(count);
+  auto work = [&results](uint32_t aBegin, uint32_t aEnd) {
+    for (uint32_t i = aBegin; i < aEnd; i++) {
+      float value = static_cast<float>(i);
+      for (int j = 0; j < 200; j++) {
+        value = std::sqrt(value + j);
+      }
+      results[i] = value;
+    }
+  };
+
+  const uint32_t maxWorkerCount = JobSystem::GetDefaultWorkerCount();
+  double baseTime = 0.0;
+  for (uint32_t workerCount = 0; ; workerCount = workerCount ? workerCount * 2 : 1) {
+    workerCount = std::min(workerCount, maxWorkerCount);
+    JobSystem jobs;
+    jobs.Init(workerCount);
+    const auto start = std::chrono::steady_clock::now();
+    jobs.ParallelFor(count, 256, work);
+    const double time = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start).count();
+    if (!workerCount) {
+      baseTime = time;
+    }
+    printf("JobSystem: %u thread(s) %.3f ms, speedup %.2fx\n",
+           workerCount + 1, time, baseTime / time);
+    if (workerCount == maxWorkerCount) {
+      break;
+    }
+  }
+}
+
+// Not a pass or fail test, it prints how recording the draws of a frame
+// scales with the threads. The draws are split as VulkanRenderer does, and
+// every thread writes its commands to a stream of its own, a stand-in for
+// its secondary command buffer.
+TEST(TestJobSystem, recordScalingBenchmark) {
+  struct Draw {
+    uint32_t pipeline;
+    uint32_t descriptorSet;
+    uint32_t indexCount;
+    Matrix4x4f transform;
+  };
+  // Sorted by state as the draw list is, a few pipelines and more sets.
+  const uint32_t drawCount = 1 << 14;
+  std::vector<Draw> draws(drawCount);
+  for (uint32_t i = 0; i < drawCount; i++) {
+    draws[i].pipeline = i / 4096;
+    draws[i].descriptorSet = i / 64;
+    draws[i].indexCount = 36;
+  }
+  const Matrix4x4f viewProj = Matrix4x4f::LookAtMatrix(Vector3Df(0, 0.5, 0.5),
+                                                       Vector3Df(0, 0.2, -1),
+                                                       Vector3Df(0, 1, 0));
+  auto record = [&draws, &viewProj](size_t aBegin, size_t aEnd, std::vector<uint32_t>& aStream) {
+    aStream.clear();
+    uint32_t boundPipeline = UINT32_MAX;
+    uint32_t boundSet = UINT32_MAX;
+    for (size_t i = aBegin; i < aEnd; i++) {
+      const Draw& draw = draws[i];
+      if (draw.pipeline != boundPipeline) {
+        aStream.push_back(draw.pipeline);
+        boundPipeline = draw.pipeline;
+      }
+      if (draw.descriptorSet != boundSet) {
+        aStream.push_back(draw.descriptorSet);
+        boundSet = draw.descriptorSet;
+      }
+      // The mvp matrix of a pushed transform.
+      const Matrix4x4f mvpMtx = viewProj * draw.transform;
+      const size_t size = aStream.size();
+      aStream.resize(size + sizeof(mvpMtx) / sizeof(uint32_t));
+      memcpy(&aStream[size], &mvpMtx, sizeof(mvpMtx));
+      aStream.push_back(draw.indexCount);
+    }
+  };
+
+  // The same split as VulkanRenderer::RecordCommandBuffer().
+  const size_t minDrawsPerThread = 64;
+  const uint32_t frameCount = 20;
+  const uint32_t maxWorkerCount = JobSystem::GetDefaultWorkerCount();
+  double baseTime = 0.0;
+  for (uint32_t workerCount = 0; ; workerCount = workerCount ? workerCount * 2 : 1) {
+    workerCount = std::min(workerCount, maxWorkerCount);
+    JobSystem jobs;
+    jobs.Init(workerCount);
+    const uint32_t threadCount = static_cast<uint32_t>(std::min<size_t>(
+        workerCount + 1, (drawCount + minDrawsPerThread - 1) / minDrawsPerThread));
+    const size_t chunkSize = (drawCount + threadCount - 1) / threadCount;
+    std::vector<std::vector<uint32_t>> streams(threadCount);
+    const auto start = std::chrono::steady_clock::now();
+    for (uint32_t frame = 0; frame < frameCount; frame++) {
+      jobs.ParallelFor(threadCount, 1, [&](uint32_t aBegin, uint32_t aEnd) {
+        for (uint32_t i = aBegin; i < aEnd; i++) {
+          const size_t begin = std::min<size_t>(i * chunkSize, drawCount);
+          record(begin, std::min<size_t>(begin + chunkSize, drawCount), streams[i]);
+        }
+      });
+    }
+    const double time = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start).count() / frameCount;
+    if (!workerCount) {
+      baseTime = time;
+    }
+    printf("Recording %u draws: %u thread(s) %.3f ms, speedup %.2fx\n",
+           drawCount, threadCount, time, baseTime / time);
+    if (workerCount == maxWorkerCount) {
+      break;
+    }
+  }
+}
+
+TEST(TestRadixSort, sortKeysAndValues) {
+  std::mt19937_64 random(7);
+  std::vector<uint64_t> keys(5000);
+  std::vector<uint32_t> values(keys.size());
+  for (uint32_t i = 0; i < keys.size(); i++) {
+    // Few distinct keys, so the stability shows.
+    keys[i] = (random() % 16) << 40 | (random() % 4);
+    values[i] = i;
+  }
+  const std::vector<uint64_t> unsortedKeys = keys;
+
+  RadixSort sorter;
+  sorter.Sort(keys, values);
+  for (uint32_t i = 0; i < keys.size(); i++) {
+    ASSERT_EQ(keys[i], unsortedKeys[values[i]]);
+    if (i) {
+      ASSERT_LE(keys[i - 1], keys[i]);
+      if (keys[i - 1] == keys[i]) {
+        ASSERT_LT(values[i - 1], values[i]);
+      }
+    }
+  }
+}
+
+TEST(TestRadixSort, sameKeys) {
+  std::vector<uint64_t> keys(100, 0x1234567890ABCDEFull);
+  std::vector<uint32_t> values(keys.size());
+  for (uint32_t i = 0; i < values.size(); i++) {
+    values[i] = i;
+  }
+
+  RadixSort sorter;
+  sorter.Sort(keys, values);
+  for (uint32_t i = 0; i < values.size(); i++) {
+    ASSERT_EQ(values[i], i);
+  }
+}